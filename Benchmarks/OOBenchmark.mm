@@ -0,0 +1,505 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import "OpenOutliner.h"
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+/**
+ * Command-line tool for measuring the performance of operations on large
+ * outlines.  Each benchmark is a separate command, run as:
+ *
+ *     OOBenchmark generate {rows} {file}
+ *     OOBenchmark {benchmark} {file} [arguments]
+ *
+ * Peak memory usage is recorded for the whole process, so benchmarks that
+ * report it should be run in separate processes on a file written by
+ * `generate`.
+ */
+namespace {
+/**
+ * The OmniOutliner 3 document type.
+ */
+NSString *const documentType = @"OmniOutliner3";
+
+/**
+ * Returns the time, in seconds, that it takes to run `aFunction`.
+ */
+double timeSeconds(const std::function<void()> &aFunction)
+{
+	auto start = std::chrono::steady_clock::now();
+	aFunction();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+/**
+ * Returns the peak resident set size of the process, in megabytes.
+ */
+double peakResidentMegabytes()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	// Darwin reports the maximum resident set size in bytes.
+	return static_cast<double>(usage.ru_maxrss) / (1024 * 1024);
+}
+
+/**
+ * Returns the number of rows in the outline, without reading deferred
+ * children.
+ */
+NSUInteger loadedRowCount(OOOutlineRow *aRow)
+{
+	NSUInteger count = 0;
+	if (![aRow deferredChildren])
+	{
+		for (OOOutlineRow *child in [aRow children])
+		{
+			count += 1 + loadedRowCount(child);
+		}
+	}
+	return count;
+}
+
+/**
+ * Constructs an outline with `aCount` rows and a text column of amounts.
+ * Every sixteenth row is at the top level and has the following fifteen rows
+ * as children.  Alternate top-level rows are collapsed, so their children are
+ * deferred when the document is loaded.
+ */
+OOOutlineDocument *generateOutline(NSUInteger aCount)
+{
+	NSError *e;
+	auto *doc = [[OOOutlineDocument alloc] initWithType: documentType error: &e];
+	[[doc undoManager] disableUndoRegistration];
+	OOOutlineColumn *topic = [doc.columns firstObject];
+	auto *amount = [[OOOutlineColumn alloc] initWithType: OOOutlineColumnTypeText
+	                                          inDocument: doc];
+	[doc addColumn: amount];
+	OOOutlineRow *parent = nil;
+	for (NSUInteger i=0 ; i<aCount ; i++)
+	{
+		auto *row = [[OOOutlineRow alloc] initInDocument: doc];
+		NSString *title = [NSString stringWithFormat: @"Row %lu", (unsigned long)i];
+		NSString *value = [NSString stringWithFormat: @"%lu.%02lu",
+		                   (unsigned long)(i % 1000), (unsigned long)(i % 100)];
+		[row setValue: [[OOOutlineValue alloc] initWithValue: title inColumn: topic]
+		       inSlot: topic.slot];
+		[row setValue: [[OOOutlineValue alloc] initWithValue: value inColumn: amount]
+		       inSlot: amount.slot];
+		if ((i % 16) == 0)
+		{
+			row.isExpanded = ((i / 16) % 2) == 0;
+			[doc.root.children addObject: row];
+			parent = row;
+		}
+		else
+		{
+			[parent.children addObject: row];
+		}
+	}
+	[[doc undoManager] enableUndoRegistration];
+	return doc;
+}
+
+/**
+ * Loads the document at `aURL` with the streaming reader, which the
+ * application uses.
+ */
+OOOutlineDocument *loadOutline(NSURL *aURL)
+{
+	auto *doc = [OOOutlineDocument new];
+	NSError *e;
+	if (![doc readFromURL: aURL ofType: documentType error: &e])
+	{
+		fprintf(stderr, "Unable to read %s: %s\n", [[aURL path] UTF8String],
+		        [[e description] UTF8String]);
+		exit(EXIT_FAILURE);
+	}
+	return doc;
+}
+
+/**
+ * Writes a generated outline with the number of rows given by the first
+ * argument to the document bundle named by the second.
+ */
+int generate(NSArray<NSString*> *args)
+{
+	NSUInteger count = static_cast<NSUInteger>([[args objectAtIndex: 0] integerValue]);
+	NSURL *url = [NSURL fileURLWithPath: [args objectAtIndex: 1]];
+	OOOutlineDocument *doc = generateOutline(count);
+	NSError *e;
+	NSFileWrapper *wrapper = [doc fileWrapperOfType: documentType error: &e];
+	if (![wrapper writeToURL: url
+	                 options: NSFileWrapperWritingAtomic
+	     originalContentsURL: nil
+	                   error: &e])
+	{
+		fprintf(stderr, "Unable to write %s: %s\n", [[url path] UTF8String],
+		        [[e description] UTF8String]);
+		return EXIT_FAILURE;
+	}
+	printf("Wrote %lu rows to %s\n", (unsigned long)count, [[url path] UTF8String]);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Loads the document named by the first argument with the streaming reader,
+ * and reports the time taken and the peak memory usage.
+ */
+int load(NSArray<NSString*> *args)
+{
+	NSURL *url = [NSURL fileURLWithPath: [args objectAtIndex: 0]];
+	OOOutlineDocument *doc;
+	double seconds = timeSeconds([&]() { doc = loadOutline(url); });
+	printf("Streaming load: %lu rows read in %.3fs, peak RSS %.1fMB\n",
+	       (unsigned long)loadedRowCount(doc.root), seconds, peakResidentMegabytes());
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Loads the document named by the first argument by parsing it into an
+ * `NSXMLDocument` and constructing the rows from the tree, as documents were
+ * loaded before the streaming reader.  The tree and the rows are both in
+ * memory while the rows are constructed.  Reports the time taken and the
+ * peak memory usage.
+ */
+int loadDOM(NSArray<NSString*> *args)
+{
+	NSURL *url = [NSURL fileURLWithPath: [args objectAtIndex: 0]];
+	OOOutlineDocument *doc;
+	double seconds = timeSeconds([&]()
+		{
+			NSError *e;
+			NSData *data = [NSData dataWithContentsOfURL: [url URLByAppendingPathComponent: @"contents.xml"]
+			                                     options: 0
+			                                       error: &e];
+			if ([data isGzippedData])
+			{
+				data = [data gunzippedData];
+			}
+			auto *xml = [[NSXMLDocument alloc] initWithData: data options: 0 error: &e];
+			if (!xml)
+			{
+				fprintf(stderr, "Unable to parse %s: %s\n", [[url path] UTF8String],
+				        [[e description] UTF8String]);
+				exit(EXIT_FAILURE);
+			}
+			// Read the columns and styles from the document without its rows.
+			NSXMLElement *rootElement = [[xml rootElement] elementForName: @"root"];
+			[rootElement detach];
+			auto *contents = [[NSFileWrapper alloc] initRegularFileWithContents: [xml XMLData]];
+			auto *bundle = [[NSFileWrapper alloc] initDirectoryWithFileWrappers: @{ @"contents.xml" : contents }];
+			doc = [OOOutlineDocument new];
+			if (![doc readFromFileWrapper: bundle ofType: documentType error: &e])
+			{
+				fprintf(stderr, "Unable to read the header of %s: %s\n",
+				        [[url path] UTF8String], [[e description] UTF8String]);
+				exit(EXIT_FAILURE);
+			}
+			NSMutableArray<OOOutlineRow*> *children = doc.root.children;
+			for (NSXMLElement *item in [rootElement elementsForName: @"item"])
+			{
+				[children addObject: [[OOOutlineRow alloc] initWithOO3XMLNode: item
+				                                                   inDocument: doc]];
+			}
+		});
+	printf("DOM load: %lu rows read in %.3fs, peak RSS %.1fMB\n",
+	       (unsigned long)loadedRowCount(doc.root), seconds, peakResidentMegabytes());
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Returns up to `aCount` rows, spread evenly through the rows that are
+ * visible in the outline, that are not the first child of their parent and
+ * so can be indented.
+ */
+NSArray<OOOutlineRow*> *indentableRows(OOOutlineDocument *aDocument, NSUInteger aCount)
+{
+	NSMutableArray<OOOutlineRow*> *candidates = [NSMutableArray new];
+	std::function<void(OOOutlineRow*)> visit = [&](OOOutlineRow *aRow)
+		{
+			NSUInteger idx = 0;
+			for (OOOutlineRow *child in [aRow children])
+			{
+				if (idx++ > 0)
+				{
+					[candidates addObject: child];
+				}
+				if (child.isExpanded)
+				{
+					visit(child);
+				}
+			}
+		};
+	visit(aDocument.root);
+	NSUInteger stride = std::max<NSUInteger>(1, [candidates count] / std::max<NSUInteger>(1, aCount));
+	NSMutableArray<OOOutlineRow*> *rows = [NSMutableArray new];
+	for (NSUInteger i=0 ; (i<[candidates count]) && ([rows count]<aCount) ; i+=stride)
+	{
+		[rows addObject: [candidates objectAtIndex: i]];
+	}
+	return rows;
+}
+
+/**
+ * Returns the rows in `someRows` that do not have an ancestor in `someRows`,
+ * as `-[OOOutlineDataSource increaseIndentLevel:]` and
+ * `-decreaseIndentLevel:` do with the selection.
+ */
+NSArray<OOOutlineRow*> *rowsExcludingChildren(NSArray<OOOutlineRow*> *someRows)
+{
+	NSMutableSet<OOOutlineRow*> *rowSet = [NSMutableSet setWithArray: someRows];
+	NSMutableArray<OOOutlineRow*> *rows = [NSMutableArray new];
+	for (OOOutlineRow *row in someRows)
+	{
+		OOOutlineRow *parent = row;
+		BOOL hasSelectedAncestor = NO;
+		while ((parent = parent.parent))
+		{
+			if ([rowSet containsObject: parent])
+			{
+				hasSelectedAncestor = YES;
+				break;
+			}
+		}
+		if (!hasSelectedAncestor)
+		{
+			[rows addObject: row];
+		}
+	}
+	return rows;
+}
+
+/**
+ * Indents the rows, making the same changes to the model as
+ * `-[OOOutlineDataSource increaseIndentLevel:]` does, without updating a view.
+ */
+void indentRows(OOOutlineDocument *aDocument, NSArray<OOOutlineRow*> *someRows)
+{
+	scoped_undo_grouping undo([aDocument undoManager], @"indent");
+	for (OOOutlineRow *row in rowsExcludingChildren(someRows))
+	{
+		OOOutlineRow *parent = row.parent;
+		NSUInteger idx = row.indexInParent;
+		if (idx == 0)
+		{
+			continue;
+		}
+		OOOutlineRow *newParent = [parent.children objectAtIndex: idx-1];
+		[undo.record(parent.children) insertObject: row atIndex: idx];
+		[undo.record(newParent.children) removeObjectAtIndex: [newParent.children count]];
+		[newParent.children addObject: row];
+		[parent.children removeObjectAtIndex: idx];
+		if (!newParent.isExpanded)
+		{
+			[undo.record(newParent) setIsExpanded: NO];
+			[newParent setIsExpanded: YES];
+		}
+	}
+}
+
+/**
+ * Outdents the rows, making the same changes to the model as
+ * `-[OOOutlineDataSource decreaseIndentLevel:]` does, without updating a view.
+ */
+void outdentRows(OOOutlineDocument *aDocument, NSArray<OOOutlineRow*> *someRows)
+{
+	scoped_undo_grouping undo([aDocument undoManager], @"unindent");
+	for (OOOutlineRow *row in rowsExcludingChildren(someRows))
+	{
+		OOOutlineRow *parent = row.parent;
+		OOOutlineRow *grandparent = parent.parent;
+		if (grandparent == nil)
+		{
+			continue;
+		}
+		NSUInteger newIdx = parent.indexInParent + 1;
+		NSUInteger oldIdx = row.indexInParent;
+		[undo.record(parent.children) insertObject: row atIndex: oldIdx];
+		[undo.record(grandparent.children) removeObjectAtIndex: newIdx];
+		[grandparent.children insertObject: row atIndex: newIdx];
+		[parent.children removeObjectAtIndex: oldIdx];
+	}
+}
+
+/**
+ * Loads the document named by the first argument, then indents and outdents
+ * the number of rows given by the second argument, or 1000 rows, and reports
+ * the time taken by each.
+ */
+int indent(NSArray<NSString*> *args)
+{
+	OOOutlineDocument *doc = loadOutline([NSURL fileURLWithPath: [args objectAtIndex: 0]]);
+	NSUInteger count = ([args count] > 1) ? static_cast<NSUInteger>([[args objectAtIndex: 1] integerValue]) : 1000;
+	NSArray<OOOutlineRow*> *rows = indentableRows(doc, count);
+	double indentSeconds = timeSeconds([&]() { indentRows(doc, rows); });
+	double outdentSeconds = timeSeconds([&]() { outdentRows(doc, rows); });
+	printf("Indented %lu rows of %lu in %.3fs, outdented in %.3fs\n",
+	       (unsigned long)[rows count], (unsigned long)loadedRowCount(doc.root),
+	       indentSeconds, outdentSeconds);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Loads the document named by the first argument, serialises its contents
+ * without compression, and reports the throughput of compressing them with
+ * 1, 2, 4, and so on up to the number of active cores.  The optional second
+ * argument is the compression level, in the range 0 to 1.  Each thread count
+ * reports the best of three runs.
+ */
+int gzip(NSArray<NSString*> *args)
+{
+	OOOutlineDocument *doc = loadOutline([NSURL fileURLWithPath: [args objectAtIndex: 0]]);
+	float level = ([args count] > 1) ? [[args objectAtIndex: 1] floatValue] : -1;
+	doc.compressesContents = NO;
+	NSError *e;
+	NSFileWrapper *wrapper = [doc fileWrapperOfType: documentType error: &e];
+	NSData *contents = [[wrapper.fileWrappers objectForKey: @"contents.xml"] regularFileContents];
+	if (!contents)
+	{
+		fprintf(stderr, "Unable to serialise the document: %s\n", [[e description] UTF8String]);
+		return EXIT_FAILURE;
+	}
+	double megabytes = static_cast<double>([contents length]) / (1024 * 1024);
+	NSUInteger cores = [[NSProcessInfo processInfo] activeProcessorCount];
+	for (NSUInteger threads = 1 ; ; threads = std::min(threads * 2, cores))
+	{
+		double best = INFINITY;
+		NSUInteger compressedLength = 0;
+		for (int run=0 ; run<3 ; run++)
+		{
+			best = std::min(best, timeSeconds([&]()
+				{
+					compressedLength = [[contents parallelGzippedDataWithCompressionLevel: level
+					                                                          threadCount: threads] length];
+				}));
+		}
+		printf("%2lu threads: %.1fMB compressed to %.1fMB at %.1fMB/s\n",
+		       (unsigned long)threads, megabytes,
+		       static_cast<double>(compressedLength) / (1024 * 1024), megabytes / best);
+		if (threads == cores)
+		{
+			break;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Loads the document named by the first argument and changes the type of its
+ * last column, the amounts in a generated outline, from text to number.
+ * Reports the time taken to load the document and to convert the column.
+ */
+int columnType(NSArray<NSString*> *args)
+{
+	NSURL *url = [NSURL fileURLWithPath: [args objectAtIndex: 0]];
+	OOOutlineDocument *doc;
+	double loadSeconds = timeSeconds([&]() { doc = loadOutline(url); });
+	OOOutlineColumn *column = [doc.columns lastObject];
+	double convertSeconds = timeSeconds([&]() { column.columnType = OOOutlineColumnTypeNumber; });
+	printf("Loaded in %.3fs, converted %lu rows to numbers in %.3fs\n",
+	       loadSeconds, (unsigned long)loadedRowCount(doc.root), convertSeconds);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * A benchmark command.
+ */
+struct benchmark
+{
+	/**
+	 * The name of the command.
+	 */
+	const char *name;
+	/**
+	 * The arguments that the command takes, for the usage message.
+	 */
+	const char *arguments;
+	/**
+	 * The number of arguments that the command requires.
+	 */
+	NSUInteger requiredArguments;
+	/**
+	 * The function that runs the command with the remaining arguments and
+	 * returns the exit status.
+	 */
+	int (*run)(NSArray<NSString*> *);
+};
+
+/**
+ * The benchmarks, in the order in which they are listed in the usage
+ * message.
+ */
+const benchmark benchmarks[] = {
+	{ "generate", "{rows} {file}", 2, generate },
+	{ "load", "{file}", 1, load },
+	{ "load-dom", "{file}", 1, loadDOM },
+	{ "indent", "{file} [rows]", 1, indent },
+	{ "gzip", "{file} [level]", 1, gzip },
+	{ "column-type", "{file}", 1, columnType },
+};
+}
+
+int main(int argc, const char *argv[])
+{
+	@autoreleasepool
+	{
+		// Documents use AppKit, which expects an application object.
+		[NSApplication sharedApplication];
+		if (argc >= 2)
+		{
+			NSMutableArray<NSString*> *args = [NSMutableArray new];
+			for (int i=2 ; i<argc ; i++)
+			{
+				[args addObject: [NSString stringWithUTF8String: argv[i]]];
+			}
+			for (const benchmark &b : benchmarks)
+			{
+				if (strcmp(argv[1], b.name) != 0)
+				{
+					continue;
+				}
+				if ([args count] < b.requiredArguments)
+				{
+					fprintf(stderr, "Usage: %s %s %s\n", argv[0], b.name, b.arguments);
+					return EXIT_FAILURE;
+				}
+				return b.run(args);
+			}
+		}
+		fprintf(stderr, "Usage: %s {benchmark} [arguments]\nBenchmarks:\n", argv[0]);
+		for (const benchmark &b : benchmarks)
+		{
+			fprintf(stderr, "\t%s %s\n", b.name, b.arguments);
+		}
+		return EXIT_FAILURE;
+	}
+}
@@ -28,6 +28,7 @@
 #import <Foundation/Foundation.h>
 
 @class OOPartialStyle;
+@class OOXMLWriter;
 
 /**
  * Extensions to `NSAttributedString` for transforming to and from OmniOutliner
@@ -53,4 +54,10 @@
  * Style elements present in `aPartialStyle` are not emitted as XML.
  */
 - (NSXMLElement*)oo3xmlValueWithPartialStyle: (OOPartialStyle*)aPartialStyle;
+/**
+ * Write the OmniOutliner 3 XML representation of this attributed string.
+ * Style elements present in `aPartialStyle` are not emitted.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+   withPartialStyle: (OOPartialStyle*)aPartialStyle;
 @end
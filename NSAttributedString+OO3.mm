@@ -89,10 +89,17 @@
 }
 - (NSXMLElement*)oo3xmlValueWithPartialStyle: (OOPartialStyle*)aPartialStyle
 {
-	NSXMLElement *text = [NSXMLElement elementWithName: @"text"];
+	return [OOXMLWriter elementByWriting: ^(OOXMLWriter *w) {
+		[self writeOO3XML: w withPartialStyle: aPartialStyle];
+	}];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+   withPartialStyle: (OOPartialStyle*)aPartialStyle
+{
 	NSUInteger i = 0;
 	NSUInteger len = [self length];
 	NSString *str = [self string];
+	[aWriter startElement: @"text"];
 	do {
 		NSRange searchRange = { i, 0 };
 		NSUInteger start;
@@ -101,7 +108,7 @@
 		                   end: &end
 		           contentsEnd: nullptr
 		              forRange: searchRange];
-		NSXMLElement *p = [NSXMLElement elementWithName: @"p"];
+		[aWriter startElement: @"p"];
 		while (start < end)
 		{
 			NSRange r;
@@ -109,39 +116,35 @@
 			r.length = std::min(r.length, end-start);
 			if (r.length > 0)
 			{
-				NSXMLElement *run = [NSXMLElement elementWithName: @"run"];
-				NSXMLElement *lit = [NSXMLElement elementWithName: @"lit"
-				                                      stringValue: [str substringWithRange: r]];
+				NSString *litText = [str substringWithRange: r];
+				[aWriter startElement: @"run"];
 				// FIXME: Recalculate the style if it's changed.
 				// FIXME: Get a partial style that this should inherit from if we don't have one.
 				OOPartialStyle *ps = [attrs objectForKey: OOPartialStyleKey];
-				NSXMLElement *style = [ps oo3xmlValue];
-				if (style)
+				[ps writeOO3XML: aWriter];
+				if (NSURL *href = [attrs objectForKey: NSLinkAttributeName])
 				{
-					[run addChild: style];
+					[aWriter startElement: @"lit"];
+					[aWriter startElement: @"cell"];
+					[aWriter addAttribute: [href absoluteString] withName: @"href"];
+					[aWriter addAttribute: litText withName: @"name"];
+					[aWriter endElement];
+					[aWriter endElement];
 				}
-				if (NSURL *href = [attrs objectForKey: NSLinkAttributeName])
+				else
 				{
-					auto *cell = [NSXMLElement elementWithName: @"cell"
-					                      attributesDictionary: @{
-					                                                @"href" : [href absoluteString],
-					                                                @"name" : [str substringWithRange: r]
-					                                             }];
-					lit = [NSXMLElement elementWithName: @"lit"];
-					[lit addChild: cell];
+					// FIXME: Create cell nodes for other attachments
+					[aWriter addElement: @"lit" withText: litText];
 				}
-				// FIXME: Create cell nodes for links and so on
-				[run addChild: lit];
 				// FIXME: Turn the attributes into a <style> element here
-				(void)attrs;
-				[p addChild: run];
+				[aWriter endElement];
 			}
 			start += r.length;
 		}
 		i = end;
-		[text addChild: p];
+		[aWriter endElement];
 	} while (i < len);
-	return text;
+	[aWriter endElement];
 }
 
 
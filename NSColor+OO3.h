@@ -27,6 +27,8 @@
 
 #import <Cocoa/Cocoa.h>
 
+@class OOXMLWriter;
+
 /**
  * Extensions to `NSColor` to allow serialising and deserialising as
  * OmniOutliner 3 XML.  This format defines `<color>` elements that encode
@@ -41,4 +43,8 @@
  * Generate a `<color>` element encoding this color data.
  */
 - (NSXMLElement*)oo3xmlValue;
+/**
+ * Write a `<color>` element encoding this color data.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter;
 @end
@@ -81,53 +81,56 @@
 	return nil;
 }
 - (NSXMLElement*)oo3xmlValue
+{
+	return [OOXMLWriter elementByWriting: ^(OOXMLWriter *w) { [self writeOO3XML: w]; }];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
 {
 	NSColorSpace *cs = [self colorSpace];
-	NSXMLElement *xml = [NSXMLElement elementWithName: @"color"];
 	NSColor *c = self;
 	auto setAttr = [&](NSString *name, CGFloat val)
 		{
-			[xml addAttribute: [NSString stringWithFormat: @"%lf", (double)val]
-			         withName: name];
+			[aWriter addAttribute: [NSString stringWithFormat: @"%lf", (double)val]
+			             withName: name];
 		};
 	auto addAlpha = [&]()
 		{
 			CGFloat a = [self alphaComponent];
 			if (a != 1)
 			{
-			    [xml addAttribute: [NSString stringWithFormat: @"%lf", (double)a]
-			             withName: @"a"];
+			    [aWriter addAttribute: [NSString stringWithFormat: @"%lf", (double)a]
+			                 withName: @"a"];
 			}
 		};
 
+	[aWriter startElement: @"color"];
 	switch ([cs colorSpaceModel])
 	{
 		case NSColorSpaceModelGray:
 			setAttr(@"w", [self whiteComponent]);
 			addAlpha();
-			return xml;
+			break;
 		case NSColorSpaceModelCMYK:
 			setAttr(@"c", [self cyanComponent]);
 			setAttr(@"m", [self magentaComponent]);
 			setAttr(@"y", [self yellowComponent]);
 			setAttr(@"k", [self blackComponent]);
 			addAlpha();
-			return xml;
+			break;
 		default:
 			c = [self colorUsingColorSpace: [NSColorSpace sRGBColorSpace]];
 		case NSColorSpaceModelRGB:
 			if (cs == [NSColorSpace sRGBColorSpace])
 			{
-				[xml addAttribute: @"srgb"
-				         withName: @"space"];
+				[aWriter addAttribute: @"srgb"
+				             withName: @"space"];
 			}
 			setAttr(@"r", [c redComponent]);
 			setAttr(@"g", [c greenComponent]);
 			setAttr(@"b", [c blueComponent]);
 			addAlpha();
-			return xml;
+			break;
 	}
-
-	return nil;
+	[aWriter endElement];
 }
 @end
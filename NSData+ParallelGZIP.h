@@ -0,0 +1,50 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Parallel gzip compression.
+ */
+@interface NSData (ParallelGZIP)
+/**
+ * Returns the data compressed as a single gzip member, compressing blocks of
+ * the data concurrently.  Each block is primed with the preceding 32KB of
+ * input, so the compression ratio is close to that of compressing the data
+ * in one pass.  The compression level is in the range 0 to 1, or negative for
+ * zlib's default level.  The result can be read by any gzip implementation.
+ * Returns `nil` if zlib fails to compress any of the blocks.
+ */
+- (nullable NSData*)parallelGzippedDataWithCompressionLevel: (float)level;
+/**
+ * Returns the data compressed as by
+ * `-parallelGzippedDataWithCompressionLevel:`, compressing at most `aCount`
+ * blocks concurrently.  The output does not depend on the thread count.
+ */
+- (nullable NSData*)parallelGzippedDataWithCompressionLevel: (float)level
+                                                threadCount: (NSUInteger)aCount;
+@end
@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import "NSData+ParallelGZIP.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+/**
+ * The size of the blocks that are compressed independently.
+ */
+const NSUInteger blockSize = 128 * 1024;
+/**
+ * The size of the deflate window, and so the amount of preceding input that
+ * is used as the dictionary for each block.
+ */
+const NSUInteger windowSize = 32 * 1024;
+/**
+ * The compressed form of a block.
+ */
+struct compressed_block
+{
+	/**
+	 * The deflate stream for the block.
+	 */
+	std::vector<uint8_t> data;
+	/**
+	 * The CRC32 of the uncompressed block.
+	 */
+	uLong crc;
+	/**
+	 * The length of the uncompressed block.
+	 */
+	NSUInteger length;
+	/**
+	 * Flag indicating whether the block was compressed successfully.
+	 */
+	bool isValid;
+};
+/**
+ * Append a 32-bit little-endian integer to the data.
+ */
+void appendLittleEndian32(NSMutableData *aData, uint32_t aValue)
+{
+	uint8_t bytes[] = {
+		static_cast<uint8_t>(aValue),
+		static_cast<uint8_t>(aValue >> 8),
+		static_cast<uint8_t>(aValue >> 16),
+		static_cast<uint8_t>(aValue >> 24)
+	};
+	[aData appendBytes: bytes length: sizeof(bytes)];
+}
+/**
+ * Compress block `i` of `blockCount` blocks of the input into `block`.
+ *
+ * Each block is a sequence of raw deflate blocks.  All except the last end
+ * with a sync flush, so that they end on a byte boundary and can be
+ * concatenated to form a single deflate stream.
+ */
+void compressBlock(compressed_block &block,
+                   const uint8_t *bytes,
+                   NSUInteger length,
+                   NSUInteger i,
+                   NSUInteger blockCount,
+                   int compression)
+{
+	NSUInteger start = i * blockSize;
+	NSUInteger len = std::min(blockSize, length - start);
+	bool isLast = (i == blockCount - 1);
+	z_stream stream = {};
+	if (deflateInit2(&stream, compression, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return;
+	}
+	if (start > 0)
+	{
+		NSUInteger dictLen = std::min(windowSize, start);
+		if (deflateSetDictionary(&stream, bytes + start - dictLen, static_cast<uInt>(dictLen)) != Z_OK)
+		{
+			deflateEnd(&stream);
+			return;
+		}
+	}
+	// The bound covers finishing the stream; the sync flush marker needs
+	// a few more bytes.
+	block.data.resize(deflateBound(&stream, static_cast<uLong>(len)) + 16);
+	stream.next_in = const_cast<Bytef*>(bytes + start);
+	stream.avail_in = static_cast<uInt>(len);
+	stream.next_out = block.data.data();
+	stream.avail_out = static_cast<uInt>(block.data.size());
+	int status = deflate(&stream, isLast ? Z_FINISH : Z_SYNC_FLUSH);
+	block.isValid = (status == (isLast ? Z_STREAM_END : Z_OK)) && (stream.avail_in == 0);
+	block.data.resize(block.data.size() - stream.avail_out);
+	deflateEnd(&stream);
+	block.crc = crc32(crc32(0, nullptr, 0), bytes + start, static_cast<uInt>(len));
+	block.length = len;
+}
+}
+
+@implementation NSData (ParallelGZIP)
+- (NSData*)parallelGzippedDataWithCompressionLevel: (float)level
+{
+	return [self parallelGzippedDataWithCompressionLevel: level
+	                                         threadCount: [[NSProcessInfo processInfo] activeProcessorCount]];
+}
+- (NSData*)parallelGzippedDataWithCompressionLevel: (float)level
+                                       threadCount: (NSUInteger)aCount
+{
+	int compression = (level < 0.0f) ? Z_DEFAULT_COMPRESSION : static_cast<int>(roundf(level * 9));
+	const uint8_t *bytes = static_cast<const uint8_t*>([self bytes]);
+	NSUInteger length = [self length];
+	NSUInteger blockCount = std::max<NSUInteger>(1, (length + blockSize - 1) / blockSize);
+	std::vector<compressed_block> blocks(blockCount);
+	// Each worker takes the next uncompressed block until none are left, so
+	// at most `aCount` blocks are compressed at once.  The block captures
+	// pointers, because it would otherwise capture const copies.
+	std::atomic<NSUInteger> nextBlock(0);
+	std::atomic<NSUInteger> *next = &nextBlock;
+	compressed_block *compressed = blocks.data();
+	NSUInteger workers = std::max<NSUInteger>(1, std::min(aCount, blockCount));
+	dispatch_apply(workers, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t) {
+		for (NSUInteger i = (*next)++ ; i < blockCount ; i = (*next)++)
+		{
+			compressBlock(compressed[i], bytes, length, i, blockCount, compression);
+		}
+	});
+	NSUInteger compressedLength = 18;
+	for (auto &block : blocks)
+	{
+		if (!block.isValid)
+		{
+			return nil;
+		}
+		compressedLength += block.data.size();
+	}
+	NSMutableData *output = [NSMutableData dataWithCapacity: compressedLength];
+	// Header: magic, deflate, no flags, no modification time, no extra flags,
+	// Unix.
+	static const uint8_t header[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	[output appendBytes: header length: sizeof(header)];
+	uLong crc = crc32(0, nullptr, 0);
+	for (auto &block : blocks)
+	{
+		[output appendBytes: block.data.data() length: block.data.size()];
+		crc = crc32_combine(crc, block.crc, static_cast<z_off_t>(block.length));
+	}
+	appendLittleEndian32(output, static_cast<uint32_t>(crc));
+	appendLittleEndian32(output, static_cast<uint32_t>(length));
+	return output;
+}
+@end
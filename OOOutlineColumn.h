@@ -32,6 +32,7 @@
 @class OOOutlineDocument;
 @class OOStyleRegistry;
 @class OOPartialStyle;
+@class OOXMLWriter;
 
 /**
  * The type of a column in the outline.
@@ -76,12 +77,32 @@ typedef enum
 	OOOutlineColumnTypeCheckBox
 } OOOutlineColumnType;
 
+/**
+ * The order in which an outline is sorted by a column.
+ */
+typedef enum
+{
+	/**
+	 * The outline is not sorted by the column.
+	 */
+	OOOutlineColumnSortNone,
+	/**
+	 * Rows are sorted with the smallest values first.
+	 */
+	OOOutlineColumnSortAscending,
+	/**
+	 * Rows are sorted with the largest values first.
+	 */
+	OOOutlineColumnSortDescending
+} OOOutlineColumnSortOrder;
+
 /**
  * Abstract superclass for class that computes summaries of columns.
  *
  * This is used for sum, mean, minimum, maximum, and so on.  Instances of this
  * class are stateless and so can be shared among documents.  All state is
- * maintained in the `-computeSummaryForRow:inColumn:` method.
+ * maintained in the `-computeSummaryForRow:inColumn:` method, and computed
+ * summaries are cached in the rows.
  */
 @interface OOOutlineSummary : NSObject
 /**
@@ -90,10 +111,17 @@ typedef enum
 + (instancetype)sharedInstance;
 /**
  * Constructs an outline value that corresponds to the summary of the children
- * of `aRow` for `aCol`.
+ * of `aRow` for `aCol`.  Subclasses override this, but callers should use
+ * `-summaryForRow:inColumn:`, which caches the result in the row.
  */
 - (OOOutlineValue*)computeSummaryForRow: (OOOutlineRow*)aRow
                                inColumn: (NSUInteger)aCol;
+/**
+ * Returns the summary of the children of `aRow` for `aCol`, computing it only
+ * if it is not already cached.
+ */
+- (OOOutlineValue*)summaryForRow: (OOOutlineRow*)aRow
+                        inColumn: (NSUInteger)aCol;
 @end
 
 /**
@@ -113,17 +141,30 @@ typedef enum
 @property (nonatomic, readonly) NSDictionary *defaultStyle;
 /**
  * Enumeration values in this column.  This is a map from enumeration id (a
- * unique string identifier for the value) to attributed strings representing
- * the value to display for these identifiers.
+ * unique string identifier for the value) to strings representing the value
+ * to display for these identifiers.  This is constructed on demand from the
+ * column's enumeration table.
  *
  * This property is `nil` for columns of any type other than
  * `OOOutlineColumnTypeEnumeration`.
  */
-@property (nonatomic) NSMutableDictionary *enumValues;
+@property (nonatomic, readonly) NSDictionary<NSString*, NSString*> *enumValues;
+/**
+ * The labels of the enumeration members in this column, in the order in which
+ * they are defined.
+ */
+@property (nonatomic, readonly) NSArray<NSString*> *enumLabels;
 /**
- * The kind of data stored in this column.
+ * The kind of data stored in this column.  Setting this converts the values
+ * in the column in every row of the document.
  */
 @property (nonatomic) OOOutlineColumnType columnType;
+/**
+ * The order in which the outline was last sorted by this column, which is
+ * saved with the document.  This is `OOOutlineColumnSortNone` for every column
+ * except the one that the outline was last sorted by.
+ */
+@property (nonatomic) OOOutlineColumnSortOrder sortOrder;
 /**
  * The width of the column, in points.
  */
@@ -150,6 +191,13 @@ typedef enum
  * The unique identifier for this column.
  */
 @property (nonatomic) NSString *identifier;
+/**
+ * The index of this column's values in each row's storage.  The document
+ * assigns this when the column is added and it does not change when columns
+ * are reordered or removed.  This is `NSNotFound` for columns that have never
+ * been added to a document.
+ */
+@property (nonatomic) NSUInteger slot;
 /**
  * Identifies whether this is the special column for notes.  Documents contain
  * one notes column, which defines the styling for notes and does not correspond
@@ -161,9 +209,20 @@ typedef enum
  */
 @property (nonatomic) BOOL isOutlineColumn;
 /**
- * The width of this column for text export.
+ * The width of this column for text export.  This is the length of the longest
+ * value in the column when formatted as text.  It is computed with a full
+ * traversal of the document the first time that it is needed after an edit
+ * and then maintained incrementally as values and rows are added and removed.
+ * The traversal does not read children that were deferred when the document
+ * was loaded, and uses the width stored in the file for them instead.
  */
 @property (readonly, nonatomic) NSUInteger textExportWidth;
+/**
+ * Flag indicating whether this column is incrementally maintaining its text
+ * export width.  If this is `NO`, then the methods for adding and removing
+ * values from the text export width do nothing.
+ */
+@property (readonly, nonatomic) BOOL maintainsTextExportWidth;
 /**
  * The style properties for this coulmn.
  */
@@ -189,9 +248,56 @@ typedef enum
  * Encode the column as OmniOutliner 3 XML.
  */
 - (NSXMLElement*)oo3xmlValue;
+/**
+ * Write the column as OmniOutliner 3 XML.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter;
+/**
+ * Write the column as OmniOutliner 3 XML.  If `includesDerivedValues` is not
+ * set, then attributes that are computed from the values in the rows, such as
+ * the text export width, are omitted.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+includingDerivedValues: (BOOL)includesDerivedValues;
+/**
+ * Returns the enumeration member ID for the member with the specified
+ * OmniOutliner 3 identifier, or `NSNotFound` if there is no such member.
+ * Member IDs are small integers, allocated sequentially.  This is O(1).
+ */
+- (NSUInteger)enumerationIDForIdentifier: (NSString*)anIdentifier;
+/**
+ * Returns the enumeration member ID for the member with the specified label,
+ * or `NSNotFound` if there is no such member.  This is O(1).
+ */
+- (NSUInteger)enumerationIDForLabel: (NSString*)aLabel;
+/**
+ * Adds a new enumeration member and returns its ID.  A new identifier is
+ * generated if `anIdentifier` is `nil`.
+ */
+- (NSUInteger)addEnumerationMemberWithIdentifier: (NSString*)anIdentifier
+                                           label: (NSString*)aLabel;
+/**
+ * Returns the OmniOutliner 3 identifier for the specified enumeration member.
+ */
+- (NSString*)enumerationIdentifierForID: (NSUInteger)anID;
+/**
+ * Returns the label for the specified enumeration member, with the column's
+ * default style applied.
+ */
+- (NSAttributedString*)enumerationLabelForID: (NSUInteger)anID;
 /**
  * Notify the column that a value will change.  This can be used for the column
  * to perform additional validation and update any internal state.
  */
 - (id)value: (OOOutlineValue*)aValue willChangeTo: (OOOutlineValue*)aNewValue;
+/**
+ * Records that a value in this column has been added to the outline.  This is
+ * called by rows and is O(log n) in the number of distinct widths.
+ */
+- (void)addValueToTextExportWidth: (OOOutlineValue*)aValue;
+/**
+ * Records that a value in this column has been removed from the outline.  This
+ * is called by rows and is O(log n) in the number of distinct widths.
+ */
+- (void)removeValueFromTextExportWidth: (OOOutlineValue*)aValue;
 @end
@@ -26,6 +26,10 @@
  */
 
 #import "OpenOutliner.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
 
 namespace
 {
@@ -46,8 +50,7 @@ Class computeSummary(T &acc, OOOutlineSummary *aSummary, OOOutlineRow *aRow, NSU
 		auto *val = [child.values objectAtIndex: aCol];
 		if (!val.value)
 		{
-			// FIXME: We should cache this, or we'll potentially end up computing it a *lot* of times.
-			val = [aSummary computeSummaryForRow: child inColumn: aCol];
+			val = [aSummary summaryForRow: child inColumn: aCol];
 			// Skip empty cells that have no non-empty children
 			if (!val.value)
 			{
@@ -75,6 +78,10 @@ Class computeSummary(T &acc, OOOutlineSummary *aSummary, OOOutlineRow *aRow, NSU
 	OO_ABSTRACT_METHOD();
 	return nil;
 }
+- (OOOutlineValue*)summaryForRow: (OOOutlineRow*)aRow inColumn: (NSUInteger)aCol
+{
+	return [aRow summaryForColumn: aCol usingSummary: self];
+}
 @end
 
 /**
@@ -195,21 +202,58 @@ SINGLETON(Max)
 	 */
 	BOOL textExportWidthDirty;
 	/**
-	 * The text export width.
+	 * The text export width that was read from the file.
 	 */
 	NSUInteger textExportWidth;
+	/**
+	 * The text export width of the rows that were deferred when the document
+	 * was loaded and had not been read when the widths were last computed.
+	 * These rows are not in `textExportWidths`, and are assumed to be no
+	 * wider than the width stored in the file.
+	 */
+	NSUInteger unreadTextExportWidth;
+	/**
+	 * Multiset of the text export widths of all values in this column, as a
+	 * map from width to the number of values with that width.  This is valid
+	 * only if `maintainsTextExportWidth` is set.
+	 */
+	std::map<NSUInteger, NSUInteger> textExportWidths;
+	/**
+	 * OmniOutliner 3 identifiers of the enumeration members, indexed by
+	 * member ID.
+	 */
+	std::vector<NSString*> enumIdentifiers;
+	/**
+	 * Labels of the enumeration members, indexed by member ID.
+	 */
+	std::vector<NSAttributedString*> enumLabelStrings;
+	/**
+	 * Map from OmniOutliner 3 identifiers to member IDs.
+	 */
+	object_map<NSString*, NSUInteger> enumIDsForIdentifiers;
+	/**
+	 * Map from labels to member IDs.
+	 */
+	object_map<NSString*, NSUInteger> enumIDsForLabels;
+	/**
+	 * Lock protecting the enumeration table, so that values can be read
+	 * concurrently while loading.
+	 */
+	std::mutex enumLock;
 }
 @synthesize
 	title,
 	columnType,
 	defaultStyle,
-	enumValues,
 	formatter,
 	identifier,
 	isNoteColumn,
 	isOutlineColumn,
+	maintainsTextExportWidth,
 	maxWidth,
 	minWidth,
+	slot,
+	sortOrder,
 	style,
 	summary,
 	width;
@@ -218,6 +262,7 @@ SINGLETON(Max)
                   inDocument: (OOOutlineDocument*)aDocument;
 {
 	OO_SUPER_INIT();
+	slot = NSNotFound;
 	title = [NSAttributedString new];
 	columnType = aType;
 	document = aDocument;
@@ -228,11 +273,17 @@ SINGLETON(Max)
 	return self;
 }
 
+- (void)setColumnType: (OOOutlineColumnType)aType
+{
+	columnType = aType;
+	[document columnDidChangeType: self];
+}
 - (instancetype)initWithOO2Plist: (NSDictionary*)aDictionary
                      columnIndex: (NSUInteger)anIndex
                       inDocument: (OOOutlineDocument*)aDocument
 {
 	OO_SUPER_INIT();
+	slot = NSNotFound;
 	NSDictionary *col = [[aDictionary objectForKey: @"Columns"] objectAtIndex: anIndex];
 	auto getValue = [&](NSString *name, auto &val)
 		{
@@ -258,6 +309,7 @@ SINGLETON(Max)
                     inDocument: (OOOutlineDocument*)aDocument
 {
 	OO_SUPER_INIT();
+	slot = NSNotFound;
 	document = aDocument;
 	// FIXME: Document default title style (stored in <root><style> element.
 	title = [NSMutableAttributedString attributedStringWithOO3XML: [[xml elementForName: @"title"] elementForName: @"text"]
@@ -288,6 +340,16 @@ SINGLETON(Max)
 	isNoteColumn = [[[xml attributeForName: @"is-note-column"] stringValue] boolValue];
 	isOutlineColumn = [[[xml attributeForName: @"is-outline-column"] stringValue] boolValue];
 	summary = [summaryTypes[[[xml attributeForName: @"summary"] stringValue]] sharedInstance];
+	static object_map<NSString*, OOOutlineColumnSortOrder> sortOrders =
+		{
+			{ @"ascending", OOOutlineColumnSortAscending },
+			{ @"descending", OOOutlineColumnSortDescending }
+		};
+	if (NSString *order = [[xml attributeForName: @"sort-order"] stringValue])
+	{
+		auto i = sortOrders.find(order);
+		sortOrder = (i == sortOrders.end()) ? OOOutlineColumnSortNone : i->second;
+	}
 	auto intAttr = [&](NSString *attr)
 		{
 			return get<NSUInteger>([[xml attributeForName: attr] stringValue]);
@@ -324,22 +386,28 @@ SINGLETON(Max)
 	}
 	if (columnType == OOOutlineColumnTypeEnumeration)
 	{
-		enumValues = [NSMutableDictionary new];
 		NSXMLElement *enumXML = [xml elementForName: @"enumeration"];
 		for (NSXMLElement *member in [enumXML elementsForName: @"member"])
 		{
 			auto *text = [NSMutableAttributedString attributedStringWithOO3XML: [member elementForName: @"text"]
 			                                                  withPartialStyle: style];
-			[enumValues	setObject: [text string]
-			               forKey: [[member attributeForName: @"id"] stringValue]];
+			[self addEnumerationMemberWithIdentifier: [[member attributeForName: @"id"] stringValue]
+			                                   label: [text string]];
 		}
 	}
 	return self;
 }
 - (NSXMLElement*)oo3xmlValue
 {
-	// FIXME: style
-	NSXMLElement *col = [NSXMLElement elementWithName: @"column"];
+	return [OOXMLWriter elementByWriting: ^(OOXMLWriter *w) { [self writeOO3XML: w]; }];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+{
+	[self writeOO3XML: aWriter includingDerivedValues: YES];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+includingDerivedValues: (BOOL)includesDerivedValues
+{
 	static std::unordered_map<OOOutlineColumnType, NSString*> columnTypes =
 	{
 		{ OOOutlineColumnTypeText, @"text" },
@@ -360,34 +428,40 @@ SINGLETON(Max)
 		{ [OOOutlineSummaryMax class], @"maximum" },
 	};
 
-	// FIXME: sort direction (if any)
-	[col setAttributesAsDictionary: @{
-									  @"id"    : identifier,
-									  @"type"  : columnTypes[columnType],
-									  @"summary" : summaryKinds[[summary class]],
-									  @"width" : [NSString stringWithFormat: @"%ld", (long)width],
-									  @"minimum-width" : [NSString stringWithFormat: @"%ld", (long)minWidth],
-									  @"maximum-width" : [NSString stringWithFormat: @"%ld", (long)maxWidth],
-									  @"text-export-width" : [NSString stringWithFormat: @"%ld", (long)self.textExportWidth]
-									 }];
+	[aWriter startElement: @"column"];
+	[aWriter addAttribute: identifier withName: @"id"];
+	[aWriter addAttribute: columnTypes[columnType] withName: @"type"];
+	[aWriter addAttribute: summaryKinds[[summary class]] withName: @"summary"];
+	[aWriter addAttribute: [NSString stringWithFormat: @"%ld", (long)width]
+	             withName: @"width"];
+	[aWriter addAttribute: [NSString stringWithFormat: @"%ld", (long)minWidth]
+	             withName: @"minimum-width"];
+	[aWriter addAttribute: [NSString stringWithFormat: @"%ld", (long)maxWidth]
+	             withName: @"maximum-width"];
+	if (includesDerivedValues)
+	{
+		[aWriter addAttribute: [NSString stringWithFormat: @"%ld", (long)self.textExportWidth]
+		             withName: @"text-export-width"];
+	}
 	auto flag = [&](BOOL flag, NSString *name)
 	{
 		if (flag)
 		{
-			[col addAttribute: @"yes"
-			         withName: name];
+			[aWriter addAttribute: @"yes"
+			             withName: name];
 		}
 	};
 	flag(isNoteColumn, @"is-note-column");
 	flag(isOutlineColumn, @"is-outline-column");
-	NSXMLElement *styleNode = [style oo3xmlValue];
-	if (styleNode)
+	if (sortOrder != OOOutlineColumnSortNone)
 	{
-		[col addChild: styleNode];
+		[aWriter addAttribute: (sortOrder == OOOutlineColumnSortAscending) ? @"ascending" : @"descending"
+		             withName: @"sort-order"];
 	}
-	NSXMLElement *titleNode = [NSXMLElement elementWithName: @"title"];
-	[titleNode addChild: [title oo3xmlValueWithPartialStyle: document.titleStyle]];
-	[col addChild: titleNode];
+	[style writeOO3XML: aWriter];
+	[aWriter startElement: @"title"];
+	[title writeOO3XML: aWriter withPartialStyle: document.titleStyle];
+	[aWriter endElement];
 	if (formatter)
 	{
 		NSString *type;
@@ -403,71 +477,193 @@ SINGLETON(Max)
 			formatString = [(OOUNIXDateFormatter*)formatter format];
 		}
 		NSAssert(formatString != nil, @"format string must not be nil!");
-		NSXMLElement *formatterElement = [NSXMLElement elementWithName: @"formatter"
-		                                                   stringValue: formatString];
-		[formatterElement setAttributesAsDictionary: @{ @"type" : type }];
-		[col addChild: formatterElement];
+		[aWriter startElement: @"formatter"];
+		[aWriter addAttribute: type withName: @"type"];
+		[aWriter addText: formatString];
+		[aWriter endElement];
+	}
+	if (columnType == OOOutlineColumnTypeEnumeration)
+	{
+		[aWriter startElement: @"enumeration"];
+		for (NSUInteger i=0, e=enumIdentifiers.size() ; i<e ; i++)
+		{
+			[aWriter startElement: @"member"];
+			[aWriter addAttribute: enumIdentifiers[i] withName: @"id"];
+			[enumLabelStrings[i] writeOO3XML: aWriter withPartialStyle: style];
+			[aWriter endElement];
+		}
+		[aWriter endElement];
+	}
+	[aWriter endElement];
+}
+- (NSDictionary<NSString*, NSString*>*)enumValues
+{
+	if (columnType != OOOutlineColumnTypeEnumeration)
+	{
+		return nil;
+	}
+	auto *values = [NSMutableDictionary dictionaryWithCapacity: enumIdentifiers.size()];
+	for (NSUInteger i=0, e=enumIdentifiers.size() ; i<e ; i++)
+	{
+		[values setObject: [enumLabelStrings[i] string]
+		           forKey: enumIdentifiers[i]];
+	}
+	return values;
+}
+- (NSArray<NSString*>*)enumLabels
+{
+	auto *labels = [NSMutableArray arrayWithCapacity: enumLabelStrings.size()];
+	for (NSAttributedString *label : enumLabelStrings)
+	{
+		[labels addObject: [label string]];
 	}
-	if (enumValues)
+	return labels;
+}
+- (NSUInteger)enumerationIDForIdentifier: (NSString*)anIdentifier
+{
+	std::lock_guard<std::mutex> g(enumLock);
+	auto i = enumIDsForIdentifiers.find(anIdentifier);
+	return (i == enumIDsForIdentifiers.end()) ? NSNotFound : i->second;
+}
+- (NSUInteger)enumerationIDForLabel: (NSString*)aLabel
+{
+	std::lock_guard<std::mutex> g(enumLock);
+	auto i = enumIDsForLabels.find(aLabel);
+	return (i == enumIDsForLabels.end()) ? NSNotFound : i->second;
+}
+- (NSUInteger)addEnumerationMemberWithIdentifier: (NSString*)anIdentifier
+                                           label: (NSString*)aLabel
+{
+	std::lock_guard<std::mutex> g(enumLock);
+	// Another thread may have added the same member since the caller looked
+	// it up.
+	if (anIdentifier)
 	{
-		NSXMLElement *enumList = [NSXMLElement elementWithName: @"enumeration"];
-		for (NSString *ident in enumValues)
+		auto i = enumIDsForIdentifiers.find(anIdentifier);
+		if (i != enumIDsForIdentifiers.end())
 		{
-			NSXMLElement *member = [NSXMLElement elementWithName: @"member"];
-			[member setAttributesAsDictionary: @{ @"id" : ident }];
-			auto *elem = [[NSAttributedString alloc] initWithString: [enumValues objectForKey: ident]
-			                                             attributes: defaultStyle];
-			[member addChild: [elem oo3xmlValueWithPartialStyle: style]];
-			[enumList addChild: member];
+			return i->second;
 		}
-		[col addChild: enumList];
 	}
-	return col;
+	else
+	{
+		auto i = enumIDsForLabels.find(aLabel);
+		if (i != enumIDsForLabels.end())
+		{
+			return i->second;
+		}
+	}
+	NSUInteger anID = enumIdentifiers.size();
+	anIdentifier = [anIdentifier copy] ?: identifierString();
+	aLabel = [aLabel copy];
+	enumIdentifiers.push_back(anIdentifier);
+	enumLabelStrings.push_back([[NSAttributedString alloc] initWithString: aLabel
+	                                                           attributes: defaultStyle]);
+	enumIDsForIdentifiers[anIdentifier] = anID;
+	// If two members have the same label, then the first one wins.
+	enumIDsForLabels.insert({ aLabel, anID });
+	return anID;
+}
+- (NSString*)enumerationIdentifierForID: (NSUInteger)anID
+{
+	std::lock_guard<std::mutex> g(enumLock);
+	return enumIdentifiers.at(anID);
+}
+- (NSAttributedString*)enumerationLabelForID: (NSUInteger)anID
+{
+	std::lock_guard<std::mutex> g(enumLock);
+	return enumLabelStrings.at(anID);
 }
 - (id)value: (OOOutlineValue*)aValue willChangeTo: (OOOutlineValue*)aNewValue
 {
-	// FIXME: Don't do this if we're changing a value that's shorter than the
-	// old one.
+	// If we are maintaining the width then the row will update it when the
+	// value is replaced.
 	textExportWidthDirty = YES;
 	return aNewValue;
 }
+- (void)setFormatter: (NSFormatter*)aFormatter
+{
+	formatter = aFormatter;
+	maintainsTextExportWidth = NO;
+	textExportWidths.clear();
+	textExportWidthDirty = YES;
+}
+/**
+ * Returns the width of a value when exported as text.
+ */
+- (NSUInteger)textExportWidthOfValue: (id)val
+{
+	NSString *s;
+	if (formatter)
+	{
+		s = [formatter stringForObjectValue: val];
+	}
+	else
+	{
+		s = get<NSString*>(val);
+	}
+	return [s length];
+}
+- (void)addValueToTextExportWidth: (OOOutlineValue*)aValue
+{
+	if (maintainsTextExportWidth)
+	{
+		textExportWidths[[self textExportWidthOfValue: [aValue value]]]++;
+	}
+}
+- (void)removeValueFromTextExportWidth: (OOOutlineValue*)aValue
+{
+	if (maintainsTextExportWidth)
+	{
+		auto i = textExportWidths.find([self textExportWidthOfValue: [aValue value]]);
+		NSAssert(i != textExportWidths.end(), @"Removing value that was not added");
+		if (--i->second == 0)
+		{
+			textExportWidths.erase(i);
+		}
+	}
+}
 - (NSUInteger)textExportWidth
 {
-	auto *doc = document;
+	auto maintainedWidth = [&]()
+		{
+			NSUInteger w = textExportWidths.empty() ? 0 : textExportWidths.rbegin()->first;
+			return std::max(w, unreadTextExportWidth);
+		};
+	if (maintainsTextExportWidth)
+	{
+		return maintainedWidth();
+	}
 	if (textExportWidthDirty)
 	{
-		NSUInteger colNumber = 0;
-		for (OOOutlineColumn *col in doc.columns)
+		auto *doc = document;
+		NSUInteger colNumber = [doc.columns indexOfObjectIdenticalTo: self];
+		if (colNumber == NSNotFound)
 		{
-			if (col == self)
-			{
-				break;
-			}
-			colNumber++;
+			return textExportWidth;
 		}
-		NSUInteger w = 0;
+		textExportWidths.clear();
+		unreadTextExportWidth = 0;
+		// Deferred children are added to the widths when they are read, so
+		// computing the width does not read them.
 		std::function<void(OOOutlineRow*)> visit = [&](OOOutlineRow *r)
 			{
 				id val = [[r.values objectAtIndex: colNumber] value];
-				NSString *s;
-				if (formatter)
+				textExportWidths[[self textExportWidthOfValue: val]]++;
+				if ([r deferredChildren])
 				{
-					s = [formatter stringForObjectValue: val];
+					unreadTextExportWidth = textExportWidth;
+					return;
 				}
-				else
-				{
-					s = get<NSString*>(val);
-				}
-
-				w = std::max(w, [s length]);
 				for (OOOutlineRow *child in r.children)
 				{
 					visit(child);
 				}
 			};
 		visit(doc.root);
-		textExportWidth = w;
+		maintainsTextExportWidth = YES;
 		textExportWidthDirty = NO;
+		return maintainedWidth();
 	}
 	return textExportWidth;
 }
@@ -69,6 +69,14 @@
  * Launches the column inspector for this document.
  */
 - (IBAction)inspectColumns: (id)sender;
+/**
+ * Handles the Find menu items, identified by the sender's tag.  Find prompts
+ * for a search string, showing the number of matches as it is typed, and
+ * then either selects every matching row or moves to the next one.  Find Next
+ * and Find Previous select the next or previous matching row after the
+ * selection.  The search string is shared through the find pasteboard.
+ */
+- (IBAction)performFindPanelAction: (id)sender;
 /**
  * Inserts rows from a pasteboard.
  */
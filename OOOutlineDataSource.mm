@@ -59,20 +59,19 @@ namespace {
  * from the outline, we must find their parents and remove them.  We don't want
  * to remove any of the nodes where we're already removing the parents.
  */
-void collectRowsToRemove(OOOutlineDocument *doc,
-                         NSArray<OOOutlineRow*> *rows,
+void collectRowsToRemove(NSArray<OOOutlineRow*> *rows,
                          object_map<OOOutlineRow*, NSMutableIndexSet*> &removals)
 {
 	NSSet *set = [NSSet setWithArray: rows];
 	for (OOOutlineRow *r : rows)
 	{
-		OOOutlineRow *p = [doc parentForRow: r];
+		OOOutlineRow *p = r.parent;
 		// Skip any where we're already removing the parent.
 		if ([set containsObject: p])
 		{
 			continue;
 		}
-		auto idx = [p.children indexOfObject: r];
+		auto idx = r.indexInParent;
 		auto &idxs = removals[p];
 		if (!idxs)
 		{
@@ -99,6 +98,10 @@ void collectRowsToRemove(OOOutlineDocument *doc,
 	 * Lazily created window controller for the column inspector.
 	 */
 	OOColumnInspectorController *columnInspector;
+	/**
+	 * The find prompt, while it is shown.
+	 */
+	NSAlert *findAlert;
 }
 @synthesize
 	document,
@@ -143,10 +146,15 @@ void collectRowsToRemove(OOOutlineDocument *doc,
 		};
 	visit(doc.root);
 	[v registerForDraggedTypes: @[ OOOUtlineRowsPasteboardType, OOOUtlineXMLPasteboardType ]];
+	[self updateSortIndicators];
 	[[NSNotificationCenter defaultCenter] addObserver: self
 	                                         selector: @selector(columnsDidChange:)
 	                                             name: OOOutlineColumnsDidChangeNotification
 	                                           object: doc];
+	[[NSNotificationCenter defaultCenter] addObserver: self
+	                                         selector: @selector(filterDidChange:)
+	                                             name: OOOutlineFilterDidChangeNotification
+	                                           object: doc];
 }
 - (void)dealloc
 {
@@ -186,29 +194,106 @@ void collectRowsToRemove(OOOutlineDocument *doc,
 		// Adding the column to the table will reset its width to minWidth, so we must set its width afterwards.
 		[tc setWidth: c.width];
 	}
+	[self updateSortIndicators];
+	[v reloadItem: nil reloadChildren: YES];
+}
+/**
+ * Shows the order in which the outline was sorted in the column headers.
+ */
+- (void)updateSortIndicators
+{
+	auto *v = view;
+	auto *cols = [document columns];
+	for (NSTableColumn *tc in [v tableColumns])
+	{
+		NSUInteger idx = get<NSUInteger>([tc identifier]);
+		NSImage *indicator = nil;
+		if (idx < [cols count])
+		{
+			switch ([[cols objectAtIndex: idx] sortOrder])
+			{
+				case OOOutlineColumnSortAscending:
+					indicator = [NSImage imageNamed: @"NSAscendingSortIndicator"];
+					break;
+				case OOOutlineColumnSortDescending:
+					indicator = [NSImage imageNamed: @"NSDescendingSortIndicator"];
+					break;
+				case OOOutlineColumnSortNone:
+					break;
+			}
+		}
+		[v setIndicatorImage: indicator inTableColumn: tc];
+	}
+}
+- (void)outlineView: (NSOutlineView*)outlineView
+didClickTableColumn: (NSTableColumn*)tableColumn
+{
+	OOOutlineDocument *doc = document;
+	auto *v = view;
+	OOOutlineColumn *col = [doc.columns objectAtIndex: get<NSUInteger>([tableColumn identifier])];
+	// Clicking a column sorts in ascending order, unless it is already, in
+	// which case it reverses the order.
+	OOOutlineColumnSortOrder order = (col.sortOrder == OOOutlineColumnSortAscending) ?
+		OOOutlineColumnSortDescending : OOOutlineColumnSortAscending;
+	scoped_undo_grouping undo([doc undoManager], @"sort");
+	// Register the reload first, so that it will be invoked after undoing all
+	// of the changes.
+	[undo.record(v) reloadItem: nil reloadChildren: YES];
+	[undo.record(self) updateSortIndicators];
+	[doc sortChildrenOfRow: doc.root
+	              byColumn: col
+	                 order: order
+	           recursively: YES];
+	[self updateSortIndicators];
+	[v reloadItem: nil reloadChildren: YES];
+}
+- (void)filterDidChange: (NSNotification*)aNotification
+{
+	NSOutlineView *v = view;
 	[v reloadItem: nil reloadChildren: YES];
 }
 - (id)outlineView: (NSOutlineView*)outlineView
             child: (NSInteger)index
            ofItem: (OOOutlineRow*)item
 {
+	OOOutlineDocument *doc = document;
 	if (item == nil)
 	{
-		item  = document.root;
+		item  = doc.root;
+	}
+	if (OOOutlineFilter *filter = doc.filter)
+	{
+		return [[filter visibleChildrenOfRow: item] objectAtIndex: (NSUInteger)index];
 	}
 	return [item.children objectAtIndex: (NSUInteger)index];
 }
 - (BOOL)outlineView: (NSOutlineView*)outlineView
-   isItemExpandable: item
+   isItemExpandable: (OOOutlineRow*)item
 {
-	return [self outlineView: outlineView numberOfChildrenOfItem: item] > 0;
+	OOOutlineDocument *doc = document;
+	if (item == nil)
+	{
+		item  = doc.root;
+	}
+	// Without a condition, this avoids reading deferred children.
+	OOOutlineFilter *filter = doc.filter;
+	if (filter.condition)
+	{
+		return [[filter visibleChildrenOfRow: item] count] > 0;
+	}
+	return item.hasChildren;
 }
 - (NSInteger)outlineView: (NSOutlineView*)outlineView
   numberOfChildrenOfItem: (OOOutlineRow*)item
 {
+	OOOutlineDocument *doc = document;
 	if (item == nil)
 	{
-		item  = document.root;
+		item  = doc.root;
+	}
+	if (OOOutlineFilter *filter = doc.filter)
+	{
+		return (NSInteger)[[filter visibleChildrenOfRow: item] count];
 	}
 	return (NSInteger)[item.children count];
 }
@@ -227,8 +312,8 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 				OOOutlineColumn *col = [document.columns objectAtIndex: idx];
 				if (auto *summary = col.summary)
 				{
-					val = [summary computeSummaryForRow: item
-					                           inColumn: idx].value;
+					val = [summary summaryForRow: item
+					                    inColumn: idx].value;
 				}
 			}
 			return val;
@@ -268,7 +353,7 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 	{
 		auto *v = [NSComboBox new];
 		v.bordered = NO;
-		[v addItemsWithObjectValues: [[modelColumn enumValues] allValues]];
+		[v addItemsWithObjectValues: [modelColumn enumLabels]];
 		v.bordered = NO;
 		v.buttonBordered = NO;
 		v.bezeled = NO;
@@ -326,6 +411,14 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 	{
 		item = doc.root;
 	}
+	// The index is in the rows that are shown, which are a subset of the
+	// children if the outline is filtered.
+	OOOutlineFilter *filter = doc.filter;
+	if (filter && (index >= 0))
+	{
+		index = (NSInteger)[filter childIndexForVisibleIndex: (NSUInteger)index
+		                                               ofRow: item];
+	}
 	BOOL isMove = NO;
 	NSDictionary *options = nil;
 	// If this is a copy operation, then remove the type that will give us
@@ -347,7 +440,7 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 	// from, they're all new.
 	if (isMove)
 	{
-		collectRowsToRemove(doc, rows, removals);
+		collectRowsToRemove(rows, removals);
 	}
 	scoped_undo_grouping undo([doc undoManager], @"move rows");
 	// Register the reload first, so that it will be invoked after undoing all
@@ -400,14 +493,14 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 	auto *doc = document;
 	auto *v = view;
 	OOOutlineRow *selected = [v itemAtRow: [v selectedRow]];
-	OOOutlineRow *row = (selected == nil) ? doc.root : [doc parentForRow: selected];
+	OOOutlineRow *row = (selected == nil) ? doc.root : selected.parent;
 	OOOutlineRow *parent = row;
 	if (row == doc.root)
 	{
 		parent = nil;
 	}
 	auto *children = row.children;
-	NSUInteger idx = selected ? [children indexOfObject: selected] + 1 : 0;
+	NSUInteger idx = selected ? selected.indexInParent + 1 : 0;
 	return { parent, children, idx };
 }
 
@@ -445,7 +538,7 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 	auto *doc = document;
 	auto *v = view;
 	object_map<OOOutlineRow*, NSMutableIndexSet*> removals;
-	collectRowsToRemove(doc, rows, removals);
+	collectRowsToRemove(rows, removals);
 	scoped_undo_grouping undo([doc undoManager], @"delete rows");
 	// Register the reload first, so that it will be invoked after undoing all
 	// of the changes.
@@ -464,13 +557,12 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 {
 	auto *rows = [self selectedRows];
 	auto *rowSet = [NSMutableSet setWithArray: rows];
-	auto *doc = document;
 	// Filter out any rows that have a parent in the selection.
 	// These will be moved as a result of moving their parents.
 	for (OOOutlineRow *row : rows)
 	{
 		OOOutlineRow *parent = row;
-		while ((parent = [doc parentForRow: parent]))
+		while ((parent = parent.parent))
 		{
 			if ([rowSet containsObject: parent])
 			{
@@ -497,8 +589,8 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 	std::vector<OOOutlineRow*> rowsToExpand;
 	for (OOOutlineRow *row in rows)
 	{
-		auto *parent = [doc parentForRow: row];
-		NSUInteger idx = [parent.children indexOfObject: row];
+		auto *parent = row.parent;
+		NSUInteger idx = row.indexInParent;
 		// You can't increase the indent level of a node that is already the
 		// first child of its parent, because there's no new parent to attach it
 		// to without reordering.
@@ -555,14 +647,14 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 	[undo.record(v) reloadItem: nil reloadChildren: YES];
 	for (OOOutlineRow *row in rows)
 	{
-		auto *parent = [doc parentForRow: row];
-		auto *grandparent = [doc parentForRow: parent];
+		auto *parent = row.parent;
+		auto *grandparent = parent.parent;
 		if (grandparent == nil)
 		{
 			continue;
 		}
-		NSUInteger newIdx = [grandparent.children indexOfObject: parent] +1;
-		NSUInteger oldIdx = [parent.children indexOfObject: row];
+		NSUInteger newIdx = parent.indexInParent + 1;
+		NSUInteger oldIdx = row.indexInParent;
 		[undo.record(parent.children) insertObject: row atIndex: oldIdx];
 		[undo.record(grandparent.children) removeObjectAtIndex: newIdx];
 		[grandparent.children insertObject: row atIndex: newIdx];
@@ -610,6 +702,186 @@ objectValueForTableColumn: (NSTableColumn*)tableColumn
 	}
 	[[columnInspector window] makeKeyAndOrderFront: self];
 }
+/**
+ * The string that find actions search for.
+ */
+- (NSString*)findString
+{
+	return [[NSPasteboard pasteboardWithName: NSPasteboardNameFind] stringForType: NSPasteboardTypeString];
+}
+- (void)setFindString: (NSString*)aString
+{
+	auto *pb = [NSPasteboard pasteboardWithName: NSPasteboardNameFind];
+	[pb clearContents];
+	[pb setString: aString forType: NSPasteboardTypeString];
+}
+/**
+ * Expands the ancestors of a row.
+ */
+- (void)revealRow: (OOOutlineRow*)aRow
+{
+	auto *v = view;
+	std::vector<OOOutlineRow*> ancestors;
+	for (OOOutlineRow *p = aRow.parent ; p.parent != nil ; p = p.parent)
+	{
+		ancestors.push_back(p);
+	}
+	for (auto i = ancestors.rbegin() ; i != ancestors.rend() ; ++i)
+	{
+		[v expandItem: *i];
+	}
+}
+/**
+ * Selects every row that contains the find string, and scrolls to the first.
+ */
+- (void)selectRowsMatchingFindString
+{
+	auto *v = view;
+	NSString *str = [self findString];
+	if ([str length] == 0)
+	{
+		return;
+	}
+	auto *rows = [[document searchIndexCreatingIfNeeded] rowsMatchingString: str];
+	// Expand everything first, because expanding rows moves the rows below.
+	for (OOOutlineRow *r in rows)
+	{
+		[self revealRow: r];
+	}
+	NSMutableIndexSet *selection = [NSMutableIndexSet new];
+	for (OOOutlineRow *r in rows)
+	{
+		NSInteger idx = [v rowForItem: r];
+		// Rows that are hidden by the filter are not shown.
+		if (idx >= 0)
+		{
+			[selection addIndex: (NSUInteger)idx];
+		}
+	}
+	if ([selection count] == 0)
+	{
+		NSBeep();
+		return;
+	}
+	[v selectRowIndexes: selection byExtendingSelection: NO];
+	[v scrollRowToVisible: (NSInteger)[selection firstIndex]];
+}
+/**
+ * Selects the row that contains the find string after (or before) the
+ * selected row.
+ */
+- (void)findNextBackwards: (BOOL)isBackwards
+{
+	auto *v = view;
+	NSString *str = [self findString];
+	if ([str length] == 0)
+	{
+		NSBeep();
+		return;
+	}
+	NSInteger selected = [v selectedRow];
+	OOOutlineRow *current = (selected >= 0) ? [v itemAtRow: selected] : nil;
+	if (![current isKindOfClass: [OOOutlineRow class]])
+	{
+		current = nil;
+	}
+	OOOutlineRow *next = [[document searchIndexCreatingIfNeeded] rowMatchingString: str
+	                                                                       afterRow: current
+	                                                                      backwards: isBackwards];
+	[self revealRow: next];
+	NSInteger idx = next ? [v rowForItem: next] : -1;
+	if (idx < 0)
+	{
+		NSBeep();
+		return;
+	}
+	[v selectRowIndexes: [NSIndexSet indexSetWithIndex: (NSUInteger)idx]
+	 byExtendingSelection: NO];
+	[v scrollRowToVisible: idx];
+}
+/**
+ * Action for the find prompt's search field, which is sent as the string is
+ * typed.  Updates the number of matches.
+ */
+- (void)findFieldChanged: (NSSearchField*)sender
+{
+	NSString *str = [sender stringValue];
+	NSUInteger count = ([str length] > 0) ?
+		[[[document searchIndexCreatingIfNeeded] matchesForString: str] count] : 0;
+	findAlert.informativeText = (count == 1) ? @"1 match" :
+		[NSString stringWithFormat: @"%lu matches", (unsigned long)count];
+}
+/**
+ * Shows a sheet prompting for the find string.
+ */
+- (void)showFindPrompt
+{
+	auto *v = view;
+	NSAlert *alert = [NSAlert new];
+	alert.messageText = @"Find";
+	[alert addButtonWithTitle: @"Select All"];
+	[alert addButtonWithTitle: @"Find Next"];
+	[alert addButtonWithTitle: @"Cancel"];
+	NSSearchField *field = [[NSSearchField alloc] initWithFrame: NSMakeRect(0, 0, 260, 22)];
+	field.stringValue = [self findString] ?: @"";
+	field.target = self;
+	field.action = @selector(findFieldChanged:);
+	alert.accessoryView = field;
+	findAlert = alert;
+	[self findFieldChanged: field];
+	[alert layout];
+	alert.window.initialFirstResponder = field;
+	[alert beginSheetModalForWindow: [v window]
+	              completionHandler: ^(NSModalResponse aResponse)
+		{
+			self->findAlert = nil;
+			if (aResponse == NSAlertThirdButtonReturn)
+			{
+				return;
+			}
+			[self setFindString: field.stringValue];
+			if (aResponse == NSAlertFirstButtonReturn)
+			{
+				[self selectRowsMatchingFindString];
+			}
+			else
+			{
+				[self findNextBackwards: NO];
+			}
+		}];
+}
+- (IBAction)performFindPanelAction: (id)sender
+{
+	switch ([sender tag])
+	{
+		case NSFindPanelActionShowFindPanel:
+			[self showFindPrompt];
+			break;
+		case NSFindPanelActionNext:
+			[self findNextBackwards: NO];
+			break;
+		case NSFindPanelActionPrevious:
+			[self findNextBackwards: YES];
+			break;
+		case NSFindPanelActionSetFindString:
+		{
+			auto *v = view;
+			NSInteger selected = [v selectedRow];
+			OOOutlineRow *row = (selected >= 0) ? [v itemAtRow: selected] : nil;
+			if ([row isKindOfClass: [OOOutlineRow class]])
+			{
+				if (NSString *str = [[row.values objectAtIndex: 0] plainText])
+				{
+					[self setFindString: str];
+				}
+			}
+			break;
+		}
+		default:
+			NSBeep();
+			break;
+	}
+}
 
 - (void)pasteFromPasteboard: (NSPasteboard*)aPasteboard
 {
@@ -26,9 +26,14 @@
  */
 
 #import <Cocoa/Cocoa.h>
+#import "OOOutlineColumn.h"
+#import "OOOutlineRow.h"
 
 @class OOOutlineColumn;
-@class OOOutlineRow;
+@class OOOutlineFilter;
+@class OOOutlineFilterCondition;
+@class OOOutlineJournal;
+@class OOOutlineSearchIndex;
 @class OOStyleRegistry;
 
 /**
@@ -50,12 +55,17 @@ extern NSString *const OOOutlineColumnsDidChangeNotification;
  */
 @property (nonatomic, readonly) NSUInteger columnCount;
 /**
- * The columns in this document.
- *
- * FIXME: This returns a mutable array, but currently modifying it will break
- * all of the things.
+ * The columns in this document, in display order.  The returned array is not
+ * modified when the columns change: use `-insertColumn:atIndex:`,
+ * `-removeColumnAtIndex:`, and `-moveColumnAtIndex:toIndex:`.
  */
 @property (nonatomic, readonly) NSArray<OOOutlineColumn*> *columns;
+/**
+ * Every column that has been assigned a slot, indexed by slot.  This includes
+ * columns that have been removed, whose values are still stored in the rows so
+ * that the removal can be undone.
+ */
+@property (nonatomic, readonly) NSArray<OOOutlineColumn*> *columnsBySlot;
 /**
  * The notes column, providing properties that should be applied to all notes.
  */
@@ -78,26 +88,135 @@ extern NSString *const OOOutlineColumnsDidChangeNotification;
  */
 @property (nonatomic) CGFloat windowHeight;
 /**
- * Map from unique identifiers to outline rows.  This contains all of the rows
- * in the document in a strong-to-weak map (so deleting a row will implicitly
- * remove it from this list).
+ * Flag indicating whether `contents.xml` is gzip compressed when the document
+ * is saved.  This is set when loading a document whose contents were
+ * compressed.  Compression uses all available cores.
+ */
+@property (nonatomic) BOOL compressesContents;
+/**
+ * The compression level used when `compressesContents` is set, in the range
+ * 0 (fastest) to 1 (smallest), or negative for the default level.
+ */
+@property (nonatomic) float compressionLevel;
+/**
+ * The journal that records changes to the rows of the document, so that
+ * autosaving can append them to the document's file rather than rewriting it.
+ */
+@property (nonatomic, readonly) OOOutlineJournal *journal;
+/**
+ * The filter that selects the rows shown in the outline, or `nil` if no
+ * condition has been set.  Rows inform the filter of every change, so it is
+ * created only when it is first needed.
+ */
+@property (nonatomic, readonly) OOOutlineFilter *filter;
+/**
+ * The condition that rows must match to be shown in the outline, or `nil` to
+ * show all rows.  Setting this posts an `OOOutlineFilterDidChangeNotification`
+ * notification.
+ */
+@property (nonatomic) OOOutlineFilterCondition *filterCondition;
+/**
+ * The index used to search the text of the rows, or `nil` if the document has
+ * not been searched.  Rows inform the index of every change, so it is created
+ * only when it is first needed, by `-searchIndexCreatingIfNeeded`.
+ */
+@property (nonatomic, readonly) OOOutlineSearchIndex *searchIndex;
+/**
+ * Returns `searchIndex`, indexing the rows first if the document has not been
+ * searched before.
+ */
+- (OOOutlineSearchIndex*)searchIndexCreatingIfNeeded;
+/**
+ * Adds a row to the document's index of rows and returns its ID.  The ID is
+ * derived from `anIdentifier` if possible, otherwise a new ID is allocated and
+ * the identifier (if not `nil`) is recorded so that it can be saved.  This is
+ * safe to call from multiple threads, so rows can be constructed concurrently
+ * while loading.
+ */
+- (OOOutlineRowID)registerRow: (OOOutlineRow*)aRow
+               withIdentifier: (NSString*)anIdentifier;
+/**
+ * Removes a row from the document's index of rows.  Rows call this when they
+ * are deallocated.
+ */
+- (void)unregisterRow: (OOOutlineRow*)aRow;
+/**
+ * Returns the row in this document with the specified ID, or `nil` if there is
+ * no such row.
+ */
+- (OOOutlineRow*)rowWithID: (OOOutlineRowID)anID;
+/**
+ * Returns the row in this document with the specified identifier string, or
+ * `nil` if there is no such row.
+ */
+- (OOOutlineRow*)rowWithIdentifier: (NSString*)anIdentifier;
+/**
+ * Returns the identifier string for the row with the specified ID.  This is
+ * safe to call from any thread.
  */
-@property (nonatomic, readonly) NSMapTable *allRows;
+- (NSString*)identifierForRowID: (OOOutlineRowID)anID;
 /**
  * Global array of all documents currently open.  This exists to make it
  * possible to materialise items across documents.
  */
 + (NSArray<OOOutlineDocument*>*)allDocuments;
 /**
- * Find the parent for a specified row.
+ * Find the parent for a specified row.  This is equivalent to the row's
+ * `parent` property and is retained for compatibility.
  */
 - (OOOutlineRow*)parentForRow: (OOOutlineRow*)aRow;
 /**
- * Add a column to the document.  This will also insert an empty value into 
- * each row.
+ * Add a column to the document, after the existing columns.  Every row has an
+ * empty value for the new column.
  *
  * Posts an `OOOutlineColumnsDidChangeNotification` notification when the new
  * column has been added.
  */
 - (void)addColumn: (OOOutlineColumn*)aColumn;
+/**
+ * Inserts a column at the specified display index.  This does not modify any
+ * rows: rows that do not store a value for a column have an empty value.
+ *
+ * Posts an `OOOutlineColumnsDidChangeNotification` notification.
+ */
+- (void)insertColumn: (OOOutlineColumn*)aColumn
+             atIndex: (NSUInteger)anIndex;
+/**
+ * Removes the column at the specified display index.  The values for the
+ * column remain in the rows until the document is next loaded, so this does
+ * not modify any rows.
+ *
+ * Posts an `OOOutlineColumnsDidChangeNotification` notification.
+ */
+- (void)removeColumnAtIndex: (NSUInteger)anIndex;
+/**
+ * Moves a column to a new display index.  Values are stored by slot, so this
+ * does not modify any rows.
+ *
+ * Posts an `OOOutlineColumnsDidChangeNotification` notification.
+ */
+- (void)moveColumnAtIndex: (NSUInteger)anIndex
+                  toIndex: (NSUInteger)aNewIndex;
+/**
+ * Converts the values in a column to the column's new type.  Columns call
+ * this when their type changes, so that rows do not need to observe them.
+ */
+- (void)columnDidChangeType: (OOOutlineColumn*)aColumn;
+/**
+ * Sorts the children of `aRow` by their values in `aColumn` and, if
+ * `isRecursive` is set, the children of each of its descendants.  The sort is
+ * stable, and rows without a value sort after those with values in either
+ * order.  This sets the sort order of `aColumn` and clears that of the other
+ * columns.  This is undoable.
+ */
+- (void)sortChildrenOfRow: (OOOutlineRow*)aRow
+                 byColumn: (OOOutlineColumn*)aColumn
+                    order: (OOOutlineColumnSortOrder)anOrder
+              recursively: (BOOL)isRecursive;
+/**
+ * Reorders the children of `aRow`.  `someRows` must contain the same rows as
+ * the children, in the new order.  This is undoable.
+ */
+- (void)setOrderOfChildren: (NSArray<OOOutlineRow*>*)someRows
+                     ofRow: (OOOutlineRow*)aRow;
 @end
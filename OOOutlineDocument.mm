@@ -26,7 +26,12 @@
  */
 
 #import "OpenOutliner.h"
+#import "row_index.h"
+#import "sort_keys.h"
+#import <atomic>
 #import <mutex>
+#import <utility>
+#import <vector>
 
 namespace {
 /**
@@ -38,6 +43,26 @@ NSMutableArray<OOOutlineDocument*> *allDocs;
  */
 std::mutex lock;
 
+/**
+ * The state of a document that is written by a save.
+ */
+struct save_snapshot
+{
+	/**
+	 * A writer containing the XML that precedes the rows, or `nil` if no
+	 * snapshot has been taken.
+	 */
+	OOXMLWriter *writer;
+	/**
+	 * The version of the root row.
+	 */
+	OOOutlineRowVersion *rows;
+	/**
+	 * The columns, in the order in which the rows' values are written.
+	 */
+	NSArray<OOOutlineColumn*> *columns;
+};
+
 /**
  * Visit all of the rows in a depth-first pattern.
  */
@@ -57,19 +82,181 @@ bool visitRows(OOOutlineRow *aRow, T &&aVisitor)
 	}
 	return false;
 }
+
+/**
+ * An entry in an array of rows being sorted.  Entries with equal keys are
+ * ordered by their original index, which makes the sort stable.
+ */
+template<typename K, bool Ascending>
+struct sort_entry
+{
+	/**
+	 * Flag indicating that the row has no value, and so sorts last.
+	 */
+	bool isEmpty;
+	/**
+	 * The sort key for the row's value.
+	 */
+	K key;
+	/**
+	 * The index of the row before sorting.
+	 */
+	uint32_t index;
+	bool operator<(const sort_entry &anEntry) const
+	{
+		if (isEmpty != anEntry.isEmpty)
+		{
+			return anEntry.isEmpty;
+		}
+		if (!isEmpty)
+		{
+			const K &a = Ascending ? key : anEntry.key;
+			const K &b = Ascending ? anEntry.key : key;
+			if (a < b)
+			{
+				return true;
+			}
+			if (b < a)
+			{
+				return false;
+			}
+		}
+		return index < anEntry.index;
+	}
+};
+
+/**
+ * Returns the rows sorted by their values in a column.  `aKeyFunction` sets
+ * the key for a value and returns `false` if the value is empty.  Keys are
+ * extracted in parallel, in chunks so that each task does a useful amount of
+ * work.
+ */
+template<typename K, bool Ascending, typename F>
+NSArray<OOOutlineRow*> *sort_rows(NSArray<OOOutlineRow*> *someRows,
+                                  OOOutlineColumn *aColumn,
+                                  F aKeyFunction)
+{
+	size_t count = [someRows count];
+	const size_t chunk = 1024;
+	__block std::vector<sort_entry<K, Ascending>> entries(count);
+	dispatch_apply((count + chunk - 1) / chunk, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t c) {
+		@autoreleasepool
+		{
+			for (size_t i=c*chunk ; i<std::min(count, (c+1)*chunk) ; i++)
+			{
+				auto &e = entries[i];
+				e.index = static_cast<uint32_t>(i);
+				e.isEmpty = !aKeyFunction([[someRows objectAtIndex: i] valueForColumn: aColumn], e.key);
+			}
+		}
+	});
+	parallel_sort(entries);
+	NSMutableArray<OOOutlineRow*> *sorted = [NSMutableArray arrayWithCapacity: count];
+	for (auto &e : entries)
+	{
+		[sorted addObject: [someRows objectAtIndex: e.index]];
+	}
+	return sorted;
+}
+
+/**
+ * Returns the rows sorted by their values in a column, using the compact key
+ * for the column's type.
+ */
+template<bool Ascending>
+NSArray<OOOutlineRow*> *sort_rows(NSArray<OOOutlineRow*> *someRows,
+                                  OOOutlineColumn *aColumn)
+{
+	switch (aColumn.columnType)
+	{
+		case OOOutlineColumnTypeNumber:
+			return sort_rows<decimal_key, Ascending>(someRows, aColumn, [](OOOutlineValue *v, decimal_key &k)
+				{
+					id n = [v value];
+					if (![n isKindOfClass: [NSNumber class]])
+					{
+						return false;
+					}
+					k = key_for_decimal([n decimalValue]);
+					return true;
+				});
+		case OOOutlineColumnTypeDate:
+			return sort_rows<int64_t, Ascending>(someRows, aColumn, [](OOOutlineValue *v, int64_t &k)
+				{
+					id d = [v value];
+					if (![d isKindOfClass: [NSDate class]])
+					{
+						return false;
+					}
+					k = key_for_date(d);
+					return true;
+				});
+		case OOOutlineColumnTypeEnumeration:
+			// Members are numbered in the order in which they are defined.
+			return sort_rows<NSUInteger, Ascending>(someRows, aColumn, [](OOOutlineValue *v, NSUInteger &k)
+				{
+					k = [v enumerationID];
+					return k != NSNotFound;
+				});
+		case OOOutlineColumnTypeCheckBox:
+			return sort_rows<NSInteger, Ascending>(someRows, aColumn, [](OOOutlineValue *v, NSInteger &k)
+				{
+					id state = [v value];
+					k = [state integerValue];
+					return state != nil;
+				});
+		case OOOutlineColumnTypeText:
+			break;
+	}
+	return sort_rows<std::u16string, Ascending>(someRows, aColumn, [](OOOutlineValue *v, std::u16string &k)
+		{
+			NSString *text = [v plainText];
+			if ([text length] == 0)
+			{
+				return false;
+			}
+			k = collation_key(text);
+			return true;
+		});
+}
 }
 
 NSString *const OOOutlineColumnsDidChangeNotification = @"OOOutlineColumnsDidChangeNotification";
 
 @implementation OOOutlineDocument
 {
-	NSMutableArray<OOOutlineColumn*> *columns;
+	/**
+	 * The columns, in display order.  This array is replaced, rather than
+	 * modified, when the columns change, so it can be used as an immutable
+	 * description of the column layout.
+	 */
+	NSArray<OOOutlineColumn*> *columns;
+	/**
+	 * Map from row IDs to rows.  This contains all of the rows in the
+	 * document, and the identifiers of rows that were read from files.
+	 */
+	row_index allRows;
+	/**
+	 * Lock protecting `allRows`, which is modified when rows are constructed
+	 * concurrently while loading, and read while saving.
+	 */
+	std::mutex allRowsLock;
+	/**
+	 * The snapshot taken on the main thread by the save in progress, to be
+	 * written by `-fileWrapperOfType:error:`.
+	 */
+	save_snapshot pendingSnapshot;
 }
 @synthesize
-	allRows,
 	columns,
+	columnsBySlot,
+	compressesContents,
+	compressionLevel,
+	filter,
+	journal,
 	noteColumn,
 	root,
+	searchIndex,
 	styleRegistry,
 	titleStyle,
 	windowHeight,
@@ -97,8 +284,192 @@ NSString *const OOOutlineColumnsDidChangeNotification = @"OOOutlineColumnsDidCha
 
 + (BOOL)autosavesInPlace
 {
-	// FIXME:
-	return NO;
+	return YES;
+}
+- (void)saveToURL: (NSURL*)url
+           ofType: (NSString*)typeName
+ forSaveOperation: (NSSaveOperationType)saveOperation
+completionHandler: (void (^)(NSError*))completionHandler
+{
+	BOOL isOO3 = [typeName isEqualToString: @"OmniOutliner3"];
+	// Autosaving appends the changes since the last save to the journal in
+	// the bundle, unless the journal cannot describe them.
+	if ((saveOperation == NSAutosaveInPlaceOperation) && isOO3 &&
+	    [url isEqual: [self fileURL]] && ![journal needsFullSave])
+	{
+		[self appendJournalToURL: url
+		       completionHandler: ^(BOOL appended) {
+			if (appended)
+			{
+				completionHandler(nil);
+				return;
+			}
+			[self saveContentsToURL: url
+			                 ofType: typeName
+			       forSaveOperation: saveOperation
+			      completionHandler: completionHandler];
+		}];
+		return;
+	}
+	[self saveContentsToURL: url
+	                 ofType: typeName
+	       forSaveOperation: saveOperation
+	      completionHandler: completionHandler];
+}
+/**
+ * Appends the changes since the last save to the journal in the bundle at
+ * `url`.  The file is accessed after any other save has finished, and the
+ * write is coordinated with other file presenters.  The completion handler is
+ * called on the main thread, with `NO` if the changes must instead be saved
+ * by writing the whole document.
+ */
+- (void)appendJournalToURL: (NSURL*)url
+         completionHandler: (void (^)(BOOL))completionHandler
+{
+	[self performAsynchronousFileAccessUsingBlock: ^(void (^fileAccessCompletionHandler)(void)) {
+		// The journal records edits on the main thread, so is only accessed
+		// there.
+		dispatch_block_t append = ^{
+			// An earlier save may have changed the file or the journal
+			// while this was waiting.
+			__block BOOL appended = NO;
+			if ([url isEqual: [self fileURL]] && ![journal needsFullSave])
+			{
+				id token = [self changeCountTokenForSaveOperation: NSAutosaveInPlaceOperation];
+				NSError *coordinationError;
+				__block NSError *appendError;
+				__block NSDate *date;
+				auto *coordinator = [[NSFileCoordinator alloc] initWithFilePresenter: self];
+				[coordinator coordinateWritingItemAtURL: url
+				                                options: NSFileCoordinatorWritingForMerging
+				                                  error: &coordinationError
+				                             byAccessor: ^(NSURL *newURL) {
+					NSError *e;
+					appended = [journal appendToBundle: newURL error: &e];
+					appendError = e;
+					// Appending to the journal modifies the file, so record
+					// the new date to avoid reporting it as changed by
+					// another application.
+					NSDate *d;
+					[newURL getResourceValue: &d
+					                  forKey: NSURLContentModificationDateKey
+					                   error: nullptr];
+					date = d;
+				}];
+				if (appended)
+				{
+					[self updateChangeCountWithToken: token
+					                forSaveOperation: NSAutosaveInPlaceOperation];
+					[self setFileModificationDate: date];
+				}
+				else
+				{
+					NSLog(@"Unable to append to journal: %@", appendError ?: coordinationError);
+				}
+			}
+			fileAccessCompletionHandler();
+			completionHandler(appended);
+		};
+		if ([NSThread isMainThread])
+		{
+			append();
+		}
+		else
+		{
+			dispatch_async(dispatch_get_main_queue(), append);
+		}
+	}];
+}
+/**
+ * Reads any children that cannot be written from the XML that they were
+ * deferred from.  Reading rows modifies the outline, so this must be called
+ * on the main thread before the rows are written in the background.
+ */
+- (void)prepareRowsForWriting
+{
+	// Unread children are copied from the file that they were read from,
+	// whose values were in slot order.
+	[root readDeferredChildrenNotMatchingLayout: columns];
+}
+/**
+ * Returns a snapshot of the document for writing as OmniOutliner 3 XML.  The
+ * header is written immediately, and the rows are captured as an immutable
+ * version that can be written on any thread.
+ */
+- (save_snapshot)snapshotForWriting
+{
+	OOXMLWriter *writer = [OOXMLWriter writer];
+	[self startOO3XML: writer];
+	return { writer, [root version], columns };
+}
+/**
+ * Saves the document by writing a new copy of the file.
+ */
+- (void)saveContentsToURL: (NSURL*)url
+                   ofType: (NSString*)typeName
+         forSaveOperation: (NSSaveOperationType)saveOperation
+        completionHandler: (void (^)(NSError*))completionHandler
+{
+	BOOL isOO3 = [typeName isEqualToString: @"OmniOutliner3"];
+	if (isOO3)
+	{
+		// Writing the header may traverse the rows to compute column widths,
+		// so the snapshot is taken here rather than on the thread that writes
+		// the file.
+		[self prepareRowsForWriting];
+		pendingSnapshot = [self snapshotForWriting];
+		// The journal is only accessed on the main thread, and records later
+		// changes relative to the snapshot.
+		[journal documentWillSave];
+	}
+	// Any save of the document's file replaces the bundle with one that does
+	// not contain a journal.
+	BOOL replacesJournal = isOO3 && (saveOperation != NSSaveToOperation) &&
+	                       (saveOperation != NSAutosaveElsewhereOperation);
+	[super saveToURL: url
+	           ofType: typeName
+	 forSaveOperation: saveOperation
+	completionHandler: ^(NSError *error) {
+		pendingSnapshot = {};
+		[journal documentDidSave: !error && replacesJournal];
+		completionHandler(error);
+	}];
+}
+- (BOOL)canAsynchronouslyWriteToURL: (NSURL*)url
+                              ofType: (NSString*)typeName
+                    forSaveOperation: (NSSaveOperationType)saveOperation
+{
+	// Saving copies the document before unblocking user interaction.
+	return [typeName isEqualToString: @"OmniOutliner3"];
+}
+- (void)canCloseDocumentWithDelegate: (id)aDelegate
+                 shouldCloseSelector: (SEL)aSelector
+                         contextInfo: (void*)aContext
+{
+	// Compact the journal into contents.xml, so that other applications that
+	// read the file see the current contents.  Documents that are closed
+	// without being asked first keep their journal, which is replayed when
+	// they are next opened.
+	NSURL *url = [self fileURL];
+	if (!url || ![journal hasJournalFile])
+	{
+		[super canCloseDocumentWithDelegate: aDelegate
+		                shouldCloseSelector: aSelector
+		                        contextInfo: aContext];
+		return;
+	}
+	[self saveToURL: url
+	           ofType: [self fileType]
+	 forSaveOperation: NSSaveOperation
+	completionHandler: ^(NSError *error) {
+		if (error)
+		{
+			NSLog(@"Unable to compact journal: %@", error);
+		}
+		[super canCloseDocumentWithDelegate: aDelegate
+		                shouldCloseSelector: aSelector
+		                        contextInfo: aContext];
+	}];
 }
 
 - (NSFileWrapper*)fileWrapperOfType: (NSString*)typeName
@@ -107,7 +478,50 @@ NSString *const OOOutlineColumnsDidChangeNotification = @"OOOutlineColumnsDidCha
 	// FIXME: Set the error for other file types.
 	if ([typeName isEqualToString: @"OmniOutliner3"])
 	{
-		NSData *contents = [[self oo3xmlValue] XMLDataWithOptions: NSXMLNodePrettyPrint];
+		// Saves take an immutable version of the rows on the main thread, and
+		// then write it while editing continues.  Versions share everything
+		// that has not changed, so only modified rows are copied.
+		save_snapshot snapshot = std::exchange(pendingSnapshot, {});
+		if (snapshot.writer == nil)
+		{
+			// Other callers have not taken a snapshot.
+			if ([NSThread isMainThread])
+			{
+				[self prepareRowsForWriting];
+			}
+			snapshot = [self snapshotForWriting];
+		}
+		OOXMLWriter *writer = snapshot.writer;
+		BOOL compresses = compressesContents;
+		float level = compressionLevel;
+		[self unblockUserInteraction];
+		if (![self finishOO3XML: writer
+		               withRows: snapshot.rows
+		                columns: snapshot.columns])
+		{
+			if (outError)
+			{
+				*outError = [NSError errorWithDomain: NSCocoaErrorDomain
+				                                code: NSFileWriteUnknownError
+				                            userInfo: @{ NSLocalizedFailureReasonErrorKey : @"Unable to write the outline." }];
+			}
+			return nil;
+		}
+		NSData *contents = [writer data];
+		if (compresses)
+		{
+			contents = [contents parallelGzippedDataWithCompressionLevel: level];
+			if (contents == nil)
+			{
+				if (outError)
+				{
+					*outError = [NSError errorWithDomain: NSCocoaErrorDomain
+					                                code: NSFileWriteUnknownError
+					                            userInfo: @{ NSLocalizedFailureReasonErrorKey : @"Unable to compress the document." }];
+				}
+				return nil;
+			}
+		}
 		// Note:
 		NSFileWrapper *wrapper = [[NSFileWrapper alloc] initDirectoryWithFileWrappers:
 			@{
@@ -117,75 +531,170 @@ NSString *const OOOutlineColumnsDidChangeNotification = @"OOOutlineColumnsDidCha
 	}
 	return nil;
 }
-- (BOOL)parseOO3XMLColumns: (NSXMLElement*)xml
+- (void)writeOO3XMLHeader: (OOXMLWriter*)aWriter
+   includingDerivedValues: (BOOL)includesDerivedValues
 {
-	columns = [NSMutableArray new];
-	for (NSXMLElement *c in [xml elementsForName: @"column"])
+	// FIXME: Not yet handling:
+	// settings
+	[styleRegistry writeOO3XML: aWriter];
+	[aWriter startElement: @"editor"];
+	[aWriter addAttribute: NSStringFromRange({ (NSUInteger)windowWidth,
+	                                           (NSUInteger)windowHeight })
+	             withName: @"content-size"];
+	[aWriter endElement];
+	[aWriter startElement: @"columns"];
+	[noteColumn writeOO3XML: aWriter includingDerivedValues: includesDerivedValues];
+	for (OOOutlineColumn *col in columns)
 	{
-		// FIXME: Handle default styles.
-		auto col = [[OOOutlineColumn alloc] initWithOO3XML: c
-		                                        inDocument: self];
-		if ([col isNoteColumn])
-		{
-			noteColumn = col;
-		}
-		else
+		[col writeOO3XML: aWriter includingDerivedValues: includesDerivedValues];
+	}
+	[aWriter endElement];
+}
+/**
+ * Writes the start of the OmniOutliner 3 XML for the document, up to and
+ * including the start tag of the `<root>` element.
+ */
+- (void)startOO3XML: (OOXMLWriter*)aWriter
+{
+	[aWriter writeXMLDeclarationWithDocumentType: @"outline"
+	                                    publicID: @"-//omnigroup.com//DTD OUTLINE 3.0//EN"
+	                                    systemID: @"http://www.omnigroup.com/namespace/OmniOutliner/xmloutline-v3.dtd"];
+	[aWriter startElement: @"outline"];
+	[aWriter addAttribute: @"http://www.omnigroup.com/namespace/OmniOutliner/v3"
+	             withName: @"xmlns"];
+	[self writeOO3XMLHeader: aWriter includingDerivedValues: YES];
+	[aWriter startElement: @"root"];
+}
+/**
+ * Writes the children of the root row version, with their values in the
+ * order of the columns in `aLayout`, and ends the XML started by
+ * `-startOO3XML:`.  Returns `NO` if any of the rows could not be written.
+ * This may be called on any thread.
+ */
+- (BOOL)finishOO3XML: (OOXMLWriter*)aWriter
+            withRows: (OOOutlineRowVersion*)rows
+             columns: (NSArray<OOOutlineColumn*>*)aLayout
+{
+	// Top-level rows are independent, so serialise them concurrently and then
+	// add them in order.  The output is the same as writing them directly.
+	NSUInteger depth = [aWriter depth];
+	std::vector<NSData*> elements([rows childCount]);
+	NSData *__strong *elementsPtr = elements.data();
+	// Exceptions cannot propagate out of the workers, so they are logged and
+	// the save fails.
+	std::atomic<bool> failed { false };
+	std::atomic<bool> *failedPtr = &failed;
+	dispatch_apply([rows childCount], dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t i) {
+		@autoreleasepool
 		{
-			[columns addObject: col];
+			OOXMLWriter *w = [OOXMLWriter writerAtDepth: depth];
+			@try
+			{
+				[[rows childAtIndex: i] writeOO3XML: w columns: aLayout];
+			}
+			@catch (NSException *e)
+			{
+				NSLog(@"Unable to write row: %@", e);
+				*failedPtr = true;
+				return;
+			}
+			elementsPtr[i] = [w data];
 		}
+	});
+	if (failed)
+	{
+		return NO;
 	}
+	for (NSData *element : elements)
+	{
+		[aWriter addWrittenElement: element];
+	}
+	[aWriter endElement];
+	[aWriter endElement];
 	return YES;
 }
-- (NSXMLDocument*)oo3xmlValue
-{
-	NSXMLDocument *doc = [NSXMLDocument document];
-	doc.standalone = NO;
-	// Not sure why, but this DTD doens't seem to work
-	static NSURL *oo3DTDURL = [NSURL URLWithString: @"http://www.omnigroup.com/namespace/OmniOutliner/xmloutline-v3.dtd"];
-	doc.DTD = [[NSXMLDTD alloc] initWithContentsOfURL: oo3DTDURL
-	                                          options: 0
-	                                            error: nullptr];
-	doc.DTD = [NSXMLDTD new];
-	doc.DTD.publicID = @"-//omnigroup.com//DTD OUTLINE 3.0//EN";
-	doc.DTD.systemID = @"http://www.omnigroup.com/namespace/OmniOutliner/xmloutline-v3.dtd";
-	[doc.DTD setName: @"outline"];
-	auto mkXML = [](NSString *name, NSDictionary *attrs)
-		{
-			return [NSXMLElement elementWithName: name
-							attributesDictionary: attrs];
-		};
-	auto *outline = mkXML(@"outline",
-	                      @{ @"xmlns" : @"http://www.omnigroup.com/namespace/OmniOutliner/v3" });
-	[doc addChild: outline];
-	// FIXME: Not yet handling:
-	// settings
-	auto addChildren = [&](NSString *name, auto dict, NSXMLElement *head=nil)
+/**
+ * Load the document from the contents of an OmniOutliner 3 `contents.xml`
+ * file, which may be compressed.  Compressed files are inflated as they are
+ * parsed.  If the bundle contains a journal then it is replayed afterwards.
+ */
+- (BOOL)readOO3XMLData: (NSData*)fileData
+               journal: (NSData*)journalData
+                 error: (NSError**)outError
+{
+	compressesContents = [fileData isGzippedData];
+	allRows.clear();
+	auto *reader = [[OOOutlineXMLReader alloc] initWithDocument: self];
+	reader.defersCollapsedChildren = YES;
+	reader.parsesRowsConcurrently = YES;
+	@try
+	{
+		NSError *e;
+		BOOL success = [reader readOO3XMLData: fileData error: &e];
+		if (e)
 		{
-			NSXMLElement *element = [NSXMLElement elementWithName: name];
-			if (head)
+			if (outError)
 			{
-				[element addChild: head];
+				*outError = e;
 			}
-			for (id val in dict)
+			NSLog(@"Error: %@", e);
+		}
+		if (!success)
+		{
+			return NO;
+		}
+	}
+	@catch (NSException *e)
+	{
+		NSLog(@"Exception: %@", e);
+		[NSApp reportException: e];
+		return NO;
+	}
+	journal = [[OOOutlineJournal alloc] initWithDocument: self];
+	if (journalData)
+	{
+		// Replayed changes are part of the file, so they cannot be undone.
+		[[self undoManager] disableUndoRegistration];
+		[journal replayJournal: journalData];
+		[[self undoManager] enableUndoRegistration];
+	}
+	std::lock_guard<std::mutex> g(lock);
+	[allDocs addObject: self];
+	return YES;
+}
+- (BOOL)readFromURL: (NSURL*)url
+             ofType: (NSString*)typeName
+              error: (NSError*_Nullable __autoreleasing*)outError
+{
+	// Map the contents of OmniOutliner 3 bundles, rather than reading them
+	// into a file wrapper, so that uncompressed files are parsed directly from
+	// the page cache.  Nothing that is constructed while loading refers to the
+	// file data, so the mapping is released as soon as the document is read.
+	NSURL *contentsURL = [url URLByAppendingPathComponent: @"contents.xml"];
+	if ([typeName isEqualToString: @"OmniOutliner3"] &&
+	    [contentsURL checkResourceIsReachableAndReturnError: nullptr])
+	{
+		NSError *e;
+		NSData *fileData = [NSData dataWithContentsOfURL: contentsURL
+		                                         options: NSDataReadingMappedAlways
+		                                           error: &e];
+		if (!fileData)
+		{
+			if (outError)
 			{
-				[element addChild: [val oo3xmlValue]];
+				*outError = e;
 			}
-			[outline addChild: element];
-			return element;
-		};
-
-	auto *editor = mkXML(@"editor",
-	                     @{ @"content-size" : NSStringFromRange({ (NSUInteger)windowWidth,
-	                                                              (NSUInteger)windowHeight }) });
-	[outline addChild: [styleRegistry oo3xmlValue]];
-	[outline addChild: editor];
-	addChildren(@"columns", columns, [noteColumn oo3xmlValue]);
-	addChildren(@"root", root.children);
-
-	NSError *e;
-	[doc validateAndReturnError: &e];
-	NSLog(@"Error: %@", e);
-	return doc;
+			return NO;
+		}
+		NSURL *journalURL = [url URLByAppendingPathComponent: OOOutlineJournalFileName];
+		NSData *journalData = [NSData dataWithContentsOfURL: journalURL
+		                                            options: NSDataReadingMappedIfSafe
+		                                              error: nullptr];
+		return [self readOO3XMLData: fileData
+		                    journal: journalData
+		                      error: outError];
+	}
+	return [super readFromURL: url ofType: typeName error: outError];
 }
 - (BOOL)readFromFileWrapper: (NSFileWrapper*)fileWrapper
                      ofType: (NSString*)typeName
@@ -216,54 +725,10 @@ NSString *const OOOutlineColumnsDidChangeNotification = @"OOOutlineColumnsDidCha
 		{
 			return NO;
 		}
-		NSData *fileData = [contents regularFileContents];
-		if ([fileData isGzippedData])
-		{
-			fileData = [fileData gunzippedData];
-		}
-		NSXMLDocument *xml = [[NSXMLDocument alloc] initWithData: fileData options: 0 error:&e];
-		if (error()) { return NO; }
-#if 0
-		NSData *dtdFile = [NSData dataWithContentsOfFile: [[NSBundle mainBundle] pathForResource: @"xmloutline-v3" ofType: @"dtd"]];
-		auto *dtd = [[NSXMLDTD alloc] initWithData: dtdFile options: 0 error: &e];
-		if (error()) { return NO; }
-		// This always reports no DTD found, yet [xml DTD] reports a DTD.
-		[xml setDTD: dtd];
-		[xml validateAndReturnError: &e];
-		if (error()) { return NO; }
-#endif
-		allRows = [NSMapTable strongToWeakObjectsMapTable];
-		auto *docRoot = [xml rootElement];
-		auto *rowRoot = [docRoot elementForName: @"root"];
-		styleRegistry = [[OOStyleRegistry alloc] initWithOO3XML: [docRoot elementForName: @"style-attribute-registry"]];
-		if (auto *s = [rowRoot elementForName: @"style"])
-		{
-			titleStyle = [styleRegistry partialStyleForOO3XML: s inheritsFrom: nil];
-		}
-		[self parseOO3XMLColumns: [docRoot elementForName: @"columns"]];
-		root = [[OOOutlineRow alloc] initInDocument: self];
-		NSXMLElement *editorNode = [docRoot elementForName: @"editor"];
-		NSRange r = NSRangeFromString([[editorNode attributeForName: @"content-size"] stringValue]);
-		windowWidth = r.location;
-		windowHeight = r.length;
-		// FIXME: Restore selected row / column
-		@try
-		{
-			for (NSXMLElement *item in [rowRoot elementsForName: @"item"])
-			{
-				[root.children addObject: [[OOOutlineRow alloc] initWithOO3XMLNode: item
-				                                                        inDocument: self]];
-			}
-		}
-		@catch (NSException *e)
-		{
-			NSLog(@"Exception: %@", e);
-			[NSApp reportException: e];
-			return NO;
-		}
-		std::lock_guard<std::mutex> g(lock);
-		[allDocs addObject: self];
-		return YES;
+		NSFileWrapper *journalWrapper = [fileWrapper.fileWrappers objectForKey: OOOutlineJournalFileName];
+		return [self readOO3XMLData: [contents regularFileContents]
+		                    journal: [journalWrapper regularFileContents]
+		                      error: outError];
 	}
 	if ([typeName isEqualToString: @"OmniOutliner2"] &&
 		![fileWrapper isDirectory])
@@ -273,11 +738,11 @@ NSString *const OOOutlineColumnsDidChangeNotification = @"OOOutlineColumnsDidCha
 		                                                                   format: nullptr
 		                                                                    error: &e];
 		if (error()) { return NO; }
-		allRows = [NSMapTable strongToWeakObjectsMapTable];
+		allRows.clear();
 		styleRegistry = [[OOStyleRegistry alloc] init];
 		// FIXME: Should this be something sensible?
 		titleStyle = nil;
-		columns = [NSMutableArray new];
+		auto *cols = [NSMutableArray new];
 		NSUInteger colCount = [[docRoot objectForKey: @"Columns"] count];
 		assert(colCount > 0);
 		NSUInteger notesIdx = -1ULL;
@@ -294,12 +759,14 @@ NSString *const OOOutlineColumnsDidChangeNotification = @"OOOutlineColumnsDidCha
 			}
 			else
 			{
-				[columns addObject: col];
+				[cols addObject: col];
 			}
 		}
+		[self setColumns: cols noteColumn: noteColumn];
 		NSDictionary *rootNode = [docRoot objectForKey: @"Root Item"];
 		assert(rootNode);
 		root = [[OOOutlineRow alloc] initInDocument: self];
+		journal = [[OOOutlineJournal alloc] initWithDocument: self];
 		// Window size is not encoded in OO2 files, so just pick some sane(ish) values.
 		windowWidth = 400;
 		windowHeight = 600;
@@ -329,59 +796,290 @@ NSString *const OOOutlineColumnsDidChangeNotification = @"OOOutlineColumnsDidCha
 {
 	return [columns count];
 }
+- (instancetype)init
+{
+	OO_SUPER_INIT();
+	compressionLevel = -1;
+	return self;
+}
 - (id)initWithType: (NSString*)typeName
              error: (NSError*_Nullable __autoreleasing *)outError
 {
-	OO_SUPER_INIT();
-	allRows = [NSMapTable strongToWeakObjectsMapTable];
+	if (!(self = [self init]))
+	{
+		return nil;
+	}
 	styleRegistry = [[OOStyleRegistry alloc] init];
-	columns = [NSMutableArray new];
 	auto *outlineColumn = [[OOOutlineColumn alloc] initWithType: OOOutlineColumnTypeText
 	                                                 inDocument: self];
 	outlineColumn.isOutlineColumn = YES;
-	[columns addObject: outlineColumn];
-	noteColumn = [[OOOutlineColumn alloc] initWithType: OOOutlineColumnTypeText
-	                                        inDocument: self];
-	noteColumn.isNoteColumn = YES;
+	auto *notes = [[OOOutlineColumn alloc] initWithType: OOOutlineColumnTypeText
+	                                         inDocument: self];
+	notes.isNoteColumn = YES;
+	[self setColumns: [NSMutableArray arrayWithObject: outlineColumn]
+	      noteColumn: notes];
 	root = [[OOOutlineRow alloc] initInDocument: self];
 	windowWidth = 400;
 	windowHeight = 600;
+	journal = [[OOOutlineJournal alloc] initWithDocument: self];
 	[root.children addObject: [[OOOutlineRow alloc] initInDocument: self]];
 	std::lock_guard<std::mutex> g(lock);
 	[allDocs addObject: self];
 	return self;
 }
+- (OOOutlineRowID)registerRow: (OOOutlineRow*)aRow
+               withIdentifier: (NSString*)anIdentifier
+{
+	std::lock_guard<std::mutex> g(allRowsLock);
+	return allRows.add(aRow, anIdentifier);
+}
+- (void)unregisterRow: (OOOutlineRow*)aRow
+{
+	std::lock_guard<std::mutex> g(allRowsLock);
+	allRows.remove(aRow, aRow.rowID);
+}
+- (OOOutlineRow*)rowWithID: (OOOutlineRowID)anID
+{
+	std::lock_guard<std::mutex> g(allRowsLock);
+	return allRows.row(anID);
+}
+- (OOOutlineRow*)rowWithIdentifier: (NSString*)anIdentifier
+{
+	std::lock_guard<std::mutex> g(allRowsLock);
+	return allRows.row(anIdentifier);
+}
+- (NSString*)identifierForRowID: (OOOutlineRowID)anID
+{
+	std::lock_guard<std::mutex> g(allRowsLock);
+	return allRows.identifier(anID);
+}
 - (OOOutlineRow*)parentForRow: (OOOutlineRow*)aRow
 {
-	std::function<OOOutlineRow*(OOOutlineRow*)> recurse;
-	recurse = [&](OOOutlineRow *r) -> OOOutlineRow*
+	return aRow.parent;
+}
+- (void)setStyleRegistry: (OOStyleRegistry*)aRegistry
+{
+	styleRegistry = aRegistry;
+}
+- (void)setTitleStyle: (OOPartialStyle*)aStyle
+{
+	titleStyle = aStyle;
+}
+- (void)setColumns: (NSMutableArray<OOOutlineColumn*>*)aColumns
+        noteColumn: (OOOutlineColumn*)aNoteColumn
+{
+	columns = [aColumns copy];
+	columnsBySlot = columns;
+	NSUInteger slot = 0;
+	for (OOOutlineColumn *col in columns)
+	{
+		col.slot = slot++;
+	}
+	noteColumn = aNoteColumn;
+}
+- (void)setRoot: (OOOutlineRow*)aRow
+{
+	root = aRow;
+	// The indexes describe the old rows.
+	searchIndex = nil;
+	if (filter)
+	{
+		OOOutlineFilterCondition *condition = filter.condition;
+		filter = nil;
+		[self setFilterCondition: condition];
+	}
+}
+- (OOOutlineFilterCondition*)filterCondition
+{
+	return filter.condition;
+}
+- (void)setFilterCondition: (OOOutlineFilterCondition*)aCondition
+{
+	if ((filter == nil) && (aCondition != nil))
+	{
+		filter = [[OOOutlineFilter alloc] initWithDocument: self];
+	}
+	filter.condition = aCondition;
+}
+- (OOOutlineSearchIndex*)searchIndexCreatingIfNeeded
+{
+	if (searchIndex == nil)
+	{
+		searchIndex = [[OOOutlineSearchIndex alloc] initWithDocument: self];
+	}
+	return searchIndex;
+}
+- (void)columnDidChangeType: (OOOutlineColumn*)aColumn
+{
+	NSUInteger idx = [columns indexOfObjectIdenticalTo: aColumn];
+	if (idx == NSNotFound)
+	{
+		return;
+	}
+	__block std::vector<OOOutlineRow*> rows;
+	visitRows(root, [&](OOOutlineRow *aRow)
+		{
+			rows.push_back(aRow);
+			return false;
+		});
+	// Constructing values is thread safe (rows are parsed concurrently), so
+	// convert in parallel, in chunks so that each task does a useful amount
+	// of work, and then update the rows on this thread.
+	const size_t chunk = 1024;
+	__block std::vector<OOOutlineValue*> converted(rows.size());
+	dispatch_apply((rows.size() + chunk - 1) / chunk, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t c) {
+		@autoreleasepool
 		{
-			for (OOOutlineRow *c in r.children)
+			for (size_t i=c*chunk ; i<std::min(rows.size(), (c+1)*chunk) ; i++)
 			{
-				if (c == aRow)
+				// Empty values stay empty, so rows that do not store a
+				// value for this column do not need one.
+				if (id val = [[rows[i].values objectAtIndex: idx] value])
 				{
-					return r;
-				}
-				if (auto *ret = recurse(c))
-				{
-					return ret;
+					converted[i] = [[OOOutlineValue alloc] initWithValue: val
+					                                            inColumn: aColumn];
 				}
 			}
-			return nil;
-		};
-	return recurse(root);
+		}
+	});
+	// The column type is part of the header, so this requires a full save
+	// and there is no need to record each value.
+	[journal suspend];
+	for (size_t i=0 ; i<rows.size() ; i++)
+	{
+		if (converted[i])
+		{
+			[rows[i].values replaceObjectAtIndex: idx withObject: converted[i]];
+		}
+	}
+	[journal resume];
+	[journal requireFullSave];
 }
-- (void)addColumn: (OOOutlineColumn*)aColumn
+/**
+ * Replaces the columns with a new array and notifies observers.
+ */
+- (void)replaceColumns: (NSArray<OOOutlineColumn*>*)aColumns
 {
-	[columns addObject: aColumn];
-	// FIXME: Add undo operation
-	visitRows(root, [&](OOOutlineRow *aRow)
-		{
-			[[aRow values] addObject: [OOOutlineValue placeholder]];
-			return false;
-		});
+	columns = [aColumns copy];
 	// FIXME: Userinfo dictionary should probably contain the column.
 	[[NSNotificationCenter defaultCenter] postNotificationName: OOOutlineColumnsDidChangeNotification
 	                                                    object: self];
 }
+- (void)addColumn: (OOOutlineColumn*)aColumn
+{
+	[self insertColumn: aColumn atIndex: [columns count]];
+}
+- (void)insertColumn: (OOOutlineColumn*)aColumn
+             atIndex: (NSUInteger)anIndex
+{
+	// Columns that were removed keep their slot, so that undoing the removal
+	// restores their values.  Other columns are given a new slot, which no
+	// row stores a value for yet, so no rows need to be modified.
+	NSUInteger slot = aColumn.slot;
+	BOOL isNew = (slot >= [columnsBySlot count]) ||
+	             ([columnsBySlot objectAtIndex: slot] != aColumn);
+	BOOL isJournaled = isNew && (anIndex == [columns count]);
+	if (isJournaled)
+	{
+		[journal documentWillAddColumn];
+	}
+	if (isNew)
+	{
+		aColumn.slot = [columnsBySlot count];
+		columnsBySlot = [columnsBySlot arrayByAddingObject: aColumn];
+	}
+	scoped_undo_grouping undo([self undoManager], @"insert column");
+	[undo.record(self) removeColumnAtIndex: anIndex];
+	auto *cols = [columns mutableCopy];
+	[cols insertObject: aColumn atIndex: anIndex];
+	[self replaceColumns: cols];
+	if (isJournaled)
+	{
+		[journal documentDidAddColumn: aColumn];
+	}
+	else
+	{
+		[journal requireFullSave];
+	}
+}
+- (void)removeColumnAtIndex: (NSUInteger)anIndex
+{
+	// The values stay in the rows, so this does not need to visit them.
+	OOOutlineColumn *col = [columns objectAtIndex: anIndex];
+	scoped_undo_grouping undo([self undoManager], @"remove column");
+	[undo.record(self) insertColumn: col atIndex: anIndex];
+	auto *cols = [columns mutableCopy];
+	[cols removeObjectAtIndex: anIndex];
+	[self replaceColumns: cols];
+	[journal requireFullSave];
+}
+- (void)sortChildrenOfRow: (OOOutlineRow*)aRow
+                 byColumn: (OOOutlineColumn*)aColumn
+                    order: (OOOutlineColumnSortOrder)anOrder
+              recursively: (BOOL)isRecursive
+{
+	scoped_undo_grouping undo([self undoManager], @"sort");
+	for (OOOutlineColumn *col in columns)
+	{
+		OOOutlineColumnSortOrder order = (col == aColumn) ? anOrder : OOOutlineColumnSortNone;
+		if (col.sortOrder != order)
+		{
+			[undo.record(col) setSortOrder: col.sortOrder];
+			col.sortOrder = order;
+		}
+	}
+	// The sort order is part of the header, so this requires a full save.
+	[journal requireFullSave];
+	if (anOrder == OOOutlineColumnSortNone)
+	{
+		return;
+	}
+	std::vector<OOOutlineRow*> parents;
+	auto collect = [&](OOOutlineRow *r)
+		{
+			if ([r.children count] > 1)
+			{
+				parents.push_back(r);
+			}
+			return !isRecursive;
+		};
+	visitRows(aRow, collect);
+	for (OOOutlineRow *r : parents)
+	{
+		NSArray<OOOutlineRow*> *children = [r.children copy];
+		NSArray<OOOutlineRow*> *sorted = (anOrder == OOOutlineColumnSortAscending) ?
+			sort_rows<true>(children, aColumn) :
+			sort_rows<false>(children, aColumn);
+		if (![sorted isEqualToArray: children])
+		{
+			[self setOrderOfChildren: sorted ofRow: r];
+		}
+	}
+}
+- (void)setOrderOfChildren: (NSArray<OOOutlineRow*>*)someRows
+                     ofRow: (OOOutlineRow*)aRow
+{
+	NSMutableArray<OOOutlineRow*> *children = aRow.children;
+	NSUInteger count = [children count];
+	NSAssert([someRows count] == count, @"Children can only be reordered");
+	scoped_undo_grouping undo([self undoManager], @"sort");
+	[undo.record(self) setOrderOfChildren: [children copy] ofRow: aRow];
+	// Inserting the rows before removing them from their old positions makes
+	// this a move, so they never leave the outline.
+	[children insertObjects: someRows
+	              atIndexes: [NSIndexSet indexSetWithIndexesInRange: NSMakeRange(0, count)]];
+	[children removeObjectsAtIndexes: [NSIndexSet indexSetWithIndexesInRange: NSMakeRange(count, count)]];
+}
+- (void)moveColumnAtIndex: (NSUInteger)anIndex
+                  toIndex: (NSUInteger)aNewIndex
+{
+	OOOutlineColumn *col = [columns objectAtIndex: anIndex];
+	scoped_undo_grouping undo([self undoManager], @"move column");
+	[undo.record(self) moveColumnAtIndex: aNewIndex toIndex: anIndex];
+	auto *cols = [columns mutableCopy];
+	[cols removeObjectAtIndex: anIndex];
+	[cols insertObject: col atIndex: aNewIndex];
+	[self replaceColumns: cols];
+	[journal requireFullSave];
+}
 @end
@@ -0,0 +1,159 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OOOutlineRow.h"
+
+@class OOOutlineColumn;
+@class OOOutlineDocument;
+
+/**
+ * Notification posted, with the document as the object, when the set of rows
+ * that are visible in the document's filtered outline changes.
+ */
+extern NSString *const OOOutlineFilterDidChangeNotification;
+
+/**
+ * A condition that rows must satisfy to be shown in a filtered outline.
+ * Conditions are immutable and are constructed with the factory methods of
+ * this class cluster.  They refer to columns, rather than column indexes, so
+ * remain valid when columns are reordered.
+ */
+@interface OOOutlineFilterCondition : NSObject
+/**
+ * Matches rows whose value in a number or date column is between `aMinimum`
+ * and `aMaximum`, inclusive.  The bounds are `NSNumber` or `NSDate` instances,
+ * and either may be `nil` for a range that is unbounded at that end.  Numbers
+ * are compared exactly, as decimals.
+ */
++ (instancetype)conditionWithColumn: (OOOutlineColumn*)aColumn
+                            minimum: (id)aMinimum
+                            maximum: (id)aMaximum;
+/**
+ * Matches rows whose value in an enumeration column is a member with one of
+ * the specified labels.
+ */
++ (instancetype)conditionWithColumn: (OOOutlineColumn*)aColumn
+                  enumerationLabels: (NSArray<NSString*>*)someLabels;
+/**
+ * Matches rows whose value in the column contains the string, ignoring case.
+ */
++ (instancetype)conditionWithColumn: (OOOutlineColumn*)aColumn
+                     containingText: (NSString*)aString;
+/**
+ * Matches rows whose note contains the string, ignoring case.
+ */
++ (instancetype)conditionWithNoteContainingText: (NSString*)aString;
+/**
+ * Matches rows whose checkbox is in the specified state.
+ */
++ (instancetype)conditionWithCheckedState: (OOOutlineRowCheckedState)aState;
+/**
+ * Matches rows that match every one of the conditions.
+ */
++ (instancetype)conditionMatchingAll: (NSArray<OOOutlineFilterCondition*>*)someConditions;
+/**
+ * Matches rows that match at least one of the conditions.
+ */
++ (instancetype)conditionMatchingAny: (NSArray<OOOutlineFilterCondition*>*)someConditions;
+/**
+ * Matches rows that do not match the condition.
+ */
++ (instancetype)conditionNegating: (OOOutlineFilterCondition*)aCondition;
+/**
+ * Returns whether the row matches this condition.  This evaluates the
+ * condition for a single row, without using the filter's indexes.
+ */
+- (BOOL)matchesRow: (OOOutlineRow*)aRow;
+@end
+
+/**
+ * The filtered projection of a document's outline.  When a condition is set,
+ * the outline shows the rows that match it and their ancestors, so that every
+ * match is shown in context.
+ *
+ * The filter indexes every row of the document when it is created, keeping
+ * sorted keys for number and date columns, posting lists for enumeration
+ * columns, and bitmaps of checked states, so that changing the condition does
+ * not need to examine every row.  Indexes for a column are built the first
+ * time that a condition uses it.  Rows call the filter when they are edited,
+ * inserted, removed, or moved, and only those rows are evaluated again.
+ */
+@interface OOOutlineFilter : NSObject
+/**
+ * Constructs a filter for the specified document and indexes its rows.  This
+ * reads any rows whose children were deferred when the document was loaded.
+ */
+- (instancetype)initWithDocument: (OOOutlineDocument*)aDocument;
+/**
+ * The condition that rows must match to be shown, or `nil` if all rows are
+ * shown.
+ */
+@property (nonatomic) OOOutlineFilterCondition *condition;
+/**
+ * Returns whether the row is shown, because it matches the condition or one of
+ * its descendants does.  The root and, if there is no condition, every row in
+ * the outline are shown.
+ */
+- (BOOL)isRowVisible: (OOOutlineRow*)aRow;
+/**
+ * Returns the children of the row that are shown, in order.  The result is
+ * cached until the children or their visibility change.
+ */
+- (NSArray<OOOutlineRow*>*)visibleChildrenOfRow: (OOOutlineRow*)aRow;
+/**
+ * Returns the index in the children of `aRow` that corresponds to an index in
+ * its visible children, for inserting rows before a visible child.  Indexes
+ * past the last visible child map to the position after it.
+ */
+- (NSUInteger)childIndexForVisibleIndex: (NSUInteger)anIndex
+                                  ofRow: (OOOutlineRow*)aRow;
+/**
+ * Records that a row and its descendants have been added to the outline.
+ */
+- (void)rowWasAdded: (OOOutlineRow*)aRow;
+/**
+ * Records that a row and its descendants have been removed from the outline.
+ */
+- (void)rowWasRemoved: (OOOutlineRow*)aRow;
+/**
+ * Records that a row in the outline has been moved to a new parent.
+ */
+- (void)rowDidMove: (OOOutlineRow*)aRow;
+/**
+ * Records that the order of a row's children has changed.
+ */
+- (void)rowDidChangeChildren: (OOOutlineRow*)aRow;
+/**
+ * Records that a value, the note, or the checked state of a row has changed.
+ */
+- (void)rowDidChange: (OOOutlineRow*)aRow;
+/**
+ * Records that a row's ID has changed.
+ */
+- (void)row: (OOOutlineRow*)aRow didChangeIDFrom: (OOOutlineRowID)anID;
+@end
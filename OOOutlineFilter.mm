@@ -0,0 +1,1124 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import "OpenOutliner.h"
+#import "row_index.h"
+#import "sort_keys.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <optional>
+#include <set>
+#include <vector>
+
+NSString *const OOOutlineFilterDidChangeNotification = @"OOOutlineFilterDidChangeNotification";
+
+namespace {
+/**
+ * Position used for rows that are not in the filter's tables, and for the
+ * parent of the root.
+ */
+constexpr uint32_t no_position = UINT32_MAX;
+
+/**
+ * A set of row positions.
+ */
+class bitmap
+{
+	/**
+	 * The bits, 64 positions per word.  Positions past the end are not in the
+	 * set.
+	 */
+	std::vector<uint64_t> words;
+	public:
+	/**
+	 * Returns whether a position is in the set.
+	 */
+	bool test(size_t aPosition) const
+	{
+		size_t w = aPosition / 64;
+		return (w < words.size()) && ((words[w] >> (aPosition % 64)) & 1);
+	}
+	/**
+	 * Adds a position to the set.
+	 */
+	void set(size_t aPosition)
+	{
+		size_t w = aPosition / 64;
+		if (w >= words.size())
+		{
+			words.resize(w + 1);
+		}
+		words[w] |= uint64_t(1) << (aPosition % 64);
+	}
+	/**
+	 * Removes a position from the set.
+	 */
+	void reset(size_t aPosition)
+	{
+		size_t w = aPosition / 64;
+		if (w < words.size())
+		{
+			words[w] &= ~(uint64_t(1) << (aPosition % 64));
+		}
+	}
+	/**
+	 * Adds a position to, or removes it from, the set.
+	 */
+	void assign(size_t aPosition, bool aFlag)
+	{
+		if (aFlag)
+		{
+			set(aPosition);
+		}
+		else
+		{
+			reset(aPosition);
+		}
+	}
+	/**
+	 * Intersects this set with another.
+	 */
+	bitmap &operator&=(const bitmap &aSet)
+	{
+		words.resize(std::min(words.size(), aSet.words.size()));
+		for (size_t i=0 ; i<words.size() ; i++)
+		{
+			words[i] &= aSet.words[i];
+		}
+		return *this;
+	}
+	/**
+	 * Adds all of the positions in another set to this one.
+	 */
+	bitmap &operator|=(const bitmap &aSet)
+	{
+		words.resize(std::max(words.size(), aSet.words.size()));
+		for (size_t i=0 ; i<aSet.words.size() ; i++)
+		{
+			words[i] |= aSet.words[i];
+		}
+		return *this;
+	}
+	/**
+	 * Removes all of the positions in another set from this one.
+	 */
+	bitmap &operator-=(const bitmap &aSet)
+	{
+		for (size_t i=0, e=std::min(words.size(), aSet.words.size()) ; i<e ; i++)
+		{
+			words[i] &= ~aSet.words[i];
+		}
+		return *this;
+	}
+	/**
+	 * Calls `aVisitor` with each position in the set, in ascending order.
+	 */
+	template<typename F>
+	void for_each(F &&aVisitor) const
+	{
+		for (size_t i=0 ; i<words.size() ; i++)
+		{
+			for (uint64_t bits = words[i] ; bits != 0 ; bits &= bits - 1)
+			{
+				aVisitor(i * 64 + static_cast<size_t>(__builtin_ctzll(bits)));
+			}
+		}
+	}
+};
+
+/**
+ * Key that number and date values are indexed by.  Numbers are compared
+ * exactly by their decimal key, and dates by their time interval.  The values
+ * in a column are all of one kind, so only keys of the same kind are compared
+ * with each other.
+ */
+struct range_key
+{
+	/**
+	 * The key for a number, or zero for a date.
+	 */
+	decimal_key number;
+	/**
+	 * The time interval since the reference date for a date, or zero for a
+	 * number.
+	 */
+	double date;
+	bool operator<(const range_key &aKey) const
+	{
+		return (number < aKey.number) ||
+		       ((number == aKey.number) && (date < aKey.date));
+	}
+	bool operator==(const range_key &aKey) const
+	{
+		return (number == aKey.number) && (date == aKey.date);
+	}
+	/**
+	 * Returns a key that is less than the key for any value.
+	 */
+	static range_key lowest()
+	{
+		return { { INT32_MIN, 0 }, -INFINITY };
+	}
+	/**
+	 * Returns a key that is greater than the key for any value.
+	 */
+	static range_key highest()
+	{
+		return { { INT32_MAX, ~static_cast<unsigned __int128>(0) }, INFINITY };
+	}
+};
+
+/**
+ * Returns the key that number and date values are indexed by, or no key for
+ * other objects.
+ */
+std::optional<range_key> key_for_object(id anObject)
+{
+	if ([anObject isKindOfClass: [NSNumber class]])
+	{
+		return range_key { key_for_decimal([anObject decimalValue]), 0 };
+	}
+	if ([anObject isKindOfClass: [NSDate class]])
+	{
+		return range_key { { 0, 0 }, [anObject timeIntervalSinceReferenceDate] };
+	}
+	return std::nullopt;
+}
+
+/**
+ * Index of the number or date keys of the rows in a column, ordered so that
+ * the rows in a range are found with a binary search.  Updating a row's key
+ * is O(log n).
+ */
+class sorted_index
+{
+	/**
+	 * The rows that have keys, as key and position pairs.
+	 */
+	std::set<std::pair<range_key, uint32_t>> entries;
+	/**
+	 * The key for each position, if the row has one.
+	 */
+	std::vector<std::optional<range_key>> keys;
+	public:
+	/**
+	 * Constructs the index from the keys for each position.
+	 */
+	void build(std::vector<std::optional<range_key>> &&someKeys)
+	{
+		keys = std::move(someKeys);
+		std::vector<std::pair<range_key, uint32_t>> sorted;
+		for (size_t i=0 ; i<keys.size() ; i++)
+		{
+			if (keys[i])
+			{
+				sorted.push_back({ *keys[i], static_cast<uint32_t>(i) });
+			}
+		}
+		parallel_sort(sorted);
+		// Inserting in order at the end is amortised constant time.
+		entries.clear();
+		for (auto &entry : sorted)
+		{
+			entries.insert(entries.end(), entry);
+		}
+	}
+	/**
+	 * Sets the key for a position.  `aKey` is empty if the row has no key.
+	 */
+	void set(uint32_t aPosition, std::optional<range_key> aKey)
+	{
+		if (keys.size() <= aPosition)
+		{
+			keys.resize(aPosition + 1);
+		}
+		std::optional<range_key> &old = keys[aPosition];
+		if (old == aKey)
+		{
+			return;
+		}
+		if (old)
+		{
+			entries.erase({ *old, aPosition });
+		}
+		if (aKey)
+		{
+			entries.insert({ *aKey, aPosition });
+		}
+		old = aKey;
+	}
+	/**
+	 * Adds the positions of the rows whose keys are in the inclusive range to
+	 * `aResult`.
+	 */
+	void find(const range_key &aMinimum, const range_key &aMaximum, bitmap &aResult) const
+	{
+		auto b = entries.lower_bound({ aMinimum, uint32_t(0) });
+		auto e = entries.upper_bound({ aMaximum, no_position });
+		for ( ; b!=e ; ++b)
+		{
+			aResult.set(b->second);
+		}
+	}
+};
+
+/**
+ * Index of the enumeration members of the rows in a column.
+ */
+class enum_index
+{
+	/**
+	 * The positions of the rows that refer to each member, indexed by
+	 * member ID.
+	 */
+	std::vector<bitmap> postings;
+	/**
+	 * The member ID for each position, or `no_position` if the row has no
+	 * member.
+	 */
+	std::vector<uint32_t> members;
+	public:
+	/**
+	 * Sets the member for a position.  `aMember` is `NSNotFound` if the row
+	 * has no member.
+	 */
+	void set(uint32_t aPosition, NSUInteger aMember)
+	{
+		uint32_t member = (aMember == NSNotFound) ? no_position : static_cast<uint32_t>(aMember);
+		if (members.size() <= aPosition)
+		{
+			members.resize(aPosition + 1, no_position);
+		}
+		uint32_t old = members[aPosition];
+		if (old == member)
+		{
+			return;
+		}
+		if (old != no_position)
+		{
+			postings[old].reset(aPosition);
+		}
+		if (member != no_position)
+		{
+			if (postings.size() <= member)
+			{
+				postings.resize(member + 1);
+			}
+			postings[member].set(aPosition);
+		}
+		members[aPosition] = member;
+	}
+	/**
+	 * Adds the positions of the rows that refer to a member to `aResult`.
+	 */
+	void find(NSUInteger aMember, bitmap &aResult) const
+	{
+		if (aMember < postings.size())
+		{
+			aResult |= postings[aMember];
+		}
+	}
+};
+}
+
+@interface OOOutlineFilter ()
+/**
+ * The positions of all of the rows in the outline, except the root.
+ */
+- (const bitmap&)liveRows;
+/**
+ * Returns the row at the specified position.
+ */
+- (OOOutlineRow*)rowAtPosition: (size_t)aPosition;
+/**
+ * Returns the positions of the rows with the specified checked state.
+ */
+- (const bitmap&)rowsWithCheckedState: (OOOutlineRowCheckedState)aState;
+/**
+ * Returns the index of the number and date keys in the column, building it if
+ * this is the first time that it has been used.
+ */
+- (const sorted_index&)sortedIndexForColumn: (OOOutlineColumn*)aColumn;
+/**
+ * Returns the index of the enumeration members in the column, building it if
+ * this is the first time that it has been used.
+ */
+- (const enum_index&)enumerationIndexForColumn: (OOOutlineColumn*)aColumn;
+@end
+
+@interface OOOutlineFilterCondition ()
+/**
+ * Returns the positions of the rows in the filter that match this condition.
+ * The default implementation evaluates `-matchesRow:` for every row, and
+ * subclasses override it to use the filter's indexes.
+ */
+- (bitmap)matchesInFilter: (OOOutlineFilter*)aFilter;
+@end
+
+@interface OOOutlineRangeCondition : OOOutlineFilterCondition
+- (instancetype)initWithColumn: (OOOutlineColumn*)aColumn
+                       minimum: (id)aMinimum
+                       maximum: (id)aMaximum;
+@end
+@interface OOOutlineEnumerationCondition : OOOutlineFilterCondition
+- (instancetype)initWithColumn: (OOOutlineColumn*)aColumn
+                        labels: (NSArray<NSString*>*)someLabels;
+@end
+@interface OOOutlineColumnTextCondition : OOOutlineFilterCondition
+- (instancetype)initWithColumn: (OOOutlineColumn*)aColumn
+                          text: (NSString*)aString;
+@end
+@interface OOOutlineNoteTextCondition : OOOutlineFilterCondition
+- (instancetype)initWithText: (NSString*)aString;
+@end
+@interface OOOutlineCheckedStateCondition : OOOutlineFilterCondition
+- (instancetype)initWithState: (OOOutlineRowCheckedState)aState;
+@end
+@interface OOOutlineAllCondition : OOOutlineFilterCondition
+- (instancetype)initWithConditions: (NSArray<OOOutlineFilterCondition*>*)someConditions;
+@end
+@interface OOOutlineAnyCondition : OOOutlineFilterCondition
+- (instancetype)initWithConditions: (NSArray<OOOutlineFilterCondition*>*)someConditions;
+@end
+@interface OOOutlineNotCondition : OOOutlineFilterCondition
+- (instancetype)initWithCondition: (OOOutlineFilterCondition*)aCondition;
+@end
+
+@implementation OOOutlineFilterCondition
++ (instancetype)conditionWithColumn: (OOOutlineColumn*)aColumn
+                            minimum: (id)aMinimum
+                            maximum: (id)aMaximum
+{
+	return [[OOOutlineRangeCondition alloc] initWithColumn: aColumn
+	                                               minimum: aMinimum
+	                                               maximum: aMaximum];
+}
++ (instancetype)conditionWithColumn: (OOOutlineColumn*)aColumn
+                  enumerationLabels: (NSArray<NSString*>*)someLabels
+{
+	return [[OOOutlineEnumerationCondition alloc] initWithColumn: aColumn
+	                                                      labels: someLabels];
+}
++ (instancetype)conditionWithColumn: (OOOutlineColumn*)aColumn
+                     containingText: (NSString*)aString
+{
+	return [[OOOutlineColumnTextCondition alloc] initWithColumn: aColumn
+	                                                       text: aString];
+}
++ (instancetype)conditionWithNoteContainingText: (NSString*)aString
+{
+	return [[OOOutlineNoteTextCondition alloc] initWithText: aString];
+}
++ (instancetype)conditionWithCheckedState: (OOOutlineRowCheckedState)aState
+{
+	return [[OOOutlineCheckedStateCondition alloc] initWithState: aState];
+}
++ (instancetype)conditionMatchingAll: (NSArray<OOOutlineFilterCondition*>*)someConditions
+{
+	return [[OOOutlineAllCondition alloc] initWithConditions: someConditions];
+}
++ (instancetype)conditionMatchingAny: (NSArray<OOOutlineFilterCondition*>*)someConditions
+{
+	return [[OOOutlineAnyCondition alloc] initWithConditions: someConditions];
+}
++ (instancetype)conditionNegating: (OOOutlineFilterCondition*)aCondition
+{
+	return [[OOOutlineNotCondition alloc] initWithCondition: aCondition];
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	[NSException raise: NSInvalidArgumentException
+	            format: @"Abstract method [%@ %@]",
+	                    [self class],
+	                    NSStringFromSelector(_cmd)];
+	return NO;
+}
+- (bitmap)matchesInFilter: (OOOutlineFilter*)aFilter
+{
+	bitmap result;
+	[aFilter liveRows].for_each([&](size_t p)
+		{
+			if ([self matchesRow: [aFilter rowAtPosition: p]])
+			{
+				result.set(p);
+			}
+		});
+	return result;
+}
+@end
+
+@implementation OOOutlineRangeCondition
+{
+	/**
+	 * The column whose values are compared.
+	 */
+	OOOutlineColumn *column;
+	/**
+	 * The smallest key that matches, or no key if nothing matches.
+	 */
+	std::optional<range_key> minimum;
+	/**
+	 * The largest key that matches, or no key if nothing matches.
+	 */
+	std::optional<range_key> maximum;
+}
+- (instancetype)initWithColumn: (OOOutlineColumn*)aColumn
+                       minimum: (id)aMinimum
+                       maximum: (id)aMaximum
+{
+	OO_SUPER_INIT();
+	column = aColumn;
+	// Bounds that are neither numbers nor dates have no key, so nothing
+	// matches them.
+	minimum = aMinimum ? key_for_object(aMinimum) : range_key::lowest();
+	maximum = aMaximum ? key_for_object(aMaximum) : range_key::highest();
+	return self;
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	auto key = key_for_object([[aRow valueForColumn: column] value]);
+	return key && minimum && maximum &&
+	       !(*key < *minimum) && !(*maximum < *key);
+}
+- (bitmap)matchesInFilter: (OOOutlineFilter*)aFilter
+{
+	bitmap result;
+	if (minimum && maximum)
+	{
+		[aFilter sortedIndexForColumn: column].find(*minimum, *maximum, result);
+	}
+	return result;
+}
+@end
+
+@implementation OOOutlineEnumerationCondition
+{
+	/**
+	 * The column whose values are compared.
+	 */
+	OOOutlineColumn *column;
+	/**
+	 * The labels of the members that match.  These are looked up each time
+	 * that the condition is evaluated, because members may be added to the
+	 * column after the condition is constructed.
+	 */
+	NSArray<NSString*> *labels;
+}
+- (instancetype)initWithColumn: (OOOutlineColumn*)aColumn
+                        labels: (NSArray<NSString*>*)someLabels
+{
+	OO_SUPER_INIT();
+	column = aColumn;
+	labels = [someLabels copy];
+	return self;
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	NSUInteger member = [[aRow valueForColumn: column] enumerationID];
+	if (member == NSNotFound)
+	{
+		return NO;
+	}
+	for (NSString *label in labels)
+	{
+		if ([column enumerationIDForLabel: label] == member)
+		{
+			return YES;
+		}
+	}
+	return NO;
+}
+- (bitmap)matchesInFilter: (OOOutlineFilter*)aFilter
+{
+	bitmap result;
+	const enum_index &index = [aFilter enumerationIndexForColumn: column];
+	for (NSString *label in labels)
+	{
+		index.find([column enumerationIDForLabel: label], result);
+	}
+	return result;
+}
+@end
+
+@implementation OOOutlineColumnTextCondition
+{
+	/**
+	 * The column whose values are searched.
+	 */
+	OOOutlineColumn *column;
+	/**
+	 * The text to search for.
+	 */
+	NSString *text;
+}
+- (instancetype)initWithColumn: (OOOutlineColumn*)aColumn
+                          text: (NSString*)aString
+{
+	OO_SUPER_INIT();
+	column = aColumn;
+	text = [aString copy];
+	return self;
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	NSString *str = [[aRow valueForColumn: column] plainText];
+	return (str != nil) &&
+	       ([str rangeOfString: text options: NSCaseInsensitiveSearch].location != NSNotFound);
+}
+@end
+
+@implementation OOOutlineNoteTextCondition
+{
+	/**
+	 * The text to search for.
+	 */
+	NSString *text;
+}
+- (instancetype)initWithText: (NSString*)aString
+{
+	OO_SUPER_INIT();
+	text = [aString copy];
+	return self;
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	NSString *str = [aRow.note string];
+	return (str != nil) &&
+	       ([str rangeOfString: text options: NSCaseInsensitiveSearch].location != NSNotFound);
+}
+@end
+
+@implementation OOOutlineCheckedStateCondition
+{
+	/**
+	 * The state that matches.
+	 */
+	OOOutlineRowCheckedState state;
+}
+- (instancetype)initWithState: (OOOutlineRowCheckedState)aState
+{
+	OO_SUPER_INIT();
+	state = aState;
+	return self;
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	return aRow.checkedState == state;
+}
+- (bitmap)matchesInFilter: (OOOutlineFilter*)aFilter
+{
+	return [aFilter rowsWithCheckedState: state];
+}
+@end
+
+@implementation OOOutlineAllCondition
+{
+	/**
+	 * The conditions that must all match.
+	 */
+	NSArray<OOOutlineFilterCondition*> *conditions;
+}
+- (instancetype)initWithConditions: (NSArray<OOOutlineFilterCondition*>*)someConditions
+{
+	OO_SUPER_INIT();
+	conditions = [someConditions copy];
+	return self;
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	for (OOOutlineFilterCondition *c in conditions)
+	{
+		if (![c matchesRow: aRow])
+		{
+			return NO;
+		}
+	}
+	return YES;
+}
+- (bitmap)matchesInFilter: (OOOutlineFilter*)aFilter
+{
+	bitmap result = [aFilter liveRows];
+	for (OOOutlineFilterCondition *c in conditions)
+	{
+		result &= [c matchesInFilter: aFilter];
+	}
+	return result;
+}
+@end
+
+@implementation OOOutlineAnyCondition
+{
+	/**
+	 * The conditions, any of which may match.
+	 */
+	NSArray<OOOutlineFilterCondition*> *conditions;
+}
+- (instancetype)initWithConditions: (NSArray<OOOutlineFilterCondition*>*)someConditions
+{
+	OO_SUPER_INIT();
+	conditions = [someConditions copy];
+	return self;
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	for (OOOutlineFilterCondition *c in conditions)
+	{
+		if ([c matchesRow: aRow])
+		{
+			return YES;
+		}
+	}
+	return NO;
+}
+- (bitmap)matchesInFilter: (OOOutlineFilter*)aFilter
+{
+	bitmap result;
+	for (OOOutlineFilterCondition *c in conditions)
+	{
+		result |= [c matchesInFilter: aFilter];
+	}
+	return result;
+}
+@end
+
+@implementation OOOutlineNotCondition
+{
+	/**
+	 * The condition that must not match.
+	 */
+	OOOutlineFilterCondition *condition;
+}
+- (instancetype)initWithCondition: (OOOutlineFilterCondition*)aCondition
+{
+	OO_SUPER_INIT();
+	condition = aCondition;
+	return self;
+}
+- (BOOL)matchesRow: (OOOutlineRow*)aRow
+{
+	return ![condition matchesRow: aRow];
+}
+- (bitmap)matchesInFilter: (OOOutlineFilter*)aFilter
+{
+	bitmap result = [aFilter liveRows];
+	result -= [condition matchesInFilter: aFilter];
+	return result;
+}
+@end
+
+@implementation OOOutlineFilter
+{
+	/**
+	 * The document whose rows are filtered.
+	 */
+	__weak OOOutlineDocument *document;
+	/**
+	 * The position of each row in the tables below, by row ID.  Positions
+	 * are reused after rows are removed, so the tables stay dense.
+	 */
+	row_id_map<uint32_t> positions;
+	/**
+	 * The row at each position, or `nil` for unused positions.
+	 */
+	std::vector<OOOutlineRow*> rows;
+	/**
+	 * The position of the parent of the row at each position.
+	 */
+	std::vector<uint32_t> parents;
+	/**
+	 * The number of rows that match the condition in the subtree rooted at
+	 * each position, including the row itself.  A row is visible if this is
+	 * not zero.
+	 */
+	std::vector<uint32_t> matchCounts;
+	/**
+	 * Positions that are not in use.
+	 */
+	std::vector<uint32_t> freePositions;
+	/**
+	 * The positions of all rows except the root.
+	 */
+	bitmap live;
+	/**
+	 * The positions of the rows that match the condition.
+	 */
+	bitmap matches;
+	/**
+	 * The positions of the rows in each checked state.
+	 */
+	bitmap checkedStates[3];
+	/**
+	 * Indexes of the number and date columns used by conditions.
+	 */
+	object_map<OOOutlineColumn*, sorted_index> sortedIndexes;
+	/**
+	 * Indexes of the enumeration columns used by conditions.
+	 */
+	object_map<OOOutlineColumn*, enum_index> enumIndexes;
+	/**
+	 * Cached visible children of rows, discarded when they may change.
+	 */
+	NSMapTable<OOOutlineRow*, NSArray<OOOutlineRow*>*> *visibleChildren;
+	/**
+	 * Flag indicating that an `OOOutlineFilterDidChangeNotification` will be
+	 * posted.
+	 */
+	BOOL notificationPending;
+}
+@synthesize condition;
+
+- (instancetype)initWithDocument: (OOOutlineDocument*)aDocument
+{
+	OO_SUPER_INIT();
+	document = aDocument;
+	visibleChildren = [NSMapTable weakToStrongObjectsMapTable];
+	[self rowWasAdded: aDocument.root];
+	return self;
+}
+- (const bitmap&)liveRows
+{
+	return live;
+}
+- (OOOutlineRow*)rowAtPosition: (size_t)aPosition
+{
+	return rows[aPosition];
+}
+- (const bitmap&)rowsWithCheckedState: (OOOutlineRowCheckedState)aState
+{
+	return checkedStates[aState];
+}
+- (const sorted_index&)sortedIndexForColumn: (OOOutlineColumn*)aColumn
+{
+	auto i = sortedIndexes.find(aColumn);
+	if (i != sortedIndexes.end())
+	{
+		return i->second;
+	}
+	std::vector<std::optional<range_key>> keys(rows.size());
+	live.for_each([&](size_t p)
+		{
+			keys[p] = key_for_object([[rows[p] valueForColumn: aColumn] value]);
+		});
+	sorted_index &index = sortedIndexes[aColumn];
+	index.build(std::move(keys));
+	return index;
+}
+- (const enum_index&)enumerationIndexForColumn: (OOOutlineColumn*)aColumn
+{
+	auto i = enumIndexes.find(aColumn);
+	if (i != enumIndexes.end())
+	{
+		return i->second;
+	}
+	enum_index &index = enumIndexes[aColumn];
+	live.for_each([&](size_t p)
+		{
+			index.set(static_cast<uint32_t>(p),
+			          [[rows[p] valueForColumn: aColumn] enumerationID]);
+		});
+	return index;
+}
+/**
+ * Returns the position of a row, or `no_position` if it is not in the
+ * outline.
+ */
+- (uint32_t)positionOfRow: (OOOutlineRow*)aRow
+{
+	if (aRow == nil)
+	{
+		return no_position;
+	}
+	uint32_t *p = positions.find(aRow.rowID);
+	return (p && (rows[*p] == aRow)) ? *p : no_position;
+}
+/**
+ * Discards cached visible children and arranges for observers to be notified
+ * once the current change, which may be part of a larger edit, has finished.
+ */
+- (void)visibilityDidChange
+{
+	[visibleChildren removeAllObjects];
+	if (notificationPending)
+	{
+		return;
+	}
+	notificationPending = YES;
+	dispatch_async(dispatch_get_main_queue(), ^{
+		self->notificationPending = NO;
+		OOOutlineDocument *doc = self->document;
+		[[NSNotificationCenter defaultCenter] postNotificationName: OOOutlineFilterDidChangeNotification
+		                                                    object: doc];
+	});
+}
+/**
+ * Adds `aDelta` to the match counts of the row at `aPosition` and its
+ * ancestors.
+ */
+- (void)addMatches: (int32_t)aDelta fromPosition: (uint32_t)aPosition
+{
+	bool changed = false;
+	for (uint32_t p = aPosition ; p != no_position ; p = parents[p])
+	{
+		bool wasVisible = matchCounts[p] > 0;
+		matchCounts[p] += aDelta;
+		changed |= (wasVisible != (matchCounts[p] > 0));
+	}
+	if (changed)
+	{
+		[self visibilityDidChange];
+	}
+}
+/**
+ * Updates the index entries and the match for the row at a position.
+ */
+- (void)updateRowAtPosition: (uint32_t)aPosition
+{
+	OOOutlineRow *r = rows[aPosition];
+	OOOutlineRowCheckedState state = r.checkedState;
+	for (int s=0 ; s<3 ; s++)
+	{
+		checkedStates[s].assign(aPosition, s == state);
+	}
+	for (auto &[col, index] : sortedIndexes)
+	{
+		index.set(aPosition, key_for_object([[r valueForColumn: col] value]));
+	}
+	for (auto &[col, index] : enumIndexes)
+	{
+		index.set(aPosition, [[r valueForColumn: col] enumerationID]);
+	}
+	bool isMatch = live.test(aPosition) && [condition matchesRow: r];
+	if (isMatch != matches.test(aPosition))
+	{
+		matches.assign(aPosition, isMatch);
+		[self addMatches: isMatch ? 1 : -1 fromPosition: aPosition];
+	}
+}
+- (void)setCondition: (OOOutlineFilterCondition*)aCondition
+{
+	condition = aCondition;
+	matches = aCondition ? [aCondition matchesInFilter: self] : bitmap();
+	matches &= live;
+	std::fill(matchCounts.begin(), matchCounts.end(), 0);
+	matches.for_each([&](size_t m)
+		{
+			for (uint32_t p = static_cast<uint32_t>(m) ; p != no_position ; p = parents[p])
+			{
+				matchCounts[p]++;
+			}
+		});
+	[self visibilityDidChange];
+}
+- (BOOL)isRowVisible: (OOOutlineRow*)aRow
+{
+	if (condition == nil)
+	{
+		return YES;
+	}
+	uint32_t p = [self positionOfRow: aRow];
+	return (p != no_position) && ((matchCounts[p] > 0) || (parents[p] == no_position));
+}
+- (NSArray<OOOutlineRow*>*)visibleChildrenOfRow: (OOOutlineRow*)aRow
+{
+	if (condition == nil)
+	{
+		return aRow.children;
+	}
+	NSArray<OOOutlineRow*> *cached = [visibleChildren objectForKey: aRow];
+	if (cached == nil)
+	{
+		NSMutableArray<OOOutlineRow*> *visible = [NSMutableArray new];
+		for (OOOutlineRow *child in aRow.children)
+		{
+			if ([self isRowVisible: child])
+			{
+				[visible addObject: child];
+			}
+		}
+		cached = visible;
+		[visibleChildren setObject: cached forKey: aRow];
+	}
+	return cached;
+}
+- (NSUInteger)childIndexForVisibleIndex: (NSUInteger)anIndex
+                                  ofRow: (OOOutlineRow*)aRow
+{
+	if (condition == nil)
+	{
+		return anIndex;
+	}
+	NSArray<OOOutlineRow*> *visible = [self visibleChildrenOfRow: aRow];
+	if (anIndex < [visible count])
+	{
+		return [[visible objectAtIndex: anIndex] indexInParent];
+	}
+	if ([visible count] > 0)
+	{
+		return [[visible lastObject] indexInParent] + 1;
+	}
+	return [aRow.children count];
+}
+- (void)rowWasAdded: (OOOutlineRow*)aRow
+{
+	std::function<void(OOOutlineRow*, uint32_t)> add = [&](OOOutlineRow *r, uint32_t parent)
+		{
+			// Reading deferred children below adds them before this visits
+			// them.
+			if ([self positionOfRow: r] != no_position)
+			{
+				return;
+			}
+			uint32_t p;
+			if (freePositions.empty())
+			{
+				p = static_cast<uint32_t>(rows.size());
+				rows.push_back(nil);
+				parents.push_back(no_position);
+				matchCounts.push_back(0);
+			}
+			else
+			{
+				p = freePositions.back();
+				freePositions.pop_back();
+			}
+			positions.insert(r.rowID, p);
+			rows[p] = r;
+			parents[p] = parent;
+			matchCounts[p] = 0;
+			live.assign(p, parent != no_position);
+			[self updateRowAtPosition: p];
+			for (OOOutlineRow *child in r.children)
+			{
+				add(child, p);
+			}
+		};
+	OOOutlineRow *parent = aRow.parent;
+	add(aRow, [self positionOfRow: parent]);
+	if (parent != nil)
+	{
+		[visibleChildren removeObjectForKey: parent];
+	}
+}
+- (void)rowWasRemoved: (OOOutlineRow*)aRow
+{
+	uint32_t p = [self positionOfRow: aRow];
+	if (p == no_position)
+	{
+		return;
+	}
+	uint32_t parent = parents[p];
+	if (matchCounts[p] > 0)
+	{
+		[self addMatches: -static_cast<int32_t>(matchCounts[p]) fromPosition: parent];
+		[self visibilityDidChange];
+	}
+	std::function<void(OOOutlineRow*)> remove = [&](OOOutlineRow *r)
+		{
+			uint32_t q = [self positionOfRow: r];
+			if (q == no_position)
+			{
+				return;
+			}
+			for (auto &s : checkedStates)
+			{
+				s.reset(q);
+			}
+			for (auto &[col, index] : sortedIndexes)
+			{
+				index.set(q, std::nullopt);
+			}
+			for (auto &[col, index] : enumIndexes)
+			{
+				index.set(q, NSNotFound);
+			}
+			live.reset(q);
+			matches.reset(q);
+			matchCounts[q] = 0;
+			parents[q] = no_position;
+			rows[q] = nil;
+			positions.erase(r.rowID);
+			freePositions.push_back(q);
+			if (r.hasChildren)
+			{
+				for (OOOutlineRow *child in r.children)
+				{
+					remove(child);
+				}
+			}
+		};
+	remove(aRow);
+	if (parent != no_position)
+	{
+		[visibleChildren removeObjectForKey: rows[parent]];
+	}
+}
+- (void)rowDidMove: (OOOutlineRow*)aRow
+{
+	uint32_t p = [self positionOfRow: aRow];
+	if (p == no_position)
+	{
+		[self rowWasAdded: aRow];
+		return;
+	}
+	int32_t count = static_cast<int32_t>(matchCounts[p]);
+	if (count > 0)
+	{
+		[self addMatches: -count fromPosition: parents[p]];
+	}
+	[visibleChildren removeObjectForKey: rows[parents[p]]];
+	OOOutlineRow *parent = aRow.parent;
+	parents[p] = [self positionOfRow: parent];
+	if (count > 0)
+	{
+		[self addMatches: count fromPosition: parents[p]];
+	}
+	[visibleChildren removeObjectForKey: parent];
+}
+- (void)rowDidChangeChildren: (OOOutlineRow*)aRow
+{
+	[visibleChildren removeObjectForKey: aRow];
+}
+- (void)rowDidChange: (OOOutlineRow*)aRow
+{
+	uint32_t p = [self positionOfRow: aRow];
+	if (p != no_position)
+	{
+		[self updateRowAtPosition: p];
+	}
+}
+- (void)row: (OOOutlineRow*)aRow didChangeIDFrom: (OOOutlineRowID)anID
+{
+	uint32_t *p = positions.find(anID);
+	if (p && (rows[*p] == aRow))
+	{
+		uint32_t position = *p;
+		positions.erase(anID);
+		positions.insert(aRow.rowID, position);
+	}
+}
+@end
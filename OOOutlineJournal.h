@@ -0,0 +1,167 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+
+@class OOOutlineColumn;
+@class OOOutlineDocument;
+@class OOOutlineRow;
+@class OOOutlineValue;
+@class OOXMLWriter;
+
+/**
+ * The name of the journal file in an OmniOutliner 3 document bundle.
+ */
+extern NSString *const OOOutlineJournalFileName;
+
+/**
+ * Journal of the edits made to a document since it was last saved in full.
+ * Autosaving in place appends the edits to a `contents.journal` file in the
+ * document bundle, rather than rewriting `contents.xml`, and the journal is
+ * replayed when the document is opened.  Each record in the file is preceded
+ * by its length, so a record that was only partially written when the
+ * application exited is ignored.
+ *
+ * The outline model informs the journal of every change to a row that is in
+ * the outline.  Changes to anything other than rows and the set of columns
+ * are not recorded, and instead require the next autosave to write the whole
+ * document.
+ */
+@interface OOOutlineJournal : NSObject
+/**
+ * Constructs a journal for the specified document.  This should be called
+ * after the document has been read, and the journal then treats the document
+ * as being saved.
+ */
+- (instancetype)initWithDocument: (OOOutlineDocument*)aDocument;
+/**
+ * Flag indicating whether changes are currently being recorded.  Changes are
+ * not recorded while the journal is suspended, when the document has no file,
+ * or when the next save must write the whole document anyway.
+ */
+@property (nonatomic, readonly) BOOL isRecording;
+/**
+ * Flag indicating whether the changes since the last save cannot be appended
+ * to the journal file, either because some were not recorded or because the
+ * journal file would become too large.
+ */
+@property (nonatomic, readonly) BOOL needsFullSave;
+/**
+ * Flag indicating whether the document's file has a journal that should be
+ * compacted into `contents.xml`.
+ */
+@property (nonatomic, readonly) BOOL hasJournalFile;
+/**
+ * Stops recording changes until a matching call to `-resume`.  This is used
+ * for changes, such as reading deferred rows, that do not modify the
+ * document.
+ */
+- (void)suspend;
+/**
+ * Resumes recording after a call to `-suspend`.
+ */
+- (void)resume;
+/**
+ * Records that `aRow` has been inserted into the children of `aParent`.  If
+ * `isMove` is set then the row was already in the outline and is recorded by
+ * identifier, otherwise it is recorded along with all of its descendants.
+ */
+- (void)row: (OOOutlineRow*)aParent
+didInsertRow: (OOOutlineRow*)aRow
+    atIndex: (NSUInteger)anIndex
+     isMove: (BOOL)isMove;
+/**
+ * Records that the child of `aParent` at the specified index is about to be
+ * removed.
+ */
+- (void)row: (OOOutlineRow*)aParent
+willRemoveRowAtIndex: (NSUInteger)anIndex;
+/**
+ * Records that the value of `aRow` in the specified column has been replaced.
+ */
+- (void)row: (OOOutlineRow*)aRow
+didSetValue: (OOOutlineValue*)aValue
+   atIndex: (NSUInteger)anIndex;
+/**
+ * Records a change to the note, expanded states, or checked state of a row.
+ */
+- (void)rowDidChangeAttributes: (OOOutlineRow*)aRow;
+/**
+ * Informs the journal that a column is about to be added to the document.
+ */
+- (void)documentWillAddColumn;
+/**
+ * Records that a column has been added to the document.
+ */
+- (void)documentDidAddColumn: (OOOutlineColumn*)aColumn;
+/**
+ * Records that the document has changed in a way that the journal cannot
+ * record.  The next save will write the whole document.
+ */
+- (void)requireFullSave;
+/**
+ * Appends the changes recorded since the last save to the journal file in the
+ * document bundle at the specified URL and waits for them to reach the disk.
+ */
+- (BOOL)appendToBundle: (NSURL*)aURL
+                 error: (NSError**)outError;
+/**
+ * Informs the journal that the whole document is about to be saved from a
+ * snapshot of its current state.  Changes made while the snapshot is written
+ * are recorded relative to the snapshot.
+ */
+- (void)documentWillSave;
+/**
+ * Informs the journal that the save started by `-documentWillSave` has
+ * finished.  If `replacedJournal` is set then the document's file was
+ * replaced by one without a journal, otherwise the file is unchanged.
+ */
+- (void)documentDidSave: (BOOL)replacedJournal;
+/**
+ * Applies the changes in a journal file to the document.  Replay stops at the
+ * first record that is incomplete or that cannot be applied.  Changes made
+ * while replaying are not recorded.  Children that were deferred when the
+ * document was loaded are read only if they contain rows that the records
+ * refer to, so replaying a short journal leaves most of them unread.
+ */
+- (void)replayJournal: (NSData*)aJournal;
+@end
+
+/**
+ * Methods on the document that are used by the journal.
+ */
+@interface OOOutlineDocument (Journal)
+/**
+ * Writes everything in the document that precedes the rows in OmniOutliner 3
+ * XML.  The journal does not record changes to any of this, other than
+ * adding columns, so it uses the output to detect them.  Values that are
+ * derived from the rows are omitted if `includesDerivedValues` is not set,
+ * because they change whenever the rows do.
+ */
+- (void)writeOO3XMLHeader: (OOXMLWriter*)aWriter
+   includingDerivedValues: (BOOL)includesDerivedValues;
+@end
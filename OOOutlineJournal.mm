@@ -0,0 +1,608 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import "OpenOutliner.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace {
+/**
+ * The size at which the journal is compacted into `contents.xml` by the next
+ * autosave.
+ */
+constexpr NSUInteger journalSizeLimit = 4 * 1024 * 1024;
+
+/**
+ * Returns the OmniOutliner 3 name for a checked state.
+ */
+NSString *checkedStateName(OOOutlineRowCheckedState aState)
+{
+	switch (aState)
+	{
+		case OOOutlineRowChecked:
+			return @"checked";
+		case OOOutlineRowUnChecked:
+			return @"unchecked";
+		case OOOutlineRowCheckedIndeterminate:
+			return @"indeterminate";
+	}
+	return @"indeterminate";
+}
+
+/**
+ * Reads all of the children of `aRow` and its descendants that were deferred
+ * when the document was loaded.
+ */
+void readAllRows(OOOutlineRow *aRow)
+{
+	for (OOOutlineRow *child in [aRow children])
+	{
+		readAllRows(child);
+	}
+}
+
+/**
+ * Returns whether a fragment written by `OOXMLWriter` contains an element
+ * whose `id` attribute is one of `someIdentifiers`.  Attribute values are
+ * compared as they were written, so identifiers that contain characters that
+ * the writer escapes are not found.
+ */
+bool fragmentContainsIdentifier(NSData *aFragment,
+                                const std::unordered_set<std::string> &someIdentifiers)
+{
+	static const char pattern[] = " id=\"";
+	constexpr size_t patternLength = sizeof(pattern) - 1;
+	const char *p = static_cast<const char*>([aFragment bytes]);
+	const char *end = p + [aFragment length];
+	while ((p = static_cast<const char*>(memmem(p, static_cast<size_t>(end - p), pattern, patternLength))))
+	{
+		p += patternLength;
+		const char *close = static_cast<const char*>(memchr(p, '"', static_cast<size_t>(end - p)));
+		if (!close)
+		{
+			break;
+		}
+		if (someIdentifiers.count(std::string(p, close)) > 0)
+		{
+			return true;
+		}
+		p = close + 1;
+	}
+	return false;
+}
+
+/**
+ * Reads the children of `aRow` and its descendants that were deferred when
+ * the document was loaded and that contain rows with one of the specified
+ * identifiers.  Other deferred children are left unread.
+ */
+void readRowsWithIdentifiers(OOOutlineRow *aRow,
+                             const std::unordered_set<std::string> &someIdentifiers)
+{
+	NSData *deferred = [aRow deferredChildren];
+	if (deferred && !fragmentContainsIdentifier(deferred, someIdentifiers))
+	{
+		return;
+	}
+	for (OOOutlineRow *child in [aRow children])
+	{
+		readRowsWithIdentifiers(child, someIdentifiers);
+	}
+}
+
+/**
+ * Writes `aData` to the end of the file at `aURL`, creating it if required,
+ * and waits for it to reach the disk.
+ */
+BOOL appendToFile(NSURL *aURL, NSData *aData, NSError **outError)
+{
+	int fd = open([aURL fileSystemRepresentation], O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	const char *bytes = static_cast<const char*>([aData bytes]);
+	NSUInteger remaining = [aData length];
+	bool success = (fd >= 0);
+	while (success && (remaining > 0))
+	{
+		ssize_t written = write(fd, bytes, remaining);
+		if (written < 0)
+		{
+			success = (errno == EINTR);
+			continue;
+		}
+		bytes += written;
+		remaining -= static_cast<NSUInteger>(written);
+	}
+	success = success && (fsync(fd) == 0);
+	int error = errno;
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+	if (!success && outError)
+	{
+		*outError = [NSError errorWithDomain: NSPOSIXErrorDomain
+		                                code: error
+		                            userInfo: @{ NSURLErrorKey : aURL }];
+	}
+	return success;
+}
+}
+
+NSString *const OOOutlineJournalFileName = @"contents.journal";
+
+@implementation OOOutlineJournal
+{
+	/**
+	 * The document whose changes are recorded.
+	 */
+	__weak OOOutlineDocument *document;
+	/**
+	 * Records that have not yet been appended to the journal file.
+	 */
+	NSMutableData *pending;
+	/**
+	 * The length of the journal file.
+	 */
+	NSUInteger journalLength;
+	/**
+	 * The number of calls to `-suspend` without a matching `-resume`.
+	 */
+	NSUInteger suspendCount;
+	/**
+	 * Flag set when a change could not be recorded.
+	 */
+	BOOL fullSaveRequired;
+	/**
+	 * The output of `-writeOO3XMLHeader:includingDerivedValues:` for the
+	 * document as it is on disk, without derived values.
+	 */
+	NSData *savedHeader;
+	/**
+	 * Flag set between `-documentWillSave` and `-documentDidSave:`.
+	 */
+	BOOL isSaving;
+	/**
+	 * The records that were pending when the save started.  These are still
+	 * required if the save does not replace the file.
+	 */
+	NSMutableData *unsavedRecords;
+	/**
+	 * The value of `fullSaveRequired` when the save started.
+	 */
+	BOOL unsavedFullSaveRequired;
+	/**
+	 * The value of `savedHeader` when the save started.
+	 */
+	NSData *unsavedHeader;
+}
+@synthesize hasJournalFile;
+
+- (instancetype)initWithDocument: (OOOutlineDocument*)aDocument
+{
+	OO_SUPER_INIT();
+	document = aDocument;
+	pending = [NSMutableData new];
+	savedHeader = [self currentHeader];
+	return self;
+}
+/**
+ * Returns the output of `-writeOO3XMLHeader:includingDerivedValues:` for the
+ * document in its current state.  Derived values are omitted, so changing
+ * them does not require a full save and comparing headers does not need to
+ * compute them.
+ */
+- (NSData*)currentHeader
+{
+	OOXMLWriter *w = [OOXMLWriter writer];
+	[document writeOO3XMLHeader: w includingDerivedValues: NO];
+	return [w data];
+}
+- (BOOL)isRecording
+{
+	return (suspendCount == 0) && !fullSaveRequired &&
+	       ((journalLength + [pending length]) <= journalSizeLimit) &&
+	       ([document fileURL] != nil);
+}
+- (BOOL)needsFullSave
+{
+	return fullSaveRequired ||
+	       ((journalLength + [pending length]) > journalSizeLimit) ||
+	       ![savedHeader isEqualToData: [self currentHeader]];
+}
+- (void)suspend
+{
+	suspendCount++;
+}
+- (void)resume
+{
+	NSAssert(suspendCount > 0, @"Unbalanced resume");
+	suspendCount--;
+}
+/**
+ * Appends the record written by the block to the pending records.  Each
+ * record is preceded by its length, so that incomplete records can be
+ * detected, and followed by a line break to make the file easier to read.
+ */
+- (void)record: (void(^)(OOXMLWriter *aWriter))aBlock
+{
+	// Records are written as trees, so that writing rows does not replace
+	// their cached XML with output that is indented for the record.
+	NSData *xml = [[[OOXMLWriter elementByWriting: aBlock] XMLString] dataUsingEncoding: NSUTF8StringEncoding];
+	[pending appendData: [[NSString stringWithFormat: @"%lu\n", (unsigned long)[xml length]]
+	                         dataUsingEncoding: NSUTF8StringEncoding]];
+	[pending appendData: xml];
+	[pending appendBytes: "\n" length: 1];
+}
+- (void)row: (OOOutlineRow*)aParent
+didInsertRow: (OOOutlineRow*)aRow
+    atIndex: (NSUInteger)anIndex
+     isMove: (BOOL)isMove
+{
+	OOOutlineDocument *doc = document;
+	[self record: ^(OOXMLWriter *w) {
+		[w startElement: @"insert"];
+		if (aParent != doc.root)
+		{
+			[w addAttribute: aParent.identifier withName: @"parent"];
+		}
+		[w addAttribute: [NSString stringWithFormat: @"%lu", (unsigned long)anIndex]
+		       withName: @"index"];
+		if (isMove)
+		{
+			[w addAttribute: aRow.identifier withName: @"ref"];
+		}
+		else
+		{
+			[aRow writeOO3XML: w];
+		}
+		[w endElement];
+	}];
+}
+- (void)row: (OOOutlineRow*)aParent
+willRemoveRowAtIndex: (NSUInteger)anIndex
+{
+	OOOutlineDocument *doc = document;
+	[self record: ^(OOXMLWriter *w) {
+		[w startElement: @"remove"];
+		if (aParent != doc.root)
+		{
+			[w addAttribute: aParent.identifier withName: @"parent"];
+		}
+		[w addAttribute: [NSString stringWithFormat: @"%lu", (unsigned long)anIndex]
+		       withName: @"index"];
+		[w addAttribute: [[aParent.children objectAtIndex: anIndex] identifier]
+		       withName: @"id"];
+		[w endElement];
+	}];
+}
+- (void)row: (OOOutlineRow*)aRow
+didSetValue: (OOOutlineValue*)aValue
+   atIndex: (NSUInteger)anIndex
+{
+	[self record: ^(OOXMLWriter *w) {
+		[w startElement: @"value"];
+		[w addAttribute: aRow.identifier withName: @"row"];
+		[w addAttribute: [NSString stringWithFormat: @"%lu", (unsigned long)anIndex]
+		       withName: @"column"];
+		[aValue writeOO3XML: w];
+		[w endElement];
+	}];
+}
+- (void)rowDidChangeAttributes: (OOOutlineRow*)aRow
+{
+	OOOutlineDocument *doc = document;
+	[self record: ^(OOXMLWriter *w) {
+		[w startElement: @"row"];
+		[w addAttribute: aRow.identifier withName: @"id"];
+		[w addAttribute: checkedStateName(aRow.checkedState) withName: @"state"];
+		if (aRow.isExpanded)
+		{
+			[w addAttribute: @"yes" withName: @"expanded"];
+		}
+		if (NSAttributedString *note = aRow.note)
+		{
+			[w startElement: @"note"];
+			if (aRow.isNoteExpanded)
+			{
+				[w addAttribute: @"yes" withName: @"expanded"];
+			}
+			[note writeOO3XML: w withPartialStyle: doc.noteColumn.style];
+			[w endElement];
+		}
+		[w endElement];
+	}];
+}
+- (void)documentWillAddColumn
+{
+	// The journal can record the new column, but not any other changes to
+	// the columns that have not yet been saved.
+	if ([self isRecording] && ![savedHeader isEqualToData: [self currentHeader]])
+	{
+		[self requireFullSave];
+	}
+}
+- (void)documentDidAddColumn: (OOOutlineColumn*)aColumn
+{
+	if (![self isRecording])
+	{
+		return;
+	}
+	[self record: ^(OOXMLWriter *w) {
+		[w startElement: @"add-column"];
+		[aColumn writeOO3XML: w];
+		[w endElement];
+	}];
+	savedHeader = [self currentHeader];
+}
+- (void)requireFullSave
+{
+	fullSaveRequired = YES;
+	[pending setLength: 0];
+}
+- (BOOL)appendToBundle: (NSURL*)aURL
+                 error: (NSError**)outError
+{
+	if ([pending length] == 0)
+	{
+		return YES;
+	}
+	if (!appendToFile([aURL URLByAppendingPathComponent: OOOutlineJournalFileName], pending, outError))
+	{
+		return NO;
+	}
+	journalLength += [pending length];
+	hasJournalFile = YES;
+	[pending setLength: 0];
+	return YES;
+}
+- (void)documentWillSave
+{
+	isSaving = YES;
+	unsavedRecords = pending;
+	unsavedFullSaveRequired = fullSaveRequired;
+	unsavedHeader = savedHeader;
+	pending = [NSMutableData new];
+	fullSaveRequired = NO;
+	savedHeader = [self currentHeader];
+}
+- (void)documentDidSave: (BOOL)replacedJournal
+{
+	if (!isSaving)
+	{
+		return;
+	}
+	isSaving = NO;
+	if (replacedJournal)
+	{
+		journalLength = 0;
+		hasJournalFile = NO;
+	}
+	else
+	{
+		// The file still describes the state before the snapshot, so the
+		// changes since the snapshot follow the ones that were pending.
+		BOOL needsFullSave = unsavedFullSaveRequired || fullSaveRequired;
+		[unsavedRecords appendData: pending];
+		pending = unsavedRecords;
+		savedHeader = unsavedHeader;
+		if (needsFullSave)
+		{
+			[self requireFullSave];
+		}
+	}
+	unsavedRecords = nil;
+	unsavedHeader = nil;
+}
+/**
+ * Applies a single record to the document.  Returns `NO` if the record does
+ * not match the document.
+ */
+- (BOOL)applyRecord: (NSXMLElement*)aRecord
+{
+	OOOutlineDocument *doc = document;
+	NSString *name = [aRecord name];
+	auto attribute = [&](NSString *aName)
+		{
+			return [[aRecord attributeForName: aName] stringValue];
+		};
+	auto row = [&](NSString *anIdentifier)
+		{
+			return [doc rowWithIdentifier: anIdentifier];
+		};
+	auto parent = [&]()
+		{
+			NSString *parentID = attribute(@"parent");
+			return parentID ? row(parentID) : doc.root;
+		};
+	if ([name isEqualToString: @"insert"])
+	{
+		OOOutlineRow *p = parent();
+		NSUInteger idx = [attribute(@"index") unsignedIntegerValue];
+		OOOutlineRow *r = nil;
+		if (NSString *ref = attribute(@"ref"))
+		{
+			r = row(ref);
+		}
+		else if (NSXMLElement *item = [aRecord elementForName: @"item"])
+		{
+			r = [[OOOutlineRow alloc] initWithOO3XMLNode: item
+			                                  inDocument: doc];
+		}
+		if (!p || !r || (idx > [p.children count]))
+		{
+			return NO;
+		}
+		[p.children insertObject: r atIndex: idx];
+		return YES;
+	}
+	if ([name isEqualToString: @"remove"])
+	{
+		OOOutlineRow *p = parent();
+		NSUInteger idx = [attribute(@"index") unsignedIntegerValue];
+		if (!p || (idx >= [p.children count]) ||
+		    ![[[p.children objectAtIndex: idx] identifier] isEqualToString: attribute(@"id")])
+		{
+			return NO;
+		}
+		[p.children removeObjectAtIndex: idx];
+		return YES;
+	}
+	if ([name isEqualToString: @"value"])
+	{
+		OOOutlineRow *r = row(attribute(@"row"));
+		NSUInteger idx = [attribute(@"column") unsignedIntegerValue];
+		NSXMLNode *value = [[aRecord children] firstObject];
+		if (!r || (idx >= [r.values count]) || (idx >= [doc.columns count]) ||
+		    ([value kind] != NSXMLElementKind))
+		{
+			return NO;
+		}
+		[r.values replaceObjectAtIndex: idx
+		                    withObject: [OOOutlineValue outlineValueWithOO3XML: (NSXMLElement*)value
+		                                                              inColumn: [doc.columns objectAtIndex: idx]]];
+		return YES;
+	}
+	if ([name isEqualToString: @"row"])
+	{
+		OOOutlineRow *r = row(attribute(@"id"));
+		if (!r)
+		{
+			return NO;
+		}
+		r.checkedState = [OOOutlineRow checkedStateForOO3Name: attribute(@"state")];
+		r.isExpanded = [attribute(@"expanded") boolValue];
+		NSXMLElement *n = [aRecord elementForName: @"note"];
+		r.note = n ? [NSMutableAttributedString attributedStringWithOO3XML: [n elementForName: @"text"]
+		                                                  withPartialStyle: doc.noteColumn.style] : nil;
+		r.isNoteExpanded = [[[n attributeForName: @"expanded"] stringValue] boolValue];
+		return YES;
+	}
+	if ([name isEqualToString: @"add-column"])
+	{
+		NSXMLElement *column = [aRecord elementForName: @"column"];
+		if (!column)
+		{
+			return NO;
+		}
+		[doc addColumn: [[OOOutlineColumn alloc] initWithOO3XML: column
+		                                             inDocument: doc]];
+		return YES;
+	}
+	return NO;
+}
+- (void)replayJournal: (NSData*)aJournal
+{
+	OOOutlineDocument *doc = document;
+	// Parse the complete records, and the offset of the end of each.
+	std::vector<std::pair<NSXMLElement*, NSUInteger>> records;
+	const char *bytes = static_cast<const char*>([aJournal bytes]);
+	NSUInteger length = [aJournal length];
+	NSUInteger end = 0;
+	while (end < length)
+	{
+		const char *newline = static_cast<const char*>(memchr(bytes + end, '\n', length - end));
+		if (!newline)
+		{
+			break;
+		}
+		NSUInteger recordStart = static_cast<NSUInteger>(newline - bytes) + 1;
+		NSUInteger recordLength = strtoul(bytes + end, nullptr, 10);
+		if ((recordLength == 0) || (recordLength + 1 > length - recordStart))
+		{
+			break;
+		}
+		NSData *record = [aJournal subdataWithRange: NSMakeRange(recordStart, recordLength)];
+		NSXMLDocument *xml = [[NSXMLDocument alloc] initWithData: record
+		                                                 options: NSXMLNodePreserveWhitespace
+		                                                   error: nullptr];
+		NSXMLElement *element = [xml rootElement];
+		if (!element)
+		{
+			break;
+		}
+		end = recordStart + recordLength + 1;
+		records.push_back({ element, end });
+	}
+	[self suspend];
+	// Records identify rows by their identifiers, so the rows that they refer
+	// to must have been read.  Reading only the deferred children that
+	// contain them keeps the rest of the document unread.
+	std::unordered_set<std::string> identifiers;
+	for (auto &record : records)
+	{
+		for (NSString *name in @[ @"parent", @"ref", @"id", @"row" ])
+		{
+			NSString *identifier = [[record.first attributeForName: name] stringValue];
+			if (identifier && ![doc rowWithIdentifier: identifier])
+			{
+				identifiers.insert([identifier UTF8String]);
+			}
+		}
+	}
+	if (!identifiers.empty())
+	{
+		readRowsWithIdentifiers(doc.root, identifiers);
+	}
+	NSUInteger offset = 0;
+	BOOL hasReadAllRows = NO;
+	for (auto &[record, recordEnd] : records)
+	{
+		if (![self applyRecord: record])
+		{
+			// The row may be in deferred children that were not found by
+			// their identifier, so try again with every row.
+			if (hasReadAllRows)
+			{
+				break;
+			}
+			readAllRows(doc.root);
+			hasReadAllRows = YES;
+			if (![self applyRecord: record])
+			{
+				break;
+			}
+		}
+		offset = recordEnd;
+	}
+	[self resume];
+	journalLength = offset;
+	hasJournalFile = (length > 0);
+	savedHeader = [self currentHeader];
+	// Records appended after an incomplete or invalid one would be ignored, so
+	// the next save must replace the journal.
+	if (offset != length)
+	{
+		NSLog(@"Ignoring %lu bytes at the end of the journal",
+		      (unsigned long)(length - offset));
+		[self requireFullSave];
+	}
+}
+@end
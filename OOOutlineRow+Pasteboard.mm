@@ -98,17 +98,12 @@ thread_local OOOutlineDocument __unsafe_unretained *currentDocument;
 {
 	if ([type isEqualToString: OOOUtlineRowsPasteboardType])
 	{
-		return self.identifier;
+		return [NSString stringWithFormat: @"%llu", self.rowID];
 	}
 	if ([type isEqualToString: (NSString*)kUTTypeUTF8PlainText])
 	{
-		NSUInteger indent = -1ULL;
-		OOOutlineRow *parent = self;
-		auto *doc = self.document;
-		while ((parent = [doc parentForRow: parent]))
-		{
-			indent++;
-		}
+		// Top-level rows are children of the root and are not indented.
+		NSUInteger indent = self.depth - 1;
 		auto *str = [NSMutableString new];
 		[self writeToString: str withIndent: indent];
 		return str;
@@ -126,16 +121,17 @@ thread_local OOOutlineDocument __unsafe_unretained *currentDocument;
 	{
 		NSString *ident = [[NSString alloc] initWithData: propertyList
 		                                        encoding: NSUTF8StringEncoding];
+		OOOutlineRowID rowID = strtoull([ident UTF8String], nullptr, 10);
 		if (currentDocument)
 		{
-			if (OOOutlineRow *row = [[currentDocument allRows] objectForKey: ident])
+			if (OOOutlineRow *row = [currentDocument rowWithID: rowID])
 			{
 				return row;
 			}
 		}
 		else for (OOOutlineDocument *doc in [OOOutlineDocument allDocuments])
 		{
-			if (OOOutlineRow *row = [[doc allRows] objectForKey: ident])
+			if (OOOutlineRow *row = [doc rowWithID: rowID])
 			{
 				return row;
 			}
@@ -27,8 +27,12 @@
 
 #import <Foundation/Foundation.h>
 
+@class OOOutlineColumn;
 @class OOOutlineValue;
 @class OOOutlineDocument;
+@class OOOutlineSummary;
+@class OOOutlineRowVersion;
+@class OOXMLWriter;
 
 /**
  * The state of the checkbox associated with this row.
@@ -50,23 +54,54 @@ typedef enum
 	OOOutlineRowUnChecked
 } OOOutlineRowCheckedState;
 
+/**
+ * Integer identifier for a row.  IDs are unique within a document and are
+ * never 0.
+ */
+typedef uint64_t OOOutlineRowID;
+
 /**
  * Object encapsulating a row in the outline.  This is responsible for managing
  * values for each column and children.
  */
 @interface OOOutlineRow : NSObject
 /**
- * The children of this row.
+ * The children of this row.  Inserting a row into this array sets its
+ * `parent` and `indexInParent`, and removing it clears them.  If the children
+ * of a collapsed row were deferred when the document was loaded, then they are
+ * read when this is first accessed.
+ */
+@property (nonatomic, readonly) NSMutableArray<OOOutlineRow*> *children;
+/**
+ * Flag indicating whether this row has any children.  Unlike accessing
+ * `children`, this does not read children that were deferred when the
+ * document was loaded.
+ */
+@property (nonatomic, readonly) BOOL hasChildren;
+/**
+ * The row whose children contain this row.  This is `nil` for the root row and
+ * for rows that are not currently in an outline.
  */
-@property (nonatomic) NSMutableArray<OOOutlineRow*> *children;
+@property (nonatomic, weak, readonly) OOOutlineRow *parent;
 /**
- * The values for this row.  Note that these are never reordered while the
- * document is loaded, even if the columns are moved.
+ * The index of this row in its parent's children, or `NSNotFound` if this row
+ * has no parent.
+ */
+@property (nonatomic, readonly) NSUInteger indexInParent;
+/**
+ * The depth of this row in the tree.  The root row has a depth of 0 and
+ * top-level rows have a depth of 1.  This is O(depth).
+ */
+@property (nonatomic, readonly) NSUInteger depth;
+/**
+ * The values for this row, indexed by the display index of their column.
+ * Values are stored by column slot, so reordering, adding, or removing columns
+ * does not modify the row.  Columns that the row stores no value for have an
+ * empty value.  Values can be replaced, but not inserted or removed.
  *
- * FIXME: We should; however, write them out in a different order if the columns
- * are reordered.
+ * Replacing a value invalidates the cached summaries of this row's ancestors.
  */
-@property (nonatomic) NSMutableArray<OOOutlineValue*> *values;
+@property (nonatomic, readonly) NSMutableArray<OOOutlineValue*> *values;
 /**
  * The state of the checkbox associated with this row.
  *
@@ -94,14 +129,71 @@ typedef enum
  */
 @property (nonatomic, weak, readonly) OOOutlineDocument *document;
 /**
- * The unique identifier for this row.
+ * The unique ID for this row within its document.
+ */
+@property (nonatomic, readonly) OOOutlineRowID rowID;
+/**
+ * The unique identifier string for this row, which is used in OmniOutliner 3
+ * files.  This is derived from `rowID` unless the row was read from a file
+ * that used a different form of identifier.  Setting it may change `rowID`.
  */
 @property (nonatomic) NSString *identifier;
+/**
+ * An immutable copy of the current state of this row and its descendants.
+ * Versions share everything that has not changed with earlier versions, so
+ * this is O(1) if nothing has changed since it was last requested and
+ * otherwise allocates O(log n) nodes for each modified row.
+ */
+@property (nonatomic, readonly) OOOutlineRowVersion *version;
+/**
+ * Returns whether this row is a (direct or indirect) parent of `aRow`.  This
+ * is O(depth).
+ */
+- (BOOL)isAncestorOfRow: (OOOutlineRow*)aRow;
+/**
+ * Returns the summary of this row's children in the specified column, as
+ * computed by `aSummary`.  The result is cached until a value in one of the
+ * descendants of this row changes or rows are inserted or removed below it.
+ */
+- (OOOutlineValue*)summaryForColumn: (NSUInteger)aCol
+                       usingSummary: (OOOutlineSummary*)aSummary;
+/**
+ * Discards the cached summaries for the specified column in this row and in
+ * any ancestors whose summaries depend on it.  If `aCol` is `NSNotFound` then
+ * the summaries for all columns are discarded.
+ */
+- (void)invalidateSummariesForColumn: (NSUInteger)aCol;
+/**
+ * Returns the value for the specified column, which must be in this row's
+ * document.  Unlike indexing `values`, this does not depend on the column's
+ * position, and so also works for columns that have been removed.
+ */
+- (OOOutlineValue*)valueForColumn: (OOOutlineColumn*)aColumn;
+/**
+ * Stores a value in the specified column slot (see `-[OOOutlineColumn slot]`).
+ * This is used by readers, whose values are in slot order, and does not
+ * record the change in the journal or update text export widths.
+ */
+- (void)setValue: (OOOutlineValue*)aValue
+          inSlot: (NSUInteger)aSlot;
 /**
  * Construct a new row in the specified document.  The row will contain empty
  * cells for all of the columns.
  */
 - (id)initInDocument: (OOOutlineDocument*)aDoc;
+/**
+ * Construct a new row with the specified identifier and no values or
+ * children.  This is used by readers that populate the row incrementally.  A
+ * new unique identifier is generated if `anIdentifier` is `nil`.  The
+ * identifier is preserved only for rows in a document.
+ */
+- (id)initWithIdentifier: (NSString*)anIdentifier
+              inDocument: (OOOutlineDocument*)aDoc;
+/**
+ * Returns the checked state corresponding to the OmniOutliner 3 name for the
+ * state (`checked`, `unchecked`, or `indeterminate`).
+ */
++ (OOOutlineRowCheckedState)checkedStateForOO3Name: (NSString*)aName;
 /**
  * Construct a new row from OmniOutliner 3 XML.
  */
@@ -117,4 +209,60 @@ typedef enum
  * Serialise the row in OmniOutliner 3 XML format.
  */
 - (NSXMLElement*)oo3xmlValue;
+/**
+ * Write the row, including all of its children, in OmniOutliner 3 XML format.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter;
+@end
+
+/**
+ * An immutable version of a row and its descendants.  A version is not
+ * affected by later changes to the row, so it can be kept as a snapshot of the
+ * row and read from any thread.  Children that were deferred when the document
+ * was loaded are written from their original XML and are not counted in
+ * `childCount` until they have been read.
+ */
+@interface OOOutlineRowVersion : NSObject
+/**
+ * The unique identifier for the row.
+ */
+@property (nonatomic, readonly) NSString *identifier;
+/**
+ * The state of the checkbox associated with the row.
+ */
+@property (nonatomic, readonly) OOOutlineRowCheckedState checkedState;
+/**
+ * The note associated with the row.
+ */
+@property (nonatomic, readonly) NSAttributedString *note;
+/**
+ * Flag indicating whether the row is expanded.
+ */
+@property (nonatomic, readonly) BOOL isExpanded;
+/**
+ * Flag indicating whether the row's note is visible.
+ */
+@property (nonatomic, readonly) BOOL isNoteExpanded;
+/**
+ * The number of children of the row.
+ */
+@property (nonatomic, readonly) NSUInteger childCount;
+/**
+ * Returns the value in the specified column, which is empty if the row does
+ * not store a value for the column.  This is O(log n) in the number of values.
+ */
+- (OOOutlineValue*)valueForColumn: (OOOutlineColumn*)aColumn;
+/**
+ * Returns the version of the child at the specified index.  This is O(log n)
+ * in the number of children.
+ */
+- (OOOutlineRowVersion*)childAtIndex: (NSUInteger)anIndex;
+/**
+ * Write the row, including all of its children, in OmniOutliner 3 XML format,
+ * with values in the order of the columns in `aLayout`.  The output is cached,
+ * so writing the same version again at the same depth and with the same
+ * layout array reuses it.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+            columns: (NSArray<OOOutlineColumn*>*)aLayout;
 @end
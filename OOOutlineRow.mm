@@ -26,62 +26,1085 @@
  */
 
 #import "OpenOutliner.h"
+#import "persistent_vector.h"
+#import "row_index.h"
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+/**
+ * A cached summary for a column.
+ */
+struct summary_cache_entry
+{
+	/**
+	 * The object that computed the summary.  If the column's summary kind
+	 * changes then the cached value is ignored.
+	 */
+	OOOutlineSummary *summary;
+	/**
+	 * The cached value.  This may be `nil` for summaries (such as the mean)
+	 * that do not have a value when no children have values.
+	 */
+	OOOutlineValue *value;
+};
+/**
+ * The serialised form of a row version, saved so that it can be reused by
+ * later saves of documents that contain the same version.
+ */
+struct xml_cache
+{
+	/**
+	 * The output of the writer that the version was written to, if it was
+	 * not written as the child of another row.  The elements of children
+	 * are located relative to their parent's element, so copying an
+	 * unchanged row to a new buffer does not modify its descendants.
+	 */
+	NSData *buffer;
+	/**
+	 * The range of the row's `<item>` element in `buffer`, or relative to
+	 * the start of the parent's element if `buffer` is `nil`.
+	 */
+	NSRange range;
+	/**
+	 * Identifies the element that the version was written as, or 0 if it has
+	 * not been written.  Copying the element keeps its token, because the
+	 * positions of the children within it do not change.
+	 */
+	uint64_t token;
+	/**
+	 * The token of the parent's element that `range` is relative to.
+	 */
+	uint64_t parentToken;
+	/**
+	 * The depth of the writer when the row was written.  The output is
+	 * indented for this depth, so it is reused only at the same depth.
+	 */
+	NSUInteger depth;
+	/**
+	 * The column layout that the row was written with.  The document
+	 * replaces its columns array whenever the columns change, so the output
+	 * is reused only if this is the same array.
+	 */
+	NSArray<OOOutlineColumn*> *columns;
+};
+/**
+ * The location of an element written by a previous save.
+ */
+struct xml_location
+{
+	/**
+	 * The buffer that contains the element, or `nil` if it is not known.
+	 */
+	NSData *buffer;
+	/**
+	 * The offset of the element in `buffer`.
+	 */
+	NSUInteger start;
+	/**
+	 * The element's token.
+	 */
+	uint64_t token;
+};
+/**
+ * The parent of a row that is being written.
+ */
+struct xml_parent
+{
+	/**
+	 * The element that the parent was previously written as, which contains
+	 * the cached elements of its children.
+	 */
+	xml_location previous;
+	/**
+	 * The token of the element that is being written for the parent.
+	 */
+	uint64_t token;
+	/**
+	 * The offset of the parent's element in the output.
+	 */
+	NSUInteger start;
+};
+/**
+ * Returns a new token for an element.  Top-level rows are written
+ * concurrently, so this is atomic.
+ */
+uint64_t next_xml_token()
+{
+	static std::atomic<uint64_t> next { 1 };
+	return next++;
+}
+/**
+ * Returns whether `aLayout` contains the columns in the first `aSlotCount`
+ * slots, in slot order.  Rows that were deferred when the document was loaded
+ * have a value for each of these slots, so their XML can be copied to a file
+ * with this layout.
+ */
+bool layoutMatchesSlots(NSArray<OOOutlineColumn*> *aLayout, NSUInteger aSlotCount)
+{
+	if ([aLayout count] != aSlotCount)
+	{
+		return false;
+	}
+	NSUInteger idx = 0;
+	for (OOOutlineColumn *col in aLayout)
+	{
+		if (col.slot != idx++)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+}
+
+@interface OOOutlineRow ()
+{
+@package
+	/**
+	 * The row whose children contain this row.
+	 */
+	__weak OOOutlineRow *parent;
+	/**
+	 * The children of this row.
+	 */
+	NSMutableArray<OOOutlineRow*> *children;
+	/**
+	 * The index of this row in the parent's children.  This is updated when
+	 * the parent's children are modified, but is validated before use in case
+	 * the row transiently appears twice in the same parent during a move.
+	 */
+	NSUInteger indexInParent;
+	/**
+	 * The number of times that this row appears in the children of `parent`.
+	 * Moves insert a row in its new location before removing it from the old
+	 * one, so this is usually 1 but may briefly be 2.
+	 */
+	NSUInteger parentLinks;
+	/**
+	 * Cached summaries of the children, indexed by column slot so that they
+	 * remain valid when columns are reordered.
+	 */
+	std::unordered_map<NSUInteger, summary_cache_entry> summaries;
+	/**
+	 * The `<children>` element for this row, if the children have not yet
+	 * been read.  The descendants that it describes are not counted in the
+	 * text export widths of the columns until they are read.
+	 */
+	NSData *deferredChildren;
+	/**
+	 * The number of slots that the rows in `deferredChildren` have values
+	 * for.
+	 */
+	NSUInteger deferredSlotCount;
+	/**
+	 * The current version of this row, or `nil` if this row or one of its
+	 * descendants has been modified since the version was constructed.
+	 */
+	OOOutlineRowVersion *version;
+	/**
+	 * The version that was invalidated, if `version` is `nil`.  The next
+	 * version refers to it to find the XML that was last written for the row.
+	 */
+	OOOutlineRowVersion *staleVersion;
+	/**
+	 * The versions of the children, in the same order as `children`.  The
+	 * entries for rows in `staleChildren` may be out of date.
+	 */
+	persistent_vector<OOOutlineRowVersion*> childVersions;
+	/**
+	 * Children that have been inserted or modified since `version` was last
+	 * constructed.  This may contain rows that have since been removed.
+	 */
+	std::vector<OOOutlineRow*> staleChildren;
+	/**
+	 * Flag indicating that every entry in `childVersions` may be out of date.
+	 * This is set instead of letting `staleChildren` grow larger than the
+	 * array of children.
+	 */
+	bool allChildrenStale;
+}
+/**
+ * Returns whether this row is reachable from the root of its document.  This
+ * is O(depth).
+ */
+- (BOOL)isInOutline;
+/**
+ * Adds the values in this row and all of its descendants to, or removes them
+ * from, the text export widths of the document's columns.
+ */
+- (void)updateTextExportWidthsByAdding: (BOOL)isAdding;
+/**
+ * Discards the current version of this row and its ancestors.  This must be
+ * called whenever anything that is saved for the row changes.
+ */
+- (void)invalidateVersion;
+/**
+ * Records that the entry for `aChild` in `childVersions` is out of date.
+ */
+- (void)markChildStale: (OOOutlineRow*)aChild;
+/**
+ * Returns the document's journal if it is recording changes and this row is in
+ * the outline, or `nil` otherwise.
+ */
+- (OOOutlineJournal*)journal;
+@end
+
+@interface OOOutlineRowVersion ()
+{
+@package
+	/**
+	 * The document that contains the row.
+	 */
+	__weak OOOutlineDocument *document;
+	/**
+	 * The unique ID for the row.
+	 */
+	OOOutlineRowID rowID;
+	/**
+	 * The state of the checkbox associated with the row.
+	 */
+	OOOutlineRowCheckedState checkedState;
+	/**
+	 * The note associated with the row.
+	 */
+	NSAttributedString *note;
+	/**
+	 * Flag indicating whether the row is expanded.
+	 */
+	BOOL isExpanded;
+	/**
+	 * Flag indicating whether the row's note is visible.
+	 */
+	BOOL isNoteExpanded;
+	/**
+	 * The values of the row.
+	 */
+	persistent_vector<OOOutlineValue*> values;
+	/**
+	 * The versions of the children of the row.
+	 */
+	persistent_vector<OOOutlineRowVersion*> children;
+	/**
+	 * The `<children>` element for the row, if its children have not yet been
+	 * read.
+	 */
+	NSData *deferredChildren;
+	/**
+	 * The number of slots that the rows in `deferredChildren` have values
+	 * for.
+	 */
+	NSUInteger deferredSlotCount;
+	/**
+	 * The XML written for this version by the last save that wrote it.  This
+	 * is updated by saves, which write each version from one thread.
+	 */
+	xml_cache cachedXML;
+	/**
+	 * The previous version of the row, until this version has been written.
+	 * The XML that was written for it contains the cached XML of the
+	 * unchanged children.
+	 */
+	OOOutlineRowVersion *previousVersion;
+}
+/**
+ * Returns the location of the element that this version was last written as,
+ * given the location of the element that contained it.
+ */
+- (xml_location)locationInParent: (const xml_location&)aParent;
+/**
+ * Writes the row as a child of the row that is being written as `aParent`,
+ * copying the cached XML of the row or its children from the previous
+ * element for the parent where possible.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+            columns: (NSArray<OOOutlineColumn*>*)aLayout
+             parent: (const xml_parent&)aParent;
+@end
+
+/**
+ * Mutable array that stores the children of a row.  This keeps the parent and
+ * index of each child up to date, so that every path that modifies the tree
+ * (including undo and redo, which operate directly on the array) maintains
+ * them.
+ */
+@interface OOOutlineRowChildren : NSMutableArray
+/**
+ * Constructs a new, empty, array of children for the specified row.
+ */
+- (instancetype)initWithParent: (OOOutlineRow*)aRow;
+@end
+
+@implementation OOOutlineRowChildren
+{
+	/**
+	 * The row that owns this array.
+	 */
+	__weak OOOutlineRow *owner;
+	/**
+	 * The rows.
+	 */
+	NSMutableArray<OOOutlineRow*> *rows;
+}
+- (instancetype)initWithParent: (OOOutlineRow*)aRow
+{
+	OO_SUPER_INIT();
+	owner = aRow;
+	rows = [NSMutableArray new];
+	return self;
+}
+/**
+ * Updates the index of all rows from `start` to the end of the array and
+ * discards the summaries that depended on the old set of children.
+ */
+- (void)renumberFrom: (NSUInteger)start
+{
+	OOOutlineRow *o = owner;
+	[o invalidateSummariesForColumn: NSNotFound];
+	[o invalidateVersion];
+	OOOutlineDocument *doc = o.document;
+	[doc.filter rowDidChangeChildren: o];
+	[doc.searchIndex rowDidChangeChildren: o];
+	for (NSUInteger i=start, e=[rows count] ; i<e ; i++)
+	{
+		OOOutlineRow *r = [rows objectAtIndex: i];
+		if (r->parent == o)
+		{
+			r->indexInParent = i;
+		}
+	}
+}
+/**
+ * Records that `aRow` has been inserted into this array.
+ */
+- (void)link: (OOOutlineRow*)aRow
+{
+	OOOutlineRow *o = owner;
+	if (aRow->parent == o)
+	{
+		aRow->parentLinks++;
+		return;
+	}
+	// If the row is being moved within the outline, its values are already
+	// accounted for.
+	BOOL wasInOutline = [aRow isInOutline];
+	aRow->parent = o;
+	aRow->parentLinks = 1;
+	BOOL isInOutline = [aRow isInOutline];
+	OOOutlineDocument *doc = o.document;
+	OOOutlineFilter *filter = doc.filter;
+	if (!wasInOutline && isInOutline)
+	{
+		[aRow updateTextExportWidthsByAdding: YES];
+		[filter rowWasAdded: aRow];
+		[doc.searchIndex rowWasAdded: aRow];
+	}
+	else if (wasInOutline)
+	{
+		if (isInOutline)
+		{
+			[filter rowDidMove: aRow];
+		}
+		else
+		{
+			[filter rowWasRemoved: aRow];
+			[doc.searchIndex rowWasRemoved: aRow];
+		}
+	}
+}
+/**
+ * Records that `aRow` has been removed from this array.  If the row has
+ * already been inserted elsewhere then it is left alone.
+ */
+- (void)unlink: (OOOutlineRow*)aRow
+{
+	OOOutlineRow *o = owner;
+	if ((aRow->parent == o) && (--aRow->parentLinks == 0))
+	{
+		BOOL wasInOutline = [aRow isInOutline];
+		aRow->parent = nil;
+		aRow->indexInParent = NSNotFound;
+		if (wasInOutline)
+		{
+			[aRow updateTextExportWidthsByAdding: NO];
+			OOOutlineDocument *doc = o.document;
+			[doc.filter rowWasRemoved: aRow];
+			[doc.searchIndex rowWasRemoved: aRow];
+		}
+	}
+}
+- (NSUInteger)count
+{
+	return [rows count];
+}
+- (id)objectAtIndex: (NSUInteger)index
+{
+	return [rows objectAtIndex: index];
+}
+- (void)insertObject: (OOOutlineRow*)anObject atIndex: (NSUInteger)index
+{
+	OOOutlineRow *o = owner;
+	OOOutlineJournal *journal = [o journal];
+	BOOL isMove = journal && [anObject isInOutline];
+	[rows insertObject: anObject atIndex: index];
+	o->childVersions.insert(index, nil);
+	[o markChildStale: anObject];
+	[self link: anObject];
+	[self renumberFrom: index];
+	[journal row: o didInsertRow: anObject atIndex: index isMove: isMove];
+}
+- (void)removeObjectAtIndex: (NSUInteger)index
+{
+	OOOutlineRow *o = owner;
+	[[o journal] row: o willRemoveRowAtIndex: index];
+	OOOutlineRow *r = [rows objectAtIndex: index];
+	[rows removeObjectAtIndex: index];
+	o->childVersions.erase(index);
+	[self unlink: r];
+	[self renumberFrom: index];
+}
+- (void)addObject: (OOOutlineRow*)anObject
+{
+	[self insertObject: anObject atIndex: [rows count]];
+}
+- (void)removeLastObject
+{
+	[self removeObjectAtIndex: [rows count] - 1];
+}
+- (void)replaceObjectAtIndex: (NSUInteger)index withObject: (OOOutlineRow*)anObject
+{
+	OOOutlineRow *o = owner;
+	OOOutlineJournal *journal = [o journal];
+	BOOL isMove = journal && [anObject isInOutline];
+	[journal row: o willRemoveRowAtIndex: index];
+	OOOutlineRow *r = [rows objectAtIndex: index];
+	[rows replaceObjectAtIndex: index withObject: anObject];
+	o->childVersions.set(index, nil);
+	[o markChildStale: anObject];
+	[self unlink: r];
+	[self link: anObject];
+	[self renumberFrom: index];
+	[journal row: o didInsertRow: anObject atIndex: index isMove: isMove];
+}
+- (void)insertObjects: (NSArray<OOOutlineRow*>*)objects atIndexes: (NSIndexSet*)indexes
+{
+	OOOutlineRow *o = owner;
+	OOOutlineJournal *journal = [o journal];
+	std::vector<BOOL> isMove;
+	if (journal)
+	{
+		for (OOOutlineRow *r in objects)
+		{
+			isMove.push_back([r isInOutline]);
+		}
+	}
+	[rows insertObjects: objects atIndexes: indexes];
+	for (NSUInteger idx : IndexSetRange<>(indexes))
+	{
+		o->childVersions.insert(idx, nil);
+	}
+	for (OOOutlineRow *r in objects)
+	{
+		[o markChildStale: r];
+		[self link: r];
+	}
+	[self renumberFrom: [indexes firstIndex]];
+	if (journal)
+	{
+		// Inserting at each index in ascending order reproduces the insertion.
+		__block NSUInteger i = 0;
+		[indexes enumerateIndexesUsingBlock: ^(NSUInteger idx, BOOL *stop) {
+			[journal row: o
+			didInsertRow: [rows objectAtIndex: idx]
+			     atIndex: idx
+			      isMove: isMove.at(i++)];
+		}];
+	}
+}
+- (void)removeObjectsAtIndexes: (NSIndexSet*)indexes
+{
+	OOOutlineRow *o = owner;
+	OOOutlineJournal *journal = [o journal];
+	[indexes enumerateIndexesWithOptions: NSEnumerationReverse
+	                          usingBlock: ^(NSUInteger idx, BOOL *stop) {
+		[journal row: o willRemoveRowAtIndex: idx];
+		o->childVersions.erase(idx);
+	}];
+	NSArray<OOOutlineRow*> *removed = [rows objectsAtIndexes: indexes];
+	[rows removeObjectsAtIndexes: indexes];
+	for (OOOutlineRow *r in removed)
+	{
+		[self unlink: r];
+	}
+	[self renumberFrom: [indexes firstIndex]];
+}
+- (void)removeAllObjects
+{
+	OOOutlineRow *o = owner;
+	if (OOOutlineJournal *journal = [o journal])
+	{
+		for (NSUInteger i=[rows count] ; i>0 ; i--)
+		{
+			[journal row: o willRemoveRowAtIndex: i - 1];
+		}
+	}
+	NSArray<OOOutlineRow*> *removed = [rows copy];
+	[rows removeAllObjects];
+	o->childVersions.clear();
+	for (OOOutlineRow *r in removed)
+	{
+		[self unlink: r];
+	}
+	[self renumberFrom: 0];
+}
+- (NSUInteger)countByEnumeratingWithState: (NSFastEnumerationState*)state
+                                  objects: (id __unsafe_unretained[])buffer
+                                    count: (NSUInteger)len
+{
+	return [rows countByEnumeratingWithState: state
+	                                 objects: buffer
+	                                   count: len];
+}
+@end
+
+/**
+ * Mutable array that stores the values of a row.  This invalidates the cached
+ * summaries that depend on a value and updates the column's text export width
+ * whenever it is replaced, including by undo and redo.  The array is indexed by
+ * column display index, but the values are stored by column slot in a
+ * persistent vector, so that versions of the row can share them.
+ */
+@interface OOOutlineRowValues : NSMutableArray
+{
+@package
+	/**
+	 * The values, indexed by column slot.  This may be shorter than the
+	 * number of slots, because columns added after the row was created have
+	 * empty values.
+	 */
+	persistent_vector<OOOutlineValue*> values;
+}
+/**
+ * Constructs a new, empty, array of values for the specified row.
+ */
+- (instancetype)initWithRow: (OOOutlineRow*)aRow;
+/**
+ * Stores a value in a slot, without any of the side effects of replacing it.
+ */
+- (void)setValue: (OOOutlineValue*)aValue inSlot: (NSUInteger)aSlot;
+@end
+
+@implementation OOOutlineRowValues
+{
+	/**
+	 * The row that owns this array.
+	 */
+	__weak OOOutlineRow *owner;
+}
+- (instancetype)initWithRow: (OOOutlineRow*)aRow
+{
+	OO_SUPER_INIT();
+	owner = aRow;
+	return self;
+}
+/**
+ * Invalidates the summaries of the parent of the owning row, and the owning
+ * row's version.  The row's own summaries depend only on its children.
+ */
+- (void)invalidateColumn: (NSUInteger)aCol
+{
+	OOOutlineRow *o = owner;
+	[o.parent invalidateSummariesForColumn: aCol];
+	[o invalidateVersion];
+}
+/**
+ * Returns the column for the value at the specified index if it is
+ * maintaining a text export width and the owning row is in the outline, or
+ * `nil` otherwise.
+ */
+- (OOOutlineColumn*)textExportColumnAtIndex: (NSUInteger)index
+{
+	OOOutlineRow *o = owner;
+	NSArray<OOOutlineColumn*> *columns = o.document.columns;
+	if (index >= [columns count])
+	{
+		return nil;
+	}
+	OOOutlineColumn *col = [columns objectAtIndex: index];
+	if (!col.maintainsTextExportWidth || ![o isInOutline])
+	{
+		return nil;
+	}
+	return col;
+}
+/**
+ * Returns the slot that stores the value at the specified display index, or
+ * raises an exception if `index` is not the index of a value.  Rows that are
+ * not in a document store their values in display order.
+ */
+- (NSUInteger)slotForIndex: (NSUInteger)index
+{
+	NSUInteger count = [self count];
+	if (index >= count)
+	{
+		[NSException raise: NSRangeException
+		            format: @"Index %lu out of bounds for %lu values",
+		                    (unsigned long)index, (unsigned long)count];
+	}
+	OOOutlineRow *o = owner;
+	OOOutlineDocument *doc = o.document;
+	return doc ? [[doc.columns objectAtIndex: index] slot] : index;
+}
+- (void)setValue: (OOOutlineValue*)aValue inSlot: (NSUInteger)aSlot
+{
+	// Slots after the last stored value are implicitly empty.
+	while (values.size() <= aSlot)
+	{
+		values.push_back([OOOutlineValue placeholder]);
+	}
+	values.set(aSlot, aValue);
+}
+- (NSUInteger)count
+{
+	OOOutlineRow *o = owner;
+	OOOutlineDocument *doc = o.document;
+	return doc ? [doc columnCount] : values.size();
+}
+- (id)objectAtIndex: (NSUInteger)index
+{
+	NSUInteger slot = [self slotForIndex: index];
+	return (slot < values.size()) ? values[slot] : [OOOutlineValue placeholder];
+}
+/**
+ * Raises an exception.  A row has a value for every column, so values are
+ * added and removed by adding and removing columns in the document.
+ */
+- (void)valuesCannotBeInsertedOrRemoved
+{
+	[NSException raise: NSInvalidArgumentException
+	            format: @"Values can be replaced but not inserted or removed"];
+}
+- (void)insertObject: (OOOutlineValue*)anObject atIndex: (NSUInteger)index
+{
+	[self valuesCannotBeInsertedOrRemoved];
+}
+- (void)removeObjectAtIndex: (NSUInteger)index
+{
+	[self valuesCannotBeInsertedOrRemoved];
+}
+- (void)addObject: (OOOutlineValue*)anObject
+{
+	[self valuesCannotBeInsertedOrRemoved];
+}
+- (void)removeLastObject
+{
+	[self valuesCannotBeInsertedOrRemoved];
+}
+- (void)replaceObjectAtIndex: (NSUInteger)index withObject: (OOOutlineValue*)anObject
+{
+	NSUInteger slot = [self slotForIndex: index];
+	if (OOOutlineColumn *col = [self textExportColumnAtIndex: index])
+	{
+		[col removeValueFromTextExportWidth: [self objectAtIndex: index]];
+		[col addValueToTextExportWidth: anObject];
+	}
+	[self setValue: anObject inSlot: slot];
+	[self invalidateColumn: index];
+	OOOutlineRow *o = owner;
+	OOOutlineDocument *doc = o.document;
+	[doc.filter rowDidChange: o];
+	[doc.searchIndex rowDidChange: o];
+	[[o journal] row: o didSetValue: anObject atIndex: index];
+}
+@end
 
 @implementation OOOutlineRow
 @synthesize
 	checkedState,
 	children,
 	document,
-	identifier,
 	isExpanded,
 	isNoteExpanded,
 	note,
+	parent,
+	rowID,
 	values;
 
 - (id)initInDocument: (OOOutlineDocument*)aDoc
 {
 	return [self initWithOO3XMLNode: nil inDocument: aDoc];
 }
-- (void)watchColumnsInDocument: (OOOutlineDocument*)aDoc
+- (void)setNote: (NSMutableAttributedString*)aNote
 {
-	for (OOOutlineColumn *col in [aDoc columns])
+	note = aNote;
+	[self invalidateVersion];
+	OOOutlineDocument *doc = document;
+	[doc.filter rowDidChange: self];
+	[doc.searchIndex rowDidChange: self];
+	[[self journal] rowDidChangeAttributes: self];
+}
+- (void)setIsExpanded: (BOOL)aFlag
+{
+	isExpanded = aFlag;
+	[self invalidateVersion];
+	[[self journal] rowDidChangeAttributes: self];
+}
+- (void)setIsNoteExpanded: (BOOL)aFlag
+{
+	isNoteExpanded = aFlag;
+	[self invalidateVersion];
+	[[self journal] rowDidChangeAttributes: self];
+}
+- (void)setCheckedState: (OOOutlineRowCheckedState)aState
+{
+	checkedState = aState;
+	[self invalidateVersion];
+	[document.filter rowDidChange: self];
+	[[self journal] rowDidChangeAttributes: self];
+}
+- (NSString*)identifier
+{
+	OOOutlineDocument *doc = document;
+	return doc ? [doc identifierForRowID: rowID] : row_identifier_string(rowID);
+}
+- (void)setIdentifier: (NSString*)anIdentifier
+{
+	OOOutlineDocument *doc = document;
+	OOOutlineRowID oldID = rowID;
+	[doc unregisterRow: self];
+	rowID = doc ? [doc registerRow: self withIdentifier: anIdentifier] : next_row_id();
+	[doc.filter row: self didChangeIDFrom: oldID];
+	[doc.searchIndex row: self didChangeIDFrom: oldID];
+	[self invalidateVersion];
+	// Records identify rows by identifier, so this cannot be recorded.
+	[[self journal] requireFullSave];
+}
+- (OOOutlineJournal*)journal
+{
+	OOOutlineJournal *journal = document.journal;
+	return ([journal isRecording] && [self isInOutline]) ? journal : nil;
+}
+- (void)invalidateVersion
+{
+	// If a row has no version then neither do its ancestors, and it is
+	// already stale in its parent.
+	for (OOOutlineRow *r = self ; (r != nil) && (r->version != nil) ; r = r->parent)
 	{
-		[col addObserver: self
-		      forKeyPath: @"columnType"
-		         options: 0
-		         context: nullptr];
+		r->staleVersion = r->version;
+		r->version = nil;
+		[r->parent markChildStale: r];
 	}
 }
-- (void)observeValueForKeyPath: (NSString *)keyPath
-                      ofObject: (id)object
-                        change: (NSDictionary<NSKeyValueChangeKey, id> *)change
-                       context: (void *)context
+- (void)markChildStale: (OOOutlineRow*)aChild
 {
-	if ([@"columnType" isEqualToString: keyPath])
+	if (allChildrenStale)
 	{
-		NSUInteger idx = [[document columns] indexOfObjectIdenticalTo: object];
-		if (idx != NSNotFound)
+		return;
+	}
+	if (staleChildren.size() > [children count])
+	{
+		allChildrenStale = true;
+		staleChildren.clear();
+		return;
+	}
+	staleChildren.push_back(aChild);
+}
+- (OOOutlineRowVersion*)version
+{
+	if (version)
+	{
+		return version;
+	}
+	// Update the versions of the children that have changed.  Rows that
+	// appear twice (during a move) or that have been removed are handled by
+	// updating everything.
+	for (OOOutlineRow *child : staleChildren)
+	{
+		if (child->parent != self)
 		{
-			id val = [[values objectAtIndex: idx] value];
-			auto *newVal = [[OOOutlineValue alloc] initWithValue: val
-			                                            inColumn: object];
-			[values replaceObjectAtIndex: idx withObject: newVal];
+			continue;
 		}
+		if (child->parentLinks != 1)
+		{
+			allChildrenStale = true;
+			break;
+		}
+		childVersions.set([child indexInParent], [child version]);
 	}
+	if (allChildrenStale)
+	{
+		childVersions.clear();
+		for (OOOutlineRow *child in children)
+		{
+			childVersions.push_back([child version]);
+		}
+	}
+	staleChildren.clear();
+	allChildrenStale = false;
+	auto *v = [OOOutlineRowVersion new];
+	v->document = document;
+	v->rowID = rowID;
+	v->checkedState = checkedState;
+	v->note = note;
+	v->isExpanded = isExpanded;
+	v->isNoteExpanded = isNoteExpanded;
+	v->values = ((OOOutlineRowValues*)values)->values;
+	v->children = childVersions;
+	v->deferredChildren = deferredChildren;
+	v->deferredSlotCount = deferredSlotCount;
+	v->previousVersion = staleVersion;
+	staleVersion = nil;
+	version = v;
+	return v;
 }
-
-- (id)initWithOO3XMLNode: (NSXMLElement*)xml
-              inDocument: (OOOutlineDocument*)aDoc
+- (NSMutableArray<OOOutlineRow*>*)children
+{
+	if (deferredChildren)
+	{
+		[self readDeferredChildren];
+	}
+	return children;
+}
+- (BOOL)hasChildren
+{
+	return (deferredChildren != nil) || ([children count] > 0);
+}
+- (void)setDeferredChildren: (NSData*)aFragment
+                  slotCount: (NSUInteger)aSlotCount
+{
+	NSAssert([children count] == 0, @"Deferred children replace existing children");
+	deferredChildren = aFragment;
+	deferredSlotCount = aSlotCount;
+	[self invalidateVersion];
+}
+- (NSData*)deferredChildren
+{
+	return deferredChildren;
+}
+- (void)readDeferredChildrenNotMatchingLayout: (NSArray<OOOutlineColumn*>*)aLayout
+{
+	if (deferredChildren && layoutMatchesSlots(aLayout, deferredSlotCount))
+	{
+		return;
+	}
+	for (OOOutlineRow *child in [self children])
+	{
+		[child readDeferredChildrenNotMatchingLayout: aLayout];
+	}
+}
+/**
+ * Constructs the children that were deferred when the document was loaded.
+ */
+- (void)readDeferredChildren
+{
+	NSData *xml = deferredChildren;
+	deferredChildren = nil;
+	OOOutlineDocument *doc = document;
+	auto *reader = [[OOOutlineXMLReader alloc] initWithDocument: doc];
+	reader.defersCollapsedChildren = YES;
+	NSError *error;
+	// The rows were already in the document, so reading them is not a change.
+	[doc.journal suspend];
+	BOOL success = [reader readOO3XMLFragment: xml
+	                                slotCount: deferredSlotCount
+	                                  intoRow: self
+	                                    error: &error];
+	[doc.journal resume];
+	if (!success)
+	{
+		[NSException raise: NSInternalInconsistencyException
+		            format: @"Unable to read deferred rows: %@", error];
+	}
+}
+- (NSUInteger)indexInParent
+{
+	OOOutlineRow *p = parent;
+	if (p == nil)
+	{
+		return NSNotFound;
+	}
+	NSMutableArray *siblings = p->children;
+	if ((indexInParent >= [siblings count]) ||
+	    ([siblings objectAtIndex: indexInParent] != self))
+	{
+		indexInParent = [siblings indexOfObjectIdenticalTo: self];
+	}
+	return indexInParent;
+}
+- (BOOL)isInOutline
+{
+	OOOutlineRow *r = self;
+	while (OOOutlineRow *p = r->parent)
+	{
+		r = p;
+	}
+	OOOutlineDocument *doc = document;
+	return r == doc.root;
+}
+- (void)updateTextExportWidthsByAdding: (BOOL)isAdding
+{
+	OOOutlineDocument *doc = document;
+	std::vector<std::pair<NSUInteger, OOOutlineColumn*>> cols;
+	NSUInteger i = 0;
+	for (OOOutlineColumn *col in doc.columns)
+	{
+		if (col.maintainsTextExportWidth)
+		{
+			cols.push_back({ i, col });
+		}
+		i++;
+	}
+	if (cols.empty())
+	{
+		return;
+	}
+	std::function<void(OOOutlineRow*)> visit = [&](OOOutlineRow *r)
+		{
+			NSArray<OOOutlineValue*> *vals = r->values;
+			for (auto &[idx, col] : cols)
+			{
+				if (idx >= [vals count])
+				{
+					continue;
+				}
+				OOOutlineValue *v = [vals objectAtIndex: idx];
+				if (isAdding)
+				{
+					[col addValueToTextExportWidth: v];
+				}
+				else
+				{
+					[col removeValueFromTextExportWidth: v];
+				}
+			}
+			for (OOOutlineRow *child in r->children)
+			{
+				visit(child);
+			}
+		};
+	visit(self);
+}
+- (NSUInteger)depth
+{
+	NSUInteger depth = 0;
+	for (OOOutlineRow *p = parent ; p != nil ; p = p->parent)
+	{
+		depth++;
+	}
+	return depth;
+}
+- (BOOL)isAncestorOfRow: (OOOutlineRow*)aRow
+{
+	for (OOOutlineRow *p = aRow.parent ; p != nil ; p = p->parent)
+	{
+		if (p == self)
+		{
+			return YES;
+		}
+	}
+	return NO;
+}
+/**
+ * Returns the slot of the column at the specified display index, which is the
+ * key for its cached summaries, or `NSNotFound` for `NSNotFound`.
+ */
+- (NSUInteger)slotForColumn: (NSUInteger)aCol
+{
+	OOOutlineDocument *doc = document;
+	if (!doc || (aCol == NSNotFound))
+	{
+		return aCol;
+	}
+	return [[doc.columns objectAtIndex: aCol] slot];
+}
+- (OOOutlineValue*)summaryForColumn: (NSUInteger)aCol
+                       usingSummary: (OOOutlineSummary*)aSummary
+{
+	NSUInteger slot = [self slotForColumn: aCol];
+	auto cached = summaries.find(slot);
+	if ((cached != summaries.end()) && (cached->second.summary == aSummary))
+	{
+		return cached->second.value;
+	}
+	OOOutlineValue *value = [aSummary computeSummaryForRow: self inColumn: aCol];
+	summaries[slot] = { aSummary, value };
+	return value;
+}
+- (void)invalidateSummariesForColumn: (NSUInteger)aCol
+{
+	// If a row does not have a cached summary then nothing above it can
+	// depend on its summary: any ancestor that used it would have cached it
+	// in this row when computing its own summary, and every invalidation
+	// continues to the parent.
+	NSUInteger slot = [self slotForColumn: aCol];
+	for (OOOutlineRow *r = self ; r != nil ; r = r->parent)
+	{
+		if (slot == NSNotFound)
+		{
+			if (r->summaries.empty())
+			{
+				return;
+			}
+			r->summaries.clear();
+		}
+		else if (r->summaries.erase(slot) == 0)
+		{
+			return;
+		}
+	}
+}
++ (OOOutlineRowCheckedState)checkedStateForOO3Name: (NSString*)aName
 {
-	OO_SUPER_INIT();
 	static object_map<NSString*, OOOutlineRowCheckedState> checked_names = {
 		{ @"indeterminate", OOOutlineRowCheckedIndeterminate},
 		{ @"checked", OOOutlineRowChecked },
 		{ @"unchecked", OOOutlineRowUnChecked }
 	};
-	children = [NSMutableArray new];
-	values = [NSMutableArray new];
+	// Rows are constructed concurrently while loading, so this must not insert
+	// missing names into the map.
+	auto i = checked_names.find(aName);
+	return (i == checked_names.end()) ? OOOutlineRowCheckedIndeterminate : i->second;
+}
+- (id)initWithIdentifier: (NSString*)anIdentifier
+              inDocument: (OOOutlineDocument*)aDoc
+{
+	OO_SUPER_INIT();
+	children = [[OOOutlineRowChildren alloc] initWithParent: self];
+	values = [[OOOutlineRowValues alloc] initWithRow: self];
+	indexInParent = NSNotFound;
 	document = aDoc;
+	rowID = aDoc ? [aDoc registerRow: self withIdentifier: anIdentifier] : next_row_id();
+	return self;
+}
+- (void)dealloc
+{
+	[document unregisterRow: self];
+}
+- (OOOutlineValue*)valueForColumn: (OOOutlineColumn*)aColumn
+{
+	auto &vals = ((OOOutlineRowValues*)values)->values;
+	NSUInteger slot = aColumn.slot;
+	return (slot < vals.size()) ? vals[slot] : [OOOutlineValue placeholder];
+}
+- (void)setValue: (OOOutlineValue*)aValue
+          inSlot: (NSUInteger)aSlot
+{
+	[(OOOutlineRowValues*)values setValue: aValue inSlot: aSlot];
+	[parent invalidateSummariesForColumn: NSNotFound];
+	[self invalidateVersion];
+	OOOutlineDocument *doc = document;
+	[doc.filter rowDidChange: self];
+	[doc.searchIndex rowDidChange: self];
+}
+- (id)initWithOO3XMLNode: (NSXMLElement*)xml
+              inDocument: (OOOutlineDocument*)aDoc
+{
+	if (!(self = [self initWithIdentifier: [[xml attributeForName: @"id"] stringValue]
+	                           inDocument: aDoc]))
+	{
+		return nil;
+	}
 	if (xml)
 	{
 		for (NSXMLElement *c in [xml elementsForName: @"children"])
@@ -94,13 +1117,19 @@
 		}
 		if (NSXMLElement *e = [xml elementForName: @"values"])
 		{
+			// The values are in display order, which may not be slot order.
 			auto *cols = aDoc.columns;
 			NSUInteger i = 0;
 			for (NSXMLElement *v in e.children)
 			{
-				OOOutlineColumn *col = [cols objectAtIndex: i++];
-				[values addObject: [OOOutlineValue outlineValueWithOO3XML: v
-				                                                 inColumn: col]];
+				if (i >= [cols count])
+				{
+					break;
+				}
+				OOOutlineColumn *col = [cols objectAtIndex: i];
+				[values replaceObjectAtIndex: i++
+				                  withObject: [OOOutlineValue outlineValueWithOO3XML: v
+				                                                            inColumn: col]];
 			}
 		}
 		isExpanded = [[[xml attributeForName: @"expanded"] stringValue] boolValue];
@@ -110,25 +1139,11 @@
 			                                            withPartialStyle: aDoc.noteColumn.style];
 			isNoteExpanded = [[[n attributeForName: @"expanded"] stringValue] boolValue];
 		}
-		identifier = [[xml attributeForName: @"id"] stringValue];
 		if (NSString *checked = [[xml attributeForName: @"state"] stringValue])
 		{
-			checkedState = checked_names[checked];
-		}
-	}
-	else
-	{
-		for (NSUInteger i=0, e=[aDoc.columns count] ; i<e ; ++i)
-		{
-			[values addObject: [OOOutlineValue placeholder]];
+			checkedState = [OOOutlineRow checkedStateForOO3Name: checked];
 		}
 	}
-	if (!identifier)
-	{
-		identifier = identifierString();
-	}
-	[[aDoc allRows] setObject: self forKey: identifier];
-	[self watchColumnsInDocument: aDoc];
 	return self;
 }
 - (id)initWithOO2Plist: (NSDictionary*)aPlist
@@ -139,7 +1154,6 @@
 	{
 		return nil;
 	}
-	[values removeAllObjects];
 	isExpanded = [[aPlist objectForKey: @"Expanded"] boolValue];
 	NSUInteger idx = 0;
 	NSUInteger columnIndex = 0;
@@ -157,8 +1171,10 @@
 		}
 		else
 		{
-			[values addObject: [[OOOutlineValue alloc] initWithValue: contents
-			                                                inColumn: [aDoc.columns objectAtIndex: columnIndex++]]];
+			[values replaceObjectAtIndex: columnIndex
+			                  withObject: [[OOOutlineValue alloc] initWithValue: contents
+			                                                           inColumn: [aDoc.columns objectAtIndex: columnIndex]]];
+			columnIndex++;
 		}
 	}
 	for (NSDictionary *child in [aPlist objectForKey: @"Children"])
@@ -167,51 +1183,178 @@
 														notesColumn: aColumn
 		                                                 inDocument: aDoc]];
 	}
-	[self watchColumnsInDocument: aDoc];
 	return self;
 }
 
 - (NSXMLElement*)oo3xmlValue
 {
-	NSXMLElement *row = [NSXMLElement elementWithName: @"item"];
+	return [OOXMLWriter elementByWriting: ^(OOXMLWriter *w) { [self writeOO3XML: w]; }];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+{
+	OOOutlineDocument *doc = document;
+	NSArray<OOOutlineColumn*> *layout = doc.columns;
+	[self readDeferredChildrenNotMatchingLayout: layout];
+	[[self version] writeOO3XML: aWriter columns: layout];
+}
+@end
+
+@implementation OOOutlineRowVersion
+@synthesize
+	checkedState,
+	isExpanded,
+	isNoteExpanded,
+	note;
+
+- (NSString*)identifier
+{
+	OOOutlineDocument *doc = document;
+	return doc ? [doc identifierForRowID: rowID] : row_identifier_string(rowID);
+}
+- (NSUInteger)childCount
+{
+	return children.size();
+}
+- (OOOutlineValue*)valueForColumn: (OOOutlineColumn*)aColumn
+{
+	NSUInteger slot = aColumn.slot;
+	return (slot < values.size()) ? values[slot] : [OOOutlineValue placeholder];
+}
+- (OOOutlineRowVersion*)childAtIndex: (NSUInteger)anIndex
+{
+	NSAssert(anIndex < children.size(), @"Child index out of range");
+	return children[anIndex];
+}
+- (xml_location)locationInParent: (const xml_location&)aParent
+{
+	if (cachedXML.token == 0)
+	{
+		return {};
+	}
+	if (cachedXML.buffer)
+	{
+		return { cachedXML.buffer, cachedXML.range.location, cachedXML.token };
+	}
+	if (aParent.buffer && (aParent.token == cachedXML.parentToken))
+	{
+		return { aParent.buffer, aParent.start + cachedXML.range.location, cachedXML.token };
+	}
+	return {};
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+            columns: (NSArray<OOOutlineColumn*>*)aLayout
+{
+	[self writeOO3XML: aWriter columns: aLayout parent: xml_parent()];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+            columns: (NSArray<OOOutlineColumn*>*)aLayout
+             parent: (const xml_parent&)aParent
+{
 	static std::unordered_map<OOOutlineRowCheckedState, NSString*> checked_names = {
 		{ OOOutlineRowCheckedIndeterminate, @"indeterminate"},
 		{ OOOutlineRowChecked, @"checked" },
 		{ OOOutlineRowUnChecked, @"unchecked" }
 	};
-	[row setAttributesWithDictionary: @{
-	                                     @"id"    : identifier,
-	                                     @"state" : checked_names[checkedState]
-	                                   }];
+	NSUInteger depth = [aWriter depth];
+	// Rows that are not written as a child of another row are cached with
+	// their writer's output.
+	bool isNested = (aParent.token != 0);
+	// Reuse the previous output if nothing has changed.  The output is
+	// retained only by writers that keep all of their output in memory.
+	BOOL canCache = ([aWriter offset] != NSNotFound);
+	auto updateCache = [&](NSUInteger aStart, uint64_t aToken)
+		{
+			NSRange range = NSMakeRange(aStart, [aWriter offset] - aStart);
+			if (isNested)
+			{
+				range.location -= aParent.start;
+			}
+			cachedXML = { isNested ? nil : [aWriter data], range, aToken, aParent.token, depth, aLayout };
+			previousVersion = nil;
+		};
+	if (canCache && (cachedXML.depth == depth) && (cachedXML.columns == aLayout))
+	{
+		xml_location location = [self locationInParent: aParent.previous];
+		if (location.buffer)
+		{
+			[aWriter addWrittenElement: location.buffer
+			                     range: NSMakeRange(location.start, cachedXML.range.length)];
+			updateCache([aWriter offset] - cachedXML.range.length, cachedXML.token);
+			return;
+		}
+	}
+	// Find the element that was last written for the row, which contains the
+	// cached XML for its unchanged children.
+	OOOutlineRowVersion *previous = self;
+	while (previous && (previous->cachedXML.token == 0))
+	{
+		previous = previous->previousVersion;
+	}
+	xml_parent context = {
+		previous ? [previous locationInParent: aParent.previous] : xml_location(),
+		next_xml_token(),
+		0
+	};
+	[aWriter startElement: @"item"];
+	NSUInteger start = [aWriter elementOffset];
+	context.start = start;
+	[aWriter addAttribute: [self identifier] withName: @"id"];
+	[aWriter addAttribute: checked_names.at(checkedState) withName: @"state"];
 	if (isExpanded)
 	{
-		[row addAttribute: @"yes" withName: @"expanded"];
+		[aWriter addAttribute: @"yes" withName: @"expanded"];
+	}
+	[aWriter startElement: @"values"];
+	if (aLayout)
+	{
+		for (OOOutlineColumn *col in aLayout)
+		{
+			[[self valueForColumn: col] writeOO3XML: aWriter];
+		}
 	}
-	NSXMLElement *vals = [NSXMLElement elementWithName: @"values"];
-	for (OOOutlineValue *val in values)
+	else
 	{
-		[vals addChild: [val oo3xmlValue]];
+		values.for_each([&](OOOutlineValue *val)
+			{
+				[val writeOO3XML: aWriter];
+			});
 	}
-	[row addChild: vals];
+	[aWriter endElement];
 	if (note)
 	{
-		NSXMLElement *noteXML = [NSXMLElement elementWithName: @"note"];
+		[aWriter startElement: @"note"];
 		if (isNoteExpanded)
 		{
-			[noteXML addAttribute: @"yes" withName: @"expanded"];
+			[aWriter addAttribute: @"yes" withName: @"expanded"];
 		}
-		[noteXML addChild: [note oo3xmlValueWithPartialStyle: document.noteColumn.style]];
-		[row addChild: noteXML];
+		[note writeOO3XML: aWriter withPartialStyle: document.noteColumn.style];
+		[aWriter endElement];
 	}
-	if ([children count] > 0)
+	if (deferredChildren)
 	{
-		NSXMLElement *childs = [NSXMLElement elementWithName: @"children"];
-		for (OOOutlineRow *child in children)
+		// The fragment's values are in slot order, so it can be copied only
+		// to a file with the same columns.  Saves read any other deferred
+		// children before taking the snapshot.
+		if (!layoutMatchesSlots(aLayout, deferredSlotCount))
 		{
-			[childs addChild: [child oo3xmlValue]];
+			[NSException raise: NSInternalInconsistencyException
+			            format: @"Deferred rows do not match the column layout"];
 		}
-		[row addChild: childs];
+		[aWriter addFragment: deferredChildren];
+	}
+	else if (!children.empty())
+	{
+		[aWriter startElement: @"children"];
+		children.for_each([&](OOOutlineRowVersion *child)
+			{
+				[child writeOO3XML: aWriter columns: aLayout parent: context];
+			});
+		[aWriter endElement];
+	}
+	[aWriter endElement];
+	if (canCache)
+	{
+		updateCache(start, context.token);
 	}
-	return row;
 }
 @end
@@ -0,0 +1,110 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OOOutlineRow.h"
+
+@class OOOutlineColumn;
+@class OOOutlineDocument;
+
+/**
+ * An occurrence of a search string in the text of a row.
+ */
+@interface OOOutlineSearchMatch : NSObject
+/**
+ * The row that contains the match.
+ */
+@property (nonatomic, readonly) OOOutlineRow *row;
+/**
+ * The column whose value contains the match, or `nil` if the match is in the
+ * row's note.
+ */
+@property (nonatomic, readonly) OOOutlineColumn *column;
+/**
+ * The range of the match in the plain text of the value or note.
+ */
+@property (nonatomic, readonly) NSRange range;
+@end
+
+/**
+ * Full-text index of the values in text and enumeration columns and the notes
+ * of the rows in a document.  This maps every sequence of three characters
+ * (after folding case) to the rows that contain it, so substring searches
+ * examine only the rows that contain all of the search string's trigrams.
+ * Searches for strings shorter than three characters examine every row.
+ *
+ * Rows call the index when they are edited, inserted, or removed, and only
+ * those rows are indexed again.  The results of the last search are cached
+ * until something changes, so stepping through matches does not repeat it.
+ */
+@interface OOOutlineSearchIndex : NSObject
+/**
+ * Constructs an index of the rows of the specified document.  This reads any
+ * rows whose children were deferred when the document was loaded.
+ */
+- (instancetype)initWithDocument: (OOOutlineDocument*)aDocument;
+/**
+ * Returns the rows that contain the string, ignoring case, in outline order.
+ */
+- (NSArray<OOOutlineRow*>*)rowsMatchingString: (NSString*)aString;
+/**
+ * Returns every occurrence of the string, ignoring case, in outline order.
+ * Within a row, matches in values (in column order) precede matches in the
+ * note.
+ */
+- (NSArray<OOOutlineSearchMatch*>*)matchesForString: (NSString*)aString;
+/**
+ * Returns the first row that contains the string after (or, if `isBackwards`
+ * is set, before) `aRow` in outline order, wrapping around at the end of the
+ * outline.  If `aRow` is `nil` then this returns the first (or last) row that
+ * contains the string.  Returns `nil` if no rows contain the string.
+ */
+- (OOOutlineRow*)rowMatchingString: (NSString*)aString
+                          afterRow: (OOOutlineRow*)aRow
+                         backwards: (BOOL)isBackwards;
+/**
+ * Records that a row and its descendants have been added to the outline.
+ */
+- (void)rowWasAdded: (OOOutlineRow*)aRow;
+/**
+ * Records that a row and its descendants have been removed from the outline.
+ */
+- (void)rowWasRemoved: (OOOutlineRow*)aRow;
+/**
+ * Records that the children of a row have been inserted, removed, or
+ * reordered.
+ */
+- (void)rowDidChangeChildren: (OOOutlineRow*)aRow;
+/**
+ * Records that a value or the note of a row has changed.
+ */
+- (void)rowDidChange: (OOOutlineRow*)aRow;
+/**
+ * Records that a row's ID has changed.
+ */
+- (void)row: (OOOutlineRow*)aRow didChangeIDFrom: (OOOutlineRowID)anID;
+@end
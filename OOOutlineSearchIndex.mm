@@ -0,0 +1,470 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import "OpenOutliner.h"
+#import "row_index.h"
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+/**
+ * Three UTF-16 code units, packed into an integer.
+ */
+typedef uint64_t trigram;
+
+/**
+ * Appends the trigrams of a string, after folding case, to `aResult`.
+ */
+void add_trigrams(NSString *aString, std::vector<trigram> &aResult)
+{
+	NSString *folded = [aString stringByFoldingWithOptions: NSCaseInsensitiveSearch
+	                                                locale: nil];
+	NSUInteger length = [folded length];
+	if (length < 3)
+	{
+		return;
+	}
+	std::vector<unichar> chars(length);
+	[folded getCharacters: chars.data() range: NSMakeRange(0, length)];
+	for (NSUInteger i=2 ; i<length ; i++)
+	{
+		aResult.push_back((trigram(chars[i-2]) << 32) |
+		                  (trigram(chars[i-1]) << 16) |
+		                  trigram(chars[i]));
+	}
+}
+
+/**
+ * Sorts trigrams and removes duplicates.
+ */
+void make_unique(std::vector<trigram> &someTrigrams)
+{
+	std::sort(someTrigrams.begin(), someTrigrams.end());
+	someTrigrams.erase(std::unique(someTrigrams.begin(), someTrigrams.end()),
+	                   someTrigrams.end());
+}
+
+/**
+ * Calls `aVisitor` with the column (or `nil` for the note) and the text of each
+ * part of a row that is searched.
+ */
+template<typename F>
+void visit_text(OOOutlineRow *aRow, NSArray<OOOutlineColumn*> *someColumns, F &&aVisitor)
+{
+	for (OOOutlineColumn *col in someColumns)
+	{
+		OOOutlineColumnType type = col.columnType;
+		if ((type != OOOutlineColumnTypeText) && (type != OOOutlineColumnTypeEnumeration))
+		{
+			continue;
+		}
+		if (NSString *text = [[aRow valueForColumn: col] plainText])
+		{
+			aVisitor(col, text);
+		}
+	}
+	if (NSString *note = [aRow.note string])
+	{
+		aVisitor(nil, note);
+	}
+}
+
+/**
+ * Returns the indexes of a row and its ancestors in their parents, starting
+ * from the top of the outline.  Comparing these compares rows in outline
+ * order.
+ */
+std::vector<NSUInteger> path_for_row(OOOutlineRow *aRow)
+{
+	std::vector<NSUInteger> path;
+	for (OOOutlineRow *r = aRow ; r.parent != nil ; r = r.parent)
+	{
+		path.push_back(r.indexInParent);
+	}
+	std::reverse(path.begin(), path.end());
+	return path;
+}
+}
+
+@interface OOOutlineSearchMatch ()
+/**
+ * Constructs a match.
+ */
+- (instancetype)initWithRow: (OOOutlineRow*)aRow
+                     column: (OOOutlineColumn*)aColumn
+                      range: (NSRange)aRange;
+@end
+
+@implementation OOOutlineSearchMatch
+@synthesize
+	column,
+	range,
+	row;
+
+- (instancetype)initWithRow: (OOOutlineRow*)aRow
+                     column: (OOOutlineColumn*)aColumn
+                      range: (NSRange)aRange
+{
+	OO_SUPER_INIT();
+	row = aRow;
+	column = aColumn;
+	range = aRange;
+	return self;
+}
+@end
+
+@implementation OOOutlineSearchIndex
+{
+	/**
+	 * The document whose rows are indexed.
+	 */
+	__weak OOOutlineDocument *document;
+	/**
+	 * The position of each row in the tables below, by row ID.  Positions
+	 * are reused after rows are removed.
+	 */
+	row_id_map<uint32_t> positions;
+	/**
+	 * The row at each position, or `nil` for unused positions.
+	 */
+	std::vector<OOOutlineRow*> rows;
+	/**
+	 * The trigrams of the row at each position, sorted, so that the row can
+	 * be removed from their postings.
+	 */
+	std::vector<std::vector<trigram>> rowTrigrams;
+	/**
+	 * Positions that are not in use.
+	 */
+	std::vector<uint32_t> freePositions;
+	/**
+	 * The positions of the rows that contain each trigram, sorted.
+	 */
+	std::unordered_map<trigram, std::vector<uint32_t>> postings;
+	/**
+	 * The string for which the results below were found, or `nil` if they
+	 * have been discarded because the outline changed.
+	 */
+	NSString *cachedString;
+	/**
+	 * The rows that contain `cachedString`, in outline order.
+	 */
+	NSArray<OOOutlineRow*> *cachedRows;
+	/**
+	 * The paths (see `path_for_row`) of the rows in `cachedRows`.
+	 */
+	std::vector<std::vector<NSUInteger>> cachedPaths;
+}
+- (instancetype)initWithDocument: (OOOutlineDocument*)aDocument
+{
+	OO_SUPER_INIT();
+	document = aDocument;
+	// The root is not shown, so it is not searched.
+	for (OOOutlineRow *r in aDocument.root.children)
+	{
+		[self rowWasAdded: r];
+	}
+	return self;
+}
+/**
+ * Returns the position of a row, or `UINT32_MAX` if it is not indexed.
+ */
+- (uint32_t)positionOfRow: (OOOutlineRow*)aRow
+{
+	uint32_t *p = positions.find(aRow.rowID);
+	return (p && (rows[*p] == aRow)) ? *p : UINT32_MAX;
+}
+/**
+ * Replaces the trigrams of the row at a position, updating only the postings
+ * of the trigrams that have been added or removed.
+ */
+- (void)setTrigrams: (std::vector<trigram>)someTrigrams
+         atPosition: (uint32_t)aPosition
+{
+	std::vector<trigram> &old = rowTrigrams[aPosition];
+	std::vector<trigram> changed;
+	std::set_difference(old.begin(), old.end(),
+	                    someTrigrams.begin(), someTrigrams.end(),
+	                    std::back_inserter(changed));
+	for (trigram t : changed)
+	{
+		auto &list = postings[t];
+		list.erase(std::lower_bound(list.begin(), list.end(), aPosition));
+		if (list.empty())
+		{
+			postings.erase(t);
+		}
+	}
+	changed.clear();
+	std::set_difference(someTrigrams.begin(), someTrigrams.end(),
+	                    old.begin(), old.end(),
+	                    std::back_inserter(changed));
+	for (trigram t : changed)
+	{
+		auto &list = postings[t];
+		list.insert(std::lower_bound(list.begin(), list.end(), aPosition), aPosition);
+	}
+	old = std::move(someTrigrams);
+	cachedString = nil;
+}
+/**
+ * Indexes the text of the row at a position.
+ */
+- (void)indexRowAtPosition: (uint32_t)aPosition
+{
+	OOOutlineDocument *doc = document;
+	std::vector<trigram> trigrams;
+	visit_text(rows[aPosition], doc.columns, [&](OOOutlineColumn *, NSString *text)
+		{
+			add_trigrams(text, trigrams);
+		});
+	make_unique(trigrams);
+	[self setTrigrams: std::move(trigrams) atPosition: aPosition];
+}
+- (void)rowWasAdded: (OOOutlineRow*)aRow
+{
+	std::function<void(OOOutlineRow*)> add = [&](OOOutlineRow *r)
+		{
+			// Reading deferred children below adds them before this visits
+			// them.
+			if ([self positionOfRow: r] != UINT32_MAX)
+			{
+				return;
+			}
+			uint32_t p;
+			if (freePositions.empty())
+			{
+				p = static_cast<uint32_t>(rows.size());
+				rows.push_back(nil);
+				rowTrigrams.emplace_back();
+			}
+			else
+			{
+				p = freePositions.back();
+				freePositions.pop_back();
+			}
+			positions.insert(r.rowID, p);
+			rows[p] = r;
+			[self indexRowAtPosition: p];
+			for (OOOutlineRow *child in r.children)
+			{
+				add(child);
+			}
+		};
+	add(aRow);
+	cachedString = nil;
+}
+- (void)rowWasRemoved: (OOOutlineRow*)aRow
+{
+	std::function<void(OOOutlineRow*)> remove = [&](OOOutlineRow *r)
+		{
+			uint32_t p = [self positionOfRow: r];
+			if (p == UINT32_MAX)
+			{
+				return;
+			}
+			[self setTrigrams: std::vector<trigram>() atPosition: p];
+			rows[p] = nil;
+			positions.erase(r.rowID);
+			freePositions.push_back(p);
+			if (r.hasChildren)
+			{
+				for (OOOutlineRow *child in r.children)
+				{
+					remove(child);
+				}
+			}
+		};
+	remove(aRow);
+	cachedString = nil;
+}
+- (void)rowDidChangeChildren: (OOOutlineRow*)aRow
+{
+	cachedString = nil;
+}
+- (void)rowDidChange: (OOOutlineRow*)aRow
+{
+	uint32_t p = [self positionOfRow: aRow];
+	if (p != UINT32_MAX)
+	{
+		[self indexRowAtPosition: p];
+	}
+}
+- (void)row: (OOOutlineRow*)aRow didChangeIDFrom: (OOOutlineRowID)anID
+{
+	uint32_t *p = positions.find(anID);
+	if (p && (rows[*p] == aRow))
+	{
+		uint32_t position = *p;
+		positions.erase(anID);
+		positions.insert(aRow.rowID, position);
+	}
+}
+/**
+ * Returns the positions of the rows that may contain the string: those that
+ * contain all of its trigrams, or every row if it has none.
+ */
+- (std::vector<uint32_t>)candidatesForString: (NSString*)aString
+{
+	std::vector<trigram> trigrams;
+	add_trigrams(aString, trigrams);
+	make_unique(trigrams);
+	std::vector<uint32_t> candidates;
+	if (trigrams.empty())
+	{
+		for (uint32_t p=0 ; p<rows.size() ; p++)
+		{
+			if (rows[p] != nil)
+			{
+				candidates.push_back(p);
+			}
+		}
+		return candidates;
+	}
+	std::vector<const std::vector<uint32_t>*> lists;
+	for (trigram t : trigrams)
+	{
+		auto list = postings.find(t);
+		if (list == postings.end())
+		{
+			return candidates;
+		}
+		lists.push_back(&list->second);
+	}
+	// Intersect the shortest lists first, so that the intermediate results
+	// are as small as possible.
+	std::sort(lists.begin(), lists.end(),
+	          [](auto *a, auto *b) { return a->size() < b->size(); });
+	candidates = *lists.front();
+	std::vector<uint32_t> next;
+	for (size_t i=1 ; (i<lists.size()) && !candidates.empty() ; i++)
+	{
+		next.clear();
+		std::set_intersection(candidates.begin(), candidates.end(),
+		                      lists[i]->begin(), lists[i]->end(),
+		                      std::back_inserter(next));
+		std::swap(candidates, next);
+	}
+	return candidates;
+}
+- (NSArray<OOOutlineRow*>*)rowsMatchingString: (NSString*)aString
+{
+	if ((cachedString != nil) && [cachedString isEqualToString: aString])
+	{
+		return cachedRows;
+	}
+	OOOutlineDocument *doc = document;
+	NSArray<OOOutlineColumn*> *columns = doc.columns;
+	std::vector<std::pair<std::vector<NSUInteger>, OOOutlineRow*>> found;
+	if ([aString length] > 0)
+	{
+		for (uint32_t p : [self candidatesForString: aString])
+		{
+			OOOutlineRow *r = rows[p];
+			bool isMatch = false;
+			visit_text(r, columns, [&](OOOutlineColumn *, NSString *text)
+				{
+					isMatch = isMatch ||
+						([text rangeOfString: aString
+						             options: NSCaseInsensitiveSearch].location != NSNotFound);
+				});
+			if (isMatch)
+			{
+				found.push_back({ path_for_row(r), r });
+			}
+		}
+	}
+	std::sort(found.begin(), found.end(),
+	          [](auto &a, auto &b) { return a.first < b.first; });
+	NSMutableArray<OOOutlineRow*> *result = [NSMutableArray arrayWithCapacity: found.size()];
+	cachedPaths.clear();
+	for (auto &[path, r] : found)
+	{
+		[result addObject: r];
+		cachedPaths.push_back(std::move(path));
+	}
+	cachedString = [aString copy];
+	cachedRows = result;
+	return result;
+}
+- (NSArray<OOOutlineSearchMatch*>*)matchesForString: (NSString*)aString
+{
+	OOOutlineDocument *doc = document;
+	NSArray<OOOutlineColumn*> *columns = doc.columns;
+	NSMutableArray<OOOutlineSearchMatch*> *matches = [NSMutableArray new];
+	for (OOOutlineRow *r in [self rowsMatchingString: aString])
+	{
+		visit_text(r, columns, [&](OOOutlineColumn *col, NSString *text)
+			{
+				NSRange search = NSMakeRange(0, [text length]);
+				for (;;)
+				{
+					NSRange found = [text rangeOfString: aString
+					                            options: NSCaseInsensitiveSearch
+					                              range: search];
+					if (found.location == NSNotFound)
+					{
+						break;
+					}
+					[matches addObject: [[OOOutlineSearchMatch alloc] initWithRow: r
+					                                                       column: col
+					                                                        range: found]];
+					search.location = NSMaxRange(found);
+					search.length = [text length] - search.location;
+				}
+			});
+	}
+	return matches;
+}
+- (OOOutlineRow*)rowMatchingString: (NSString*)aString
+                          afterRow: (OOOutlineRow*)aRow
+                         backwards: (BOOL)isBackwards
+{
+	NSArray<OOOutlineRow*> *found = [self rowsMatchingString: aString];
+	NSUInteger count = [found count];
+	if (count == 0)
+	{
+		return nil;
+	}
+	if (aRow == nil)
+	{
+		return isBackwards ? [found lastObject] : [found firstObject];
+	}
+	auto path = path_for_row(aRow);
+	if (isBackwards)
+	{
+		auto i = std::lower_bound(cachedPaths.begin(), cachedPaths.end(), path);
+		NSUInteger idx = static_cast<NSUInteger>(i - cachedPaths.begin());
+		return [found objectAtIndex: (idx == 0) ? count - 1 : idx - 1];
+	}
+	auto i = std::upper_bound(cachedPaths.begin(), cachedPaths.end(), path);
+	NSUInteger idx = static_cast<NSUInteger>(i - cachedPaths.begin());
+	return [found objectAtIndex: (idx == count) ? 0 : idx];
+}
+@end
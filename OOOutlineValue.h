@@ -28,6 +28,7 @@
 #import <Foundation/Foundation.h>
 
 @class OOOutlineColumn;
+@class OOXMLWriter;
 
 /**
  * Class cluster for values stored in outline cells (row / column
@@ -39,6 +40,17 @@
  */
 + (instancetype)outlineValueWithOO3XML: (NSXMLElement*)xml
                               inColumn: (OOOutlineColumn*)aCol;
+/**
+ * Construct a value from the parsed components of an OmniOutliner 3 XML value
+ * element, without requiring an XML tree.  `aType` is the name of the element
+ * (`text`, `number`, and so on), `aValue` is either the character data of the
+ * element or, for `text` elements, the parsed attributed string.  `anIdref` is
+ * the `idref` attribute, which is used only by enumerations.
+ */
++ (instancetype)outlineValueWithOO3Type: (NSString*)aType
+                                  value: (id)aValue
+                                  idref: (NSString*)anIdref
+                               inColumn: (OOOutlineColumn*)aCol;
 /**
  * Returns a placeholder value.
  */
@@ -47,11 +59,26 @@
  * Serialise as OmniOutliner 3 XML.
  */
 - (NSXMLElement*)oo3xmlValue;
+/**
+ * Write as OmniOutliner 3 XML.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter;
 /**
  * Return the value that this object contains.  The type of this value depends
  * on the type of the column.
  */
 - (id)value;
+/**
+ * Returns the ID of the enumeration member that this value refers to (see
+ * `-[OOOutlineColumn enumerationIDForLabel:]`), or `NSNotFound` if this is
+ * not an enumeration value.
+ */
+- (NSUInteger)enumerationID;
+/**
+ * Returns the text of this value without formatting attributes, as used for
+ * searching, or `nil` for empty values.
+ */
+- (NSString*)plainText;
 /**
  * Construct a new value with the specified object in a given column.  When
  * called on a placeholder value, this will construct a new value whose type
@@ -26,6 +26,7 @@
  */
 
 #import "OpenOutliner.h"
+#include <mutex>
 
 /**
  * Superclass for all concrete subclasses of `OOOutlineValue`.  This provides a
@@ -37,6 +38,14 @@
 @interface OOConcreteOutlineValue (SubclassMethods)
 - (instancetype)initWithOO3XML: (NSXMLElement*)xml
                       inColumn: (OOOutlineColumn*)aCol;
+/**
+ * Initialise the value from the parsed contents of an OmniOutliner 3 XML
+ * element.  The default implementation of `-initWithOO3XML:inColumn:` calls
+ * this with the string value and `idref` attribute of the element.
+ */
+- (instancetype)initWithOO3Value: (id)aValue
+                           idref: (NSString*)anIdref
+                        inColumn: (OOOutlineColumn*)aCol;
 @end
 
 
@@ -45,14 +54,22 @@
 @interface OOOutlineDateValue : OOConcreteOutlineValue @end
 @interface OOOutlineEnumValue : OOConcreteOutlineValue @end
 @interface OOOutlineNumberValue : OOConcreteOutlineValue @end
-@interface OOOutlineCheckBoxValue : OOConcreteOutlineValue @end
+@interface OOOutlineCheckBoxValue : OOConcreteOutlineValue
+/**
+ * Returns the shared value for the specified checkbox state.
+ */
++ (instancetype)checkBoxValueWithState: (NSInteger)aState;
+@end
 
 
-@implementation OOOutlineValue
-+ (OOOutlineValue*)outlineValueWithOO3XML: (NSXMLElement*)xml
-                                 inColumn: (OOOutlineColumn*)aCol
+namespace {
+/**
+ * Returns the concrete value class that corresponds to an OmniOutliner 3 XML
+ * value element name.  Throws an exception for unknown names.
+ */
+Class classForOO3Type(NSString *aType)
 {
-	object_map<NSString*, Class> subclasses =
+	static object_map<NSString*, Class> subclasses =
 		{
 			{ @"text", [OOOutlineTextValue class] },
 			{ @"enum", [OOOutlineEnumValue class] },
@@ -61,25 +78,70 @@
 			{ @"checkbox", [OOOutlineCheckBoxValue class] },
 			{ @"null", [OOOutlineEmptyValue class] }
 		};
-	if (subclasses.find(xml.name) == subclasses.end())
+	auto cls = subclasses.find(aType);
+	if (cls == subclasses.end())
 	{
 		[NSException raise: NSInternalInconsistencyException
-		            format: @"Unknown column type %@", xml.name];
+		            format: @"Unknown column type %@", aType];
 	}
+	return cls->second;
+}
+}
+
+@implementation OOOutlineValue
++ (OOOutlineValue*)outlineValueWithOO3XML: (NSXMLElement*)xml
+                                 inColumn: (OOOutlineColumn*)aCol
+{
 	// FIXME: Default column styles
-	return [[subclasses[xml.name] alloc] initWithOO3XML: xml inColumn: aCol];
+	return [[classForOO3Type(xml.name) alloc] initWithOO3XML: xml inColumn: aCol];
+}
++ (OOOutlineValue*)outlineValueWithOO3Type: (NSString*)aType
+                                     value: (id)aValue
+                                     idref: (NSString*)anIdref
+                                  inColumn: (OOOutlineColumn*)aCol
+{
+	return [[classForOO3Type(aType) alloc] initWithOO3Value: aValue
+	                                                  idref: anIdref
+	                                               inColumn: aCol];
 }
 + (instancetype)placeholder
 {
-	return [OOOutlineEmptyValue new];
+	// Values are immutable and empty values carry no state, so every empty
+	// cell shares a single instance.
+	static OOOutlineEmptyValue *placeholder = [OOOutlineEmptyValue new];
+	return placeholder;
 }
 - (id)value
 {
 	OO_ABSTRACT_METHOD();
 }
+- (NSUInteger)enumerationID
+{
+	return NSNotFound;
+}
+- (NSString*)plainText
+{
+	id value = [self value];
+	if (value == nil)
+	{
+		return nil;
+	}
+	if ([value isKindOfClass: [NSAttributedString class]])
+	{
+		return [value string];
+	}
+	return [self description];
+}
 - (NSXMLElement*)oo3xmlValue
 {
-	OO_ABSTRACT_METHOD();
+	return [OOXMLWriter elementByWriting: ^(OOXMLWriter *w) { [self writeOO3XML: w]; }];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+{
+	[NSException raise: NSInvalidArgumentException
+	            format: @"Abstract method [%@ %@]",
+	                    [self class],
+	                    NSStringFromSelector(_cmd)];
 }
 - (instancetype)initWithValue: (id)aValue inColumn: (OOOutlineColumn*)aCol
 {
@@ -112,10 +174,17 @@
 	OOOutlineColumn *column;
 }
 - (OOOutlineTextValue*)initWithOO3XML: (NSXMLElement*)xml inColumn: (OOOutlineColumn*)aCol
+{
+	return [self initWithOO3Value: [NSMutableAttributedString attributedStringWithOO3XML: xml
+	                                                                     withPartialStyle: aCol.style]
+	                        idref: nil
+	                     inColumn: aCol];
+}
+- (OOOutlineTextValue*)initWithOO3Value: (id)aValue idref: (NSString*)anIdref inColumn: (OOOutlineColumn*)aCol
 {
 	OO_SUPER_INIT();
-	value = [NSMutableAttributedString attributedStringWithOO3XML: xml
-	                                             withPartialStyle: aCol.style];
+	NSAssert([aValue isKindOfClass: [NSMutableAttributedString class]], @"Incorrect class");
+	value = aValue;
 	column = aCol;
 	return self;
 }
@@ -143,9 +212,9 @@
 {
 	return value;
 }
-- (NSXMLElement*)oo3xmlValue
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
 {
-	return [value oo3xmlValueWithPartialStyle: column.style];
+	[value writeOO3XML: aWriter withPartialStyle: column.style];
 }
 @end
 
@@ -153,10 +222,10 @@
 {
 	NSDate *value;
 }
-- (instancetype)initWithOO3XML: (NSXMLElement*)xml inColumn: (OOOutlineColumn*)aCol
+- (instancetype)initWithOO3Value: (id)aValue idref: (NSString*)anIdref inColumn: (OOOutlineColumn*)aCol
 {
 	OO_SUPER_INIT();
-	value = [NSDate dateWithString: [xml stringValue]];
+	value = [NSDate dateWithString: aValue];
 	return self;
 }
 - (instancetype)initWithValue: (id)aValue inColumn: (OOOutlineColumn*)aCol
@@ -178,15 +247,15 @@
 {
 	return value;
 }
-- (NSXMLElement*)oo3xmlValue
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
 {
 	// FIXME: The OmniOutliner 3 format's way of dealing with dates is horrible
 	// and assumes that we only ever have a single time zone.  You end up with
 	// multiple time zones in the files and any kind of sorting becomes
 	// nonsense.  This should be fixed soon, because the parsing is quite
 	// permissive.
-	return [NSXMLElement elementWithName: @"date"
-	                         stringValue: [value description]];
+	[aWriter addElement: @"date"
+	           withText: [value description]];
 }
 @end
 
@@ -194,10 +263,10 @@
 {
 	NSDecimalNumber *value;
 }
-- (instancetype)initWithOO3XML: (NSXMLElement*)xml inColumn: (OOOutlineColumn*)aCol;
+- (instancetype)initWithOO3Value: (id)aValue idref: (NSString*)anIdref inColumn: (OOOutlineColumn*)aCol
 {
 	OO_SUPER_INIT();
-	value = [NSDecimalNumber decimalNumberWithString: [xml stringValue]];
+	value = [NSDecimalNumber decimalNumberWithString: aValue];
 	return self;
 }
 - (instancetype)initWithValue: (id)aValue inColumn: (OOOutlineColumn*)aCol
@@ -219,10 +288,10 @@
 {
 	return value;
 }
-- (NSXMLElement*)oo3xmlValue
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
 {
-	return [NSXMLElement elementWithName: @"number"
-	                         stringValue: [value stringValue]];
+	[aWriter addElement: @"number"
+	           withText: [value stringValue]];
 }
 @end
 
@@ -230,26 +299,42 @@
 {
 	NSNumber *value;
 }
-- (instancetype)initWithOO3XML: (NSXMLElement*)xml inColumn: (OOOutlineColumn*)aCol;
+/**
+ * Initialises a new value with the specified state.  This is used only to
+ * create the shared instances.
+ */
+- (instancetype)initWithState: (NSInteger)aState
 {
 	OO_SUPER_INIT();
+	value = [NSNumber numberWithInteger: aState];
+	return self;
+}
++ (instancetype)checkBoxValueWithState: (NSInteger)aState
+{
+	NSAssert((aState >= NSMixedState) && (aState <= NSOnState), @"Invalid state!");
+	// There are only three possible values, so share them between all cells.
+	static OOOutlineCheckBoxValue *values[] =
+		{
+			[[OOOutlineCheckBoxValue alloc] initWithState: NSMixedState],
+			[[OOOutlineCheckBoxValue alloc] initWithState: NSOffState],
+			[[OOOutlineCheckBoxValue alloc] initWithState: NSOnState]
+		};
+	return values[aState - NSMixedState];
+}
+- (instancetype)initWithOO3Value: (id)aValue idref: (NSString*)anIdref inColumn: (OOOutlineColumn*)aCol
+{
 	static object_map<NSString*, NSInteger> states =
 		{
 			{ @"checked", NSOnState },
 			{ @"unchecked", NSOffState },
 			{ @"indeterminate", NSMixedState }
 		};
-	value = [NSNumber numberWithInteger: states.at([xml stringValue])];
-	return self;
+	return [OOOutlineCheckBoxValue checkBoxValueWithState: states.at(aValue)];
 }
 - (instancetype)initWithValue: (id)aValue inColumn: (OOOutlineColumn*)aCol
 {
-	OO_SUPER_INIT();
 	NSAssert([aValue isKindOfClass: [NSNumber class]], @"Incorrect class");
-	NSInteger v = [aValue integerValue];
-	NSAssert((v >= NSMixedState) && (v <= NSOnState), @"Invalid state!");
-	value = aValue;
-	return self;
+	return [OOOutlineCheckBoxValue checkBoxValueWithState: [aValue integerValue]];
 }
 - (NSString*)description
 {
@@ -259,7 +344,7 @@
 {
 	return value;
 }
-- (NSXMLElement*)oo3xmlValue
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
 {
 	static std::unordered_map<NSInteger, NSString*> states =
 	{
@@ -267,52 +352,112 @@
 		{ NSOffState, @"unchecked" },
 		{ NSMixedState, @"indeterminate" }
 	};
-	return [NSXMLElement elementWithName: @"checkbox"
-	                         stringValue: states.at([value integerValue])];
+	[aWriter addElement: @"checkbox"
+	           withText: states.at([value integerValue])];
 }
 @end
 
 
 
 
+namespace {
+/**
+ * Shared enumeration values for each column, indexed by member ID.  Values are
+ * immutable and refer to their label via the column, so all cells with the
+ * same value share one instance.
+ */
+NSMapTable<OOOutlineColumn*, NSMutableDictionary<NSNumber*, OOOutlineEnumValue*>*> *sharedEnumValues;
+/**
+ * Lock protecting `sharedEnumValues`.
+ */
+std::mutex sharedEnumValuesLock;
+}
+
 @implementation OOOutlineEnumValue
 {
-	NSAttributedString *text;
-	NSString *enumValName;
+	/**
+	 * The column that defines the enumeration.
+	 */
+	DEBUG_WEAK OOOutlineColumn *column;
+	/**
+	 * The ID of the enumeration member in the column.
+	 */
+	uint32_t enumID;
 }
-- (instancetype)initWithOO3XML: (NSXMLElement*)xml  inColumn: (OOOutlineColumn*)aCol
+/**
+ * Initialises a new value with the specified member ID.  This is used only to
+ * create the shared instances.
+ */
+- (instancetype)initWithID: (NSUInteger)anID inColumn: (OOOutlineColumn*)aCol
 {
 	OO_SUPER_INIT();
-	text = [[NSAttributedString alloc] initWithString: [xml stringValue]
-	                                       attributes: [aCol defaultStyle]];
-	enumValName = [[[xml attributeForName: @"idref"] stringValue] copy];
-	NSAssert([[text string] isEqualToString: [[aCol enumValues] objectForKey: enumValName]], @"Mismatched enum!");
+	column = aCol;
+	enumID = static_cast<uint32_t>(anID);
 	return self;
 }
-- (NSXMLElement*)oo3xmlValue
+/**
+ * Returns the shared value for the specified member of the column's
+ * enumeration.
+ */
++ (instancetype)enumValueWithID: (NSUInteger)anID inColumn: (OOOutlineColumn*)aCol
 {
-	NSXMLElement *e = [NSXMLElement elementWithName: @"enum"
-	                                    stringValue: [text string]];
-	[e setAttributesWithDictionary: @{ @"idref": enumValName }];
-	return e;
+	std::lock_guard<std::mutex> g(sharedEnumValuesLock);
+	if (!sharedEnumValues)
+	{
+		sharedEnumValues = [NSMapTable weakToStrongObjectsMapTable];
+	}
+	auto *values = [sharedEnumValues objectForKey: aCol];
+	if (!values)
+	{
+		values = [NSMutableDictionary new];
+		[sharedEnumValues setObject: values forKey: aCol];
+	}
+	OOOutlineEnumValue *value = [values objectForKey: @(anID)];
+	if (!value)
+	{
+		value = [[OOOutlineEnumValue alloc] initWithID: anID inColumn: aCol];
+		[values setObject: value forKey: @(anID)];
+	}
+	return value;
+}
+- (instancetype)initWithOO3Value: (id)aValue idref: (NSString*)anIdref inColumn: (OOOutlineColumn*)aCol
+{
+	NSUInteger anID = [aCol enumerationIDForIdentifier: anIdref];
+	if (anID == NSNotFound)
+	{
+		anID = [aCol addEnumerationMemberWithIdentifier: anIdref label: aValue];
+	}
+	NSAssert([[[aCol enumerationLabelForID: anID] string] isEqualToString: aValue], @"Mismatched enum!");
+	return [OOOutlineEnumValue enumValueWithID: anID inColumn: aCol];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+{
+	OOOutlineColumn *col = column;
+	[aWriter startElement: @"enum"];
+	[aWriter addAttribute: [col enumerationIdentifierForID: enumID] withName: @"idref"];
+	[aWriter addText: [[col enumerationLabelForID: enumID] string]];
+	[aWriter endElement];
 }
 - (NSString*)description
 {
-	return [text description];
+	OOOutlineColumn *col = column;
+	return [[col enumerationLabelForID: enumID] description];
 }
 - (id)value
 {
-	return text;
+	OOOutlineColumn *col = column;
+	return [col enumerationLabelForID: enumID];
+}
+- (NSUInteger)enumerationID
+{
+	return enumID;
 }
 - (instancetype)initWithValue: (id)aValue inColumn: (OOOutlineColumn*)aCol
 {
-	OO_SUPER_INIT();
 	NSString *str;
 	if ([aValue isKindOfClass: [NSString class]])
 	{
 		str = aValue;
-		aValue= [[NSAttributedString alloc] initWithString: aValue
-		                                        attributes: [aCol defaultStyle]];
 	}
 	else
 	{
@@ -321,34 +466,40 @@
 	}
 	if ([str length] == 0)
 	{
-		return (id)[[OOOutlineEmptyValue alloc] initWithValue: nil inColumn: aCol];
+		return (id)[OOOutlineValue placeholder];
 	}
-	auto *keys = [aCol.enumValues allKeysForObject: str];
-	if ([keys count] == 0)
+	NSUInteger anID = [aCol enumerationIDForLabel: str];
+	if (anID == NSNotFound)
 	{
-		NSAssert(NO, @"Not yet implemented!");
+		anID = [aCol addEnumerationMemberWithIdentifier: nil label: str];
 	}
-	enumValName = [keys objectAtIndex: 0];
-	text = [aValue copy];
-	return self;
+	return [OOOutlineEnumValue enumValueWithID: anID inColumn: aCol];
 }
 @end
 
 
 @implementation OOOutlineEmptyValue
-- (instancetype)initWithOO3XML: (NSXMLElement*)xml inColumn: (OOOutlineColumn*)aCol
+- (instancetype)initWithOO3Value: (id)aValue idref: (NSString*)anIdref inColumn: (OOOutlineColumn*)aCol
 {
-	return [super init];
+	return [OOOutlineValue placeholder];
 }
 - (id)value
 {
 	// FIXME: Get rid of this class and replace it with a default (empty) value for the specified column
 	return nil;
 }
-- (NSXMLElement*)oo3xmlValue
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
 {
-	return [NSXMLElement elementWithName: @"null"];
+	[aWriter startElement: @"null"];
+	[aWriter endElement];
 }
 @end
 
-@implementation OOConcreteOutlineValue @end
+@implementation OOConcreteOutlineValue
+- (instancetype)initWithOO3XML: (NSXMLElement*)xml inColumn: (OOOutlineColumn*)aCol
+{
+	return [self initWithOO3Value: [xml stringValue]
+	                        idref: [[xml attributeForName: @"idref"] stringValue]
+	                     inColumn: aCol];
+}
+@end
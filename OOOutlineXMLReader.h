@@ -0,0 +1,136 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "OOOutlineDocument.h"
+
+@class OOOutlineColumn;
+@class OOOutlineRow;
+@class OOPartialStyle;
+@class OOStyleRegistry;
+
+/**
+ * Streaming reader for the OmniOutliner 3 XML format.  This constructs the
+ * style registry, columns, and rows of a document directly from parser events,
+ * without building an XML tree for the document.  Small, bounded parts of the
+ * file (the style registry, column definitions, and `<style>` elements) are
+ * still collected into `NSXMLElement` fragments and passed to the existing
+ * constructors.
+ */
+@interface OOOutlineXMLReader : NSObject
+/**
+ * Construct a reader that will populate the specified document.
+ */
+- (instancetype)initWithDocument: (OOOutlineDocument*)aDocument;
+/**
+ * Flag indicating that the children of collapsed rows should not be
+ * constructed while reading.  Instead, the `<children>` element of each
+ * collapsed row is recorded as an XML fragment and the rows are constructed
+ * when the row's children are first accessed.
+ */
+@property (nonatomic) BOOL defersCollapsedChildren;
+/**
+ * Flag indicating that the top-level rows should be read concurrently.  The
+ * reader locates each child of the `<root>` element in the input and then
+ * parses them on a pool of threads, adding the rows to the document's root
+ * once they have all been read.  This is ignored for compressed input, which
+ * is parsed as it is inflated.
+ */
+@property (nonatomic) BOOL parsesRowsConcurrently;
+/**
+ * Parse OmniOutliner 3 XML (`contents.xml`) from the provided data.  If the
+ * data is gzip compressed then it is inflated on another thread while it is
+ * parsed.  Returns `NO` and sets the error if the XML is malformed.
+ * Exceptions raised while constructing the model are propagated to the
+ * caller.
+ */
+- (BOOL)readOO3XMLData: (NSData*)aData
+                 error: (NSError**)outError;
+/**
+ * Parse a `<children>` element that was deferred while reading and add the
+ * rows that it contains to the children of the specified row.  The rows have
+ * values for the first `aSlotCount` slots.  The document's columns and styles
+ * must already have been loaded.
+ */
+- (BOOL)readOO3XMLFragment: (NSData*)aData
+                 slotCount: (NSUInteger)aSlotCount
+                   intoRow: (OOOutlineRow*)aRow
+                     error: (NSError**)outError;
+@end
+
+/**
+ * Methods used by readers to populate a document.  These should not be called
+ * other than while loading.
+ */
+@interface OOOutlineDocument (Reading)
+/**
+ * Sets the style registry.  This must be called before any columns are
+ * constructed.
+ */
+- (void)setStyleRegistry: (OOStyleRegistry*)aRegistry;
+/**
+ * Sets the style used for column titles.
+ */
+- (void)setTitleStyle: (OOPartialStyle*)aStyle;
+/**
+ * Sets the columns and the note column.  This must be called before any rows
+ * are constructed.
+ */
+- (void)setColumns: (NSMutableArray<OOOutlineColumn*>*)aColumns
+        noteColumn: (OOOutlineColumn*)aNoteColumn;
+/**
+ * Sets the (virtual) root row.
+ */
+- (void)setRoot: (OOOutlineRow*)aRow;
+@end
+
+/**
+ * Methods used by readers to populate a row.  These should not be called
+ * other than while loading.
+ */
+@interface OOOutlineRow (Reading)
+/**
+ * Sets the `<children>` element of this row, written by a fragment writer, to
+ * be read when the children are first accessed.  The rows in the fragment
+ * have values for the first `aSlotCount` slots.  Until the children are read,
+ * the row writes the fragment in place of its children when it is saved.
+ */
+- (void)setDeferredChildren: (NSData*)aFragment
+                  slotCount: (NSUInteger)aSlotCount;
+/**
+ * Returns the `<children>` element that was set with
+ * `-setDeferredChildren:slotCount:`, or `nil` if the children have been read.
+ */
+- (NSData*)deferredChildren;
+/**
+ * Reads the children of this row and its descendants that were deferred and
+ * that cannot be copied to a file whose values are in the order of `aLayout`.
+ * Other deferred children are left unread.  This must be called on the main
+ * thread before writing a version of the row with this layout.
+ */
+- (void)readDeferredChildrenNotMatchingLayout: (NSArray<OOOutlineColumn*>*)aLayout;
+@end
@@ -0,0 +1,1150 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import "OpenOutliner.h"
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+/**
+ * The size of the chunks in which compressed files are inflated, and of the
+ * buffer between the inflating thread and the parser.
+ */
+const NSUInteger inflateChunkSize = 256 * 1024;
+/**
+ * Returns a stream that provides the contents of the gzip-compressed data.
+ * The data is inflated in chunks on a background thread, so decompression
+ * overlaps with parsing and the inflated data is never held in memory in its
+ * entirety.  Files with multiple gzip members are inflated as their
+ * concatenation.  If the data is corrupt then the stream ends early.  Closing
+ * the returned stream stops inflation.
+ */
+NSInputStream *inflatingStream(NSData *aData)
+{
+	NSInputStream *input;
+	NSOutputStream *output;
+	[NSStream getBoundStreamsWithBufferSize: inflateChunkSize
+	                            inputStream: &input
+	                           outputStream: &output];
+	[output open];
+	dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+		z_stream stream = {};
+		const uint8_t *in = static_cast<const uint8_t*>([aData bytes]);
+		NSUInteger remaining = [aData length];
+		if (inflateInit2(&stream, 47) == Z_OK)
+		{
+			std::vector<uint8_t> buffer(inflateChunkSize);
+			int status = Z_OK;
+			while (status == Z_OK)
+			{
+				if (stream.avail_in == 0)
+				{
+					// zlib lengths are 32 bits, so large files are provided
+					// in pieces.
+					uInt len = static_cast<uInt>(std::min<NSUInteger>(remaining, UINT_MAX));
+					stream.next_in = const_cast<Bytef*>(in);
+					stream.avail_in = len;
+					in += len;
+					remaining -= len;
+				}
+				stream.next_out = buffer.data();
+				stream.avail_out = static_cast<uInt>(buffer.size());
+				status = inflate(&stream, Z_NO_FLUSH);
+				if ((status != Z_OK) && (status != Z_STREAM_END))
+				{
+					break;
+				}
+				const uint8_t *out = buffer.data();
+				NSUInteger available = buffer.size() - stream.avail_out;
+				while (available > 0)
+				{
+					// This blocks until the parser has consumed enough of
+					// the previous chunk, and fails if the stream is closed.
+					NSInteger written = [output write: out maxLength: available];
+					if (written <= 0)
+					{
+						status = Z_STREAM_ERROR;
+						break;
+					}
+					out += written;
+					available -= static_cast<NSUInteger>(written);
+				}
+				// A gzip file may contain several members, each of which
+				// ends the deflate stream, so continue with the next.
+				if ((status == Z_STREAM_END) && ((stream.avail_in > 0) || (remaining > 0)))
+				{
+					status = inflateReset(&stream);
+				}
+			}
+			inflateEnd(&stream);
+		}
+		[output close];
+	});
+	return input;
+}
+/**
+ * Returns the names of the attributes of an element in the order in which
+ * the model writes them, so that deferred elements are copied with the same
+ * bytes as rows that are read and written again.  Attributes that the model
+ * does not write follow in alphabetical order.
+ */
+NSArray<NSString*> *attributeOrder(NSString *aName, NSDictionary<NSString*, NSString*> *attrs)
+{
+	static NSDictionary<NSString*, NSArray<NSString*>*> *orders = @{
+		@"item" : @[ @"id", @"state", @"expanded" ],
+		@"note" : @[ @"expanded" ],
+		@"enum" : @[ @"idref" ],
+		@"cell" : @[ @"href", @"name" ],
+		@"value" : @[ @"key" ],
+		@"color" : @[ @"space", @"w", @"c", @"m", @"y", @"k", @"r", @"g", @"b", @"a" ]
+	};
+	NSMutableArray<NSString*> *order = [NSMutableArray arrayWithCapacity: [attrs count]];
+	NSArray<NSString*> *known = [orders objectForKey: aName];
+	for (NSString *key in known)
+	{
+		if ([attrs objectForKey: key])
+		{
+			[order addObject: key];
+		}
+	}
+	if ([order count] < [attrs count])
+	{
+		NSMutableArray<NSString*> *others = [[attrs allKeys] mutableCopy];
+		[others removeObjectsInArray: known];
+		[order addObjectsFromArray: [others sortedArrayUsingSelector: @selector(compare:)]];
+	}
+	return order;
+}
+/**
+ * The locations of the parts of an OmniOutliner 3 document that can be parsed
+ * independently.
+ */
+struct document_layout
+{
+	/**
+	 * The range of the `<root>` element, including its start and end tags.
+	 */
+	NSRange root;
+	/**
+	 * The ranges of each of the child elements of `<root>`.
+	 */
+	std::vector<NSRange> children;
+};
+/**
+ * Scans an uncompressed OmniOutliner 3 document for the `<root>` element and
+ * its children, without parsing anything else.  Returns `false` if the
+ * document does not have the expected structure.
+ */
+bool scanDocumentLayout(NSData *aData, document_layout &layout)
+{
+	const char *bytes = static_cast<const char*>([aData bytes]);
+	const char *end = bytes + [aData length];
+	const char *p = bytes;
+	NSUInteger depth = 0;
+	bool inRoot = false;
+	NSUInteger childStart = NSNotFound;
+	auto startsWith = [&](const char *aPrefix)
+		{
+			size_t len = strlen(aPrefix);
+			return (static_cast<size_t>(end - p) >= len) && (memcmp(p, aPrefix, len) == 0);
+		};
+	auto skipPast = [&](const char *aTerminator)
+		{
+			size_t len = strlen(aTerminator);
+			p = static_cast<const char*>(memmem(p, static_cast<size_t>(end - p), aTerminator, len));
+			if (p == nullptr)
+			{
+				return false;
+			}
+			p += len;
+			return true;
+		};
+	// Character data cannot contain a `<`, so every `<` starts markup.
+	while (const char *lt = static_cast<const char*>(memchr(p, '<', static_cast<size_t>(end - p))))
+	{
+		NSUInteger offset = static_cast<NSUInteger>(lt - bytes);
+		p = lt + 1;
+		if (startsWith("?"))
+		{
+			if (!skipPast("?>")) { return false; }
+			continue;
+		}
+		if (startsWith("!--"))
+		{
+			if (!skipPast("-->")) { return false; }
+			continue;
+		}
+		if (startsWith("![CDATA["))
+		{
+			if (!skipPast("]]>")) { return false; }
+			continue;
+		}
+		if (startsWith("!"))
+		{
+			// Document type declaration, which may contain an internal subset.
+			int brackets = 0;
+			for ( ; p < end ; p++)
+			{
+				if (*p == '[')
+				{
+					brackets++;
+				}
+				else if (*p == ']')
+				{
+					brackets--;
+				}
+				else if ((*p == '>') && (brackets == 0))
+				{
+					break;
+				}
+			}
+			if (p++ == end) { return false; }
+			continue;
+		}
+		if (startsWith("/"))
+		{
+			if (!skipPast(">") || (depth == 0)) { return false; }
+			depth--;
+			NSUInteger tagEnd = static_cast<NSUInteger>(p - bytes);
+			if (inRoot && (depth == 2) && (childStart != NSNotFound))
+			{
+				layout.children.push_back(NSMakeRange(childStart, tagEnd - childStart));
+				childStart = NSNotFound;
+			}
+			else if (inRoot && (depth == 1))
+			{
+				layout.root.length = tagEnd - layout.root.location;
+				return true;
+			}
+			continue;
+		}
+		const char *name = p;
+		while ((p < end) && !isspace(*p) && (*p != '>') && (*p != '/'))
+		{
+			p++;
+		}
+		size_t nameLength = static_cast<size_t>(p - name);
+		// Attribute values may contain `>`, so skip quoted strings.
+		char quote = 0;
+		for ( ; p < end ; p++)
+		{
+			if (quote)
+			{
+				if (*p == quote)
+				{
+					quote = 0;
+				}
+			}
+			else if ((*p == '"') || (*p == '\''))
+			{
+				quote = *p;
+			}
+			else if (*p == '>')
+			{
+				break;
+			}
+		}
+		if (p == end) { return false; }
+		bool isEmpty = (p[-1] == '/');
+		p++;
+		NSUInteger tagEnd = static_cast<NSUInteger>(p - bytes);
+		if (!inRoot && (depth == 1) && (nameLength == 4) && (memcmp(name, "root", 4) == 0))
+		{
+			inRoot = true;
+			layout.root.location = offset;
+			if (isEmpty)
+			{
+				layout.root.length = tagEnd - offset;
+				return true;
+			}
+		}
+		else if (inRoot && (depth == 2))
+		{
+			if (isEmpty)
+			{
+				layout.children.push_back(NSMakeRange(offset, tagEnd - offset));
+			}
+			else
+			{
+				childStart = offset;
+			}
+		}
+		if (!isEmpty)
+		{
+			depth++;
+		}
+	}
+	return false;
+}
+/**
+ * The kinds of element that the reader can be inside.  The reader maintains a
+ * stack of these that mirrors the parser's element stack.
+ */
+enum class element
+{
+	/**
+	 * Outside of any element.
+	 */
+	Document,
+	/**
+	 * The top-level `<outline>` element.
+	 */
+	Outline,
+	/**
+	 * The `<columns>` element.
+	 */
+	Columns,
+	/**
+	 * The `<root>` element, containing the top-level rows.
+	 */
+	Root,
+	/**
+	 * An `<item>` element, corresponding to a row.
+	 */
+	Item,
+	/**
+	 * The `<values>` element in a row.
+	 */
+	Values,
+	/**
+	 * A non-text value element (`<number>`, `<date>`, and so on) in a row.
+	 */
+	Value,
+	/**
+	 * A `<note>` element in a row.
+	 */
+	Note,
+	/**
+	 * The `<children>` element in a row.
+	 */
+	Children,
+	/**
+	 * A `<text>` element in a value or a note.
+	 */
+	Text,
+	/**
+	 * A `<p>` element in a text element.
+	 */
+	Paragraph,
+	/**
+	 * A `<run>` element in a paragraph.
+	 */
+	Run,
+	/**
+	 * A `<lit>` element in a run.
+	 */
+	Lit,
+	/**
+	 * An element that is being collected into an XML fragment.
+	 */
+	Fragment,
+	/**
+	 * An element in the children of a collapsed row, which is being recorded
+	 * to be read later.
+	 */
+	Deferred,
+	/**
+	 * An element (and all of its children) that is not used.
+	 */
+	Ignored
+};
+}
+
+@interface OOOutlineXMLReader () <NSXMLParserDelegate>
+@end
+
+@implementation OOOutlineXMLReader
+{
+	/**
+	 * The document that is being populated.
+	 */
+	OOOutlineDocument *document;
+	/**
+	 * The stack of elements that we are currently inside.
+	 */
+	std::vector<element> stack;
+	/**
+	 * The stack of rows that we are currently inside.  The bottom of the stack
+	 * is the document's root row.
+	 */
+	std::vector<OOOutlineRow*> rows;
+	/**
+	 * The columns in the document, indexed by slot.  Values in the file are
+	 * in this order.  These are collected while parsing the `<columns>`
+	 * element and passed to the document at the end.
+	 */
+	NSMutableArray<OOOutlineColumn*> *columns;
+	/**
+	 * The note column.
+	 */
+	OOOutlineColumn *noteColumn;
+	/**
+	 * The index of the next value in the current row's `<values>` element.
+	 */
+	NSUInteger valueIndex;
+	/**
+	 * The element name for the value currently being parsed.
+	 */
+	NSString *valueType;
+	/**
+	 * The `idref` attribute for the value currently being parsed.
+	 */
+	NSString *valueIdref;
+	/**
+	 * Character data collected for the current value, `<lit>`, or fragment
+	 * element.
+	 */
+	NSMutableString *characters;
+	/**
+	 * The rich text value currently being constructed.
+	 */
+	NSMutableAttributedString *text;
+	/**
+	 * The partial style from which styles in the current rich text value
+	 * inherit.
+	 */
+	OOPartialStyle *textStyle;
+	/**
+	 * The attributes for the next run of text in the current rich text value.
+	 */
+	NSDictionary *textAttributes;
+	/**
+	 * Flag indicating that the next paragraph must be separated from the
+	 * previous one.
+	 */
+	BOOL separateParagraphs;
+	/**
+	 * The name of the link in the current `<lit>` element, if any.
+	 */
+	NSString *linkName;
+	/**
+	 * The target of the link in the current `<lit>` element, if any.
+	 */
+	NSString *linkHref;
+	/**
+	 * The stack of elements in the fragment that is currently being collected.
+	 */
+	NSMutableArray<NSXMLElement*> *fragment;
+	/**
+	 * The function to invoke with the fragment once it is complete.
+	 */
+	std::function<void(NSXMLElement*)> fragmentHandler;
+	/**
+	 * The writer used to record the children of a collapsed row.
+	 */
+	OOXMLWriter *deferred;
+	/**
+	 * Flag indicating that the element currently being recorded does not yet
+	 * have any child elements.
+	 */
+	BOOL deferredElementIsEmpty;
+	/**
+	 * The row for the `<item>` element when reading a single child of the
+	 * `<root>` element.
+	 */
+	OOOutlineRow *topLevelRow;
+	/**
+	 * Any exception raised during parsing.  This is rethrown once the parser
+	 * has returned, rather than being propagated through the parser.
+	 */
+	NSException *exception;
+}
+@synthesize
+	defersCollapsedChildren,
+	parsesRowsConcurrently;
+- (instancetype)initWithDocument: (OOOutlineDocument*)aDocument
+{
+	OO_SUPER_INIT();
+	document = aDocument;
+	return self;
+}
+/**
+ * Make sure that the document has a style registry.  Documents without a
+ * registry use the default.
+ */
+- (void)ensureStyleRegistry
+{
+	if (!document.styleRegistry)
+	{
+		[document setStyleRegistry: [OOStyleRegistry new]];
+	}
+}
+/**
+ * Start collecting an XML fragment, rooted in the element with the specified
+ * name and attributes.  The handler is invoked once the element has ended.
+ */
+- (void)startFragment: (NSString*)aName
+           attributes: (NSDictionary*)attrs
+              handler: (std::function<void(NSXMLElement*)>)aHandler
+{
+	fragment = [NSMutableArray arrayWithObject: [NSXMLElement elementWithName: aName
+	                                                     attributesDictionary: attrs]];
+	fragmentHandler = std::move(aHandler);
+	characters = [NSMutableString new];
+	stack.push_back(element::Fragment);
+}
+/**
+ * Add any pending character data to the current fragment element.
+ * Whitespace-only text is discarded, as it would be by `NSXMLDocument`.
+ */
+- (void)flushFragmentText
+{
+	static NSCharacterSet *nonWhitespace = [[NSCharacterSet whitespaceAndNewlineCharacterSet] invertedSet];
+	if ([characters rangeOfCharacterFromSet: nonWhitespace].location != NSNotFound)
+	{
+		[[fragment lastObject] addChild: [NSXMLNode textWithStringValue: [characters copy]]];
+	}
+	[characters setString: @""];
+}
+/**
+ * Record any pending character data in the element that is being deferred.
+ * Whitespace is only significant in elements that contain only text.
+ */
+- (void)flushDeferredText
+{
+	static NSCharacterSet *nonWhitespace = [[NSCharacterSet whitespaceAndNewlineCharacterSet] invertedSet];
+	if (deferredElementIsEmpty ||
+	    ([characters rangeOfCharacterFromSet: nonWhitespace].location != NSNotFound))
+	{
+		if ([characters length] > 0)
+		{
+			[deferred addText: characters];
+		}
+	}
+	[characters setString: @""];
+}
+/**
+ * Record the start of an element that is being deferred.  The parser does not
+ * report the order in which attributes appeared, so they are recorded in the
+ * order in which the model writes them.
+ */
+- (void)startDeferredElement: (NSString*)aName
+                  attributes: (NSDictionary<NSString*, NSString*>*)attrs
+{
+	if (deferred == nil)
+	{
+		deferred = [OOXMLWriter fragmentWriter];
+		characters = [NSMutableString new];
+	}
+	else
+	{
+		deferredElementIsEmpty = NO;
+		[self flushDeferredText];
+	}
+	[deferred startElement: aName];
+	for (NSString *key in attributeOrder(aName, attrs))
+	{
+		[deferred addAttribute: [attrs objectForKey: key] withName: key];
+	}
+	deferredElementIsEmpty = YES;
+	stack.push_back(element::Deferred);
+}
+/**
+ * Start a new rich text value, inheriting from the specified style.
+ */
+- (void)startText: (OOPartialStyle*)aStyle
+{
+	text = [NSMutableAttributedString new];
+	textStyle = aStyle;
+	textAttributes = nil;
+	separateParagraphs = NO;
+	stack.push_back(element::Text);
+}
+/**
+ * Start a new row and add it to the current parent.
+ */
+- (void)startItem: (NSDictionary<NSString*, NSString*>*)attrs
+{
+	auto *row = [[OOOutlineRow alloc] initWithIdentifier: [attrs objectForKey: @"id"]
+	                                          inDocument: document];
+	row.isExpanded = [[attrs objectForKey: @"expanded"] boolValue];
+	if (NSString *checked = [attrs objectForKey: @"state"])
+	{
+		row.checkedState = [OOOutlineRow checkedStateForOO3Name: checked];
+	}
+	if (rows.empty())
+	{
+		topLevelRow = row;
+	}
+	else
+	{
+		[rows.back().children addObject: row];
+	}
+	rows.push_back(row);
+	stack.push_back(element::Item);
+}
+- (void)startElement: (NSString*)aName
+          attributes: (NSDictionary<NSString*, NSString*>*)attrs
+{
+	element parent = stack.empty() ? element::Document : stack.back();
+	auto is = [&](NSString *aString)
+		{
+			return [aName isEqualToString: aString];
+		};
+	switch (parent)
+	{
+		case element::Document:
+			if (is(@"outline"))
+			{
+				stack.push_back(element::Outline);
+				return;
+			}
+			break;
+		case element::Outline:
+			if (is(@"style-attribute-registry"))
+			{
+				[self startFragment: aName
+				         attributes: attrs
+				            handler: [=](NSXMLElement *e)
+					{
+						[document setStyleRegistry: [[OOStyleRegistry alloc] initWithOO3XML: e]];
+					}];
+				return;
+			}
+			if (is(@"editor"))
+			{
+				NSRange r = NSRangeFromString([attrs objectForKey: @"content-size"]);
+				document.windowWidth = r.location;
+				document.windowHeight = r.length;
+				break;
+			}
+			if (is(@"columns"))
+			{
+				[self ensureStyleRegistry];
+				columns = [NSMutableArray new];
+				stack.push_back(element::Columns);
+				return;
+			}
+			if (is(@"root"))
+			{
+				[self ensureStyleRegistry];
+				if (!columns)
+				{
+					columns = [NSMutableArray new];
+					[document setColumns: columns noteColumn: nil];
+				}
+				// FIXME: Restore selected row / column
+				auto *root = [[OOOutlineRow alloc] initInDocument: document];
+				[document setRoot: root];
+				rows.push_back(root);
+				stack.push_back(element::Root);
+				return;
+			}
+			break;
+		case element::Columns:
+			if (is(@"column"))
+			{
+				[self startFragment: aName
+				         attributes: attrs
+				            handler: [=](NSXMLElement *e)
+					{
+						// FIXME: Handle default styles.
+						auto *col = [[OOOutlineColumn alloc] initWithOO3XML: e
+						                                         inDocument: document];
+						if ([col isNoteColumn])
+						{
+							noteColumn = col;
+						}
+						else
+						{
+							[columns addObject: col];
+						}
+					}];
+				return;
+			}
+			break;
+		case element::Root:
+			if (is(@"style"))
+			{
+				[self startFragment: aName
+				         attributes: attrs
+				            handler: [=](NSXMLElement *e)
+					{
+						[document setTitleStyle: [document.styleRegistry partialStyleForOO3XML: e
+						                                                           inheritsFrom: nil]];
+					}];
+				return;
+			}
+			[[fallthrough]];
+		case element::Children:
+			if (is(@"item"))
+			{
+				[self startItem: attrs];
+				return;
+			}
+			break;
+		case element::Item:
+			if (is(@"values"))
+			{
+				valueIndex = 0;
+				stack.push_back(element::Values);
+				return;
+			}
+			if (is(@"note"))
+			{
+				rows.back().isNoteExpanded = [[attrs objectForKey: @"expanded"] boolValue];
+				stack.push_back(element::Note);
+				return;
+			}
+			if (is(@"children"))
+			{
+				if (defersCollapsedChildren && !rows.back().isExpanded)
+				{
+					[self startDeferredElement: aName attributes: attrs];
+					return;
+				}
+				stack.push_back(element::Children);
+				return;
+			}
+			break;
+		case element::Values:
+			// Ignore values for columns that the file does not declare.
+			if (valueIndex >= [columns count])
+			{
+				break;
+			}
+			if (is(@"text"))
+			{
+				[self startText: [[columns objectAtIndex: valueIndex] style]];
+				return;
+			}
+			valueType = aName;
+			valueIdref = [attrs objectForKey: @"idref"];
+			characters = [NSMutableString new];
+			stack.push_back(element::Value);
+			return;
+		case element::Note:
+			if (is(@"text"))
+			{
+				[self startText: [noteColumn style]];
+				return;
+			}
+			break;
+		case element::Text:
+			if (is(@"p"))
+			{
+				if (separateParagraphs)
+				{
+					[[text mutableString] appendString: @"\n"];
+				}
+				separateParagraphs = YES;
+				stack.push_back(element::Paragraph);
+				return;
+			}
+			break;
+		case element::Paragraph:
+			if (is(@"run"))
+			{
+				stack.push_back(element::Run);
+				return;
+			}
+			break;
+		case element::Run:
+			if (is(@"style"))
+			{
+				[self startFragment: aName
+				         attributes: attrs
+				            handler: [=](NSXMLElement *e)
+					{
+						auto *ps = [textStyle.registry partialStyleForOO3XML: e
+						                                        inheritsFrom: textStyle];
+						textAttributes = [ps.registry attributesForStyle: ps];
+					}];
+				return;
+			}
+			if (is(@"lit"))
+			{
+				characters = [NSMutableString new];
+				linkName = nil;
+				linkHref = nil;
+				stack.push_back(element::Lit);
+				return;
+			}
+			break;
+		case element::Lit:
+			if (is(@"cell"))
+			{
+				linkName = [attrs objectForKey: @"name"];
+				linkHref = [attrs objectForKey: @"href"];
+			}
+			break;
+		case element::Fragment:
+		{
+			[self flushFragmentText];
+			auto *e = [NSXMLElement elementWithName: aName
+			                   attributesDictionary: attrs];
+			[[fragment lastObject] addChild: e];
+			[fragment addObject: e];
+			stack.push_back(element::Fragment);
+			return;
+		}
+		case element::Deferred:
+			[self startDeferredElement: aName attributes: attrs];
+			return;
+		case element::Value:
+		case element::Ignored:
+			break;
+	}
+	stack.push_back(element::Ignored);
+}
+- (void)endElement
+{
+	element e = stack.back();
+	stack.pop_back();
+	switch (e)
+	{
+		case element::Fragment:
+		{
+			[self flushFragmentText];
+			NSXMLElement *finished = [fragment lastObject];
+			[fragment removeLastObject];
+			if ([fragment count] == 0)
+			{
+				auto handler = std::move(fragmentHandler);
+				fragment = nil;
+				characters = nil;
+				handler(finished);
+			}
+			break;
+		}
+		case element::Deferred:
+		{
+			BOOL wasEmpty = deferredElementIsEmpty;
+			[self flushDeferredText];
+			[deferred endElement];
+			deferredElementIsEmpty = NO;
+			if (stack.back() != element::Deferred)
+			{
+				// Rows with an empty `<children>` element have no children.
+				if (!wasEmpty)
+				{
+					[rows.back() setDeferredChildren: [deferred data]
+					                       slotCount: [columns count]];
+				}
+				deferred = nil;
+				characters = nil;
+			}
+			break;
+		}
+		case element::Columns:
+			[document setColumns: columns noteColumn: noteColumn];
+			break;
+		case element::Item:
+			rows.pop_back();
+			break;
+		case element::Value:
+			[rows.back() setValue: [OOOutlineValue outlineValueWithOO3Type: valueType
+			                                                         value: characters
+			                                                         idref: valueIdref
+			                                                      inColumn: [columns objectAtIndex: valueIndex]]
+			               inSlot: valueIndex];
+			valueIndex++;
+			characters = nil;
+			break;
+		case element::Text:
+			if (stack.back() == element::Values)
+			{
+				[rows.back() setValue: [OOOutlineValue outlineValueWithOO3Type: @"text"
+				                                                         value: text
+				                                                         idref: nil
+				                                                      inColumn: [columns objectAtIndex: valueIndex]]
+				               inSlot: valueIndex];
+				valueIndex++;
+			}
+			else
+			{
+				rows.back().note = text;
+			}
+			text = nil;
+			break;
+		case element::Lit:
+		{
+			NSDictionary *attrs = textAttributes;
+			NSString *str = characters;
+			if (linkName)
+			{
+				str = linkName;
+				NSMutableDictionary *mutableAttrs = [attrs mutableCopy];
+				if (!mutableAttrs)
+				{
+					mutableAttrs = [NSMutableDictionary new];
+					if (textStyle)
+					{
+						[mutableAttrs setObject: textStyle
+						                 forKey: OOPartialStyleKey];
+					}
+				}
+				[mutableAttrs setObject: [NSURL URLWithString: linkHref]
+				                 forKey: NSLinkAttributeName];
+				attrs = mutableAttrs;
+			}
+			[text appendAttributedString: [[NSAttributedString alloc] initWithString: str
+			                                                              attributes: attrs]];
+			characters = nil;
+			break;
+		}
+		default:
+			break;
+	}
+}
+- (void)addCharacters: (NSString*)aString
+{
+	switch (stack.empty() ? element::Document : stack.back())
+	{
+		case element::Value:
+		case element::Lit:
+		case element::Fragment:
+		case element::Deferred:
+			[characters appendString: aString];
+			break;
+		default:
+			break;
+	}
+}
+- (void)parser: (NSXMLParser*)parser
+didStartElement: (NSString*)elementName
+  namespaceURI: (NSString*)namespaceURI
+ qualifiedName: (NSString*)qName
+    attributes: (NSDictionary<NSString*, NSString*>*)attributeDict
+{
+	@try
+	{
+		[self startElement: elementName attributes: attributeDict];
+	}
+	@catch (NSException *e)
+	{
+		exception = e;
+		[parser abortParsing];
+	}
+}
+- (void)parser: (NSXMLParser*)parser
+ didEndElement: (NSString*)elementName
+  namespaceURI: (NSString*)namespaceURI
+ qualifiedName: (NSString*)qName
+{
+	@try
+	{
+		[self endElement];
+	}
+	@catch (NSException *e)
+	{
+		exception = e;
+		[parser abortParsing];
+	}
+}
+- (void)parser: (NSXMLParser*)parser foundCharacters: (NSString*)aString
+{
+	[self addCharacters: aString];
+}
+- (void)parser: (NSXMLParser*)parser foundCDATA: (NSData*)aBlock
+{
+	[self addCharacters: [[NSString alloc] initWithData: aBlock
+	                                           encoding: NSUTF8StringEncoding]];
+}
+/**
+ * Parse the data, starting in the current state.
+ */
+- (BOOL)parse: (NSData*)aData
+        error: (NSError**)outError
+{
+	NSInputStream *stream = nil;
+	NSXMLParser *parser;
+	if ([aData isGzippedData])
+	{
+		stream = inflatingStream(aData);
+		parser = [[NSXMLParser alloc] initWithStream: stream];
+	}
+	else
+	{
+		parser = [[NSXMLParser alloc] initWithData: aData];
+	}
+	parser.delegate = self;
+	parser.shouldProcessNamespaces = NO;
+	parser.shouldResolveExternalEntities = NO;
+	BOOL success = [parser parse];
+	// If parsing stopped early then this stops the inflating thread.
+	[stream close];
+	if (exception)
+	{
+		@throw exception;
+	}
+	if (!success)
+	{
+		if (outError)
+		{
+			*outError = [parser parserError];
+		}
+		return NO;
+	}
+	return YES;
+}
+/**
+ * Fill in anything that was missing from the file.
+ */
+- (void)finishReading
+{
+	[self ensureStyleRegistry];
+	if (!columns)
+	{
+		[document setColumns: [NSMutableArray new] noteColumn: nil];
+	}
+	if (!document.root)
+	{
+		[document setRoot: [[OOOutlineRow alloc] initInDocument: document]];
+	}
+}
+/**
+ * Read a document by parsing everything other than the contents of the
+ * `<root>` element and then parsing each child of `<root>` concurrently.
+ */
+- (BOOL)readOO3XMLData: (NSData*)aData
+            withLayout: (const document_layout&)layout
+                 error: (NSError**)outError
+{
+	const char *bytes = static_cast<const char*>([aData bytes]);
+	NSUInteger rootEnd = NSMaxRange(layout.root);
+	auto *header = [NSMutableData dataWithBytes: bytes length: layout.root.location];
+	[header appendBytes: bytes + rootEnd length: [aData length] - rootEnd];
+	if (![self parse: header error: outError])
+	{
+		return NO;
+	}
+	[self finishReading];
+	// The rows are not attached to the outline until they have all been read,
+	// so constructing them does not touch the text export widths or summaries
+	// of the rest of the document.
+	const std::vector<NSRange> *children = &layout.children;
+	std::vector<OOOutlineRow*> results(children->size());
+	OOOutlineRow *__strong *resultsPtr = results.data();
+	std::mutex failureLock;
+	std::mutex *failureLockPtr = &failureLock;
+	__block NSError *error;
+	__block NSException *exception;
+	OOOutlineDocument *doc = document;
+	BOOL defers = defersCollapsedChildren;
+	dispatch_apply(children->size(), dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t i) {
+		@autoreleasepool
+		{
+			NSRange r = (*children)[i];
+			auto *d = [NSData dataWithBytesNoCopy: const_cast<char*>(bytes + r.location)
+			                               length: r.length
+			                         freeWhenDone: NO];
+			auto *reader = [[OOOutlineXMLReader alloc] initWithDocument: doc];
+			reader.defersCollapsedChildren = defers;
+			NSError *e;
+			@try
+			{
+				if ([reader readOO3XMLRootChild: d error: &e])
+				{
+					resultsPtr[i] = reader->topLevelRow;
+					return;
+				}
+			}
+			@catch (NSException *ex)
+			{
+				std::lock_guard<std::mutex> g(*failureLockPtr);
+				exception = exception ?: ex;
+				return;
+			}
+			std::lock_guard<std::mutex> g(*failureLockPtr);
+			error = error ?: e;
+		}
+	});
+	if (exception)
+	{
+		@throw exception;
+	}
+	if (error)
+	{
+		if (outError)
+		{
+			*outError = error;
+		}
+		return NO;
+	}
+	auto *rows = [NSMutableArray arrayWithCapacity: results.size()];
+	for (OOOutlineRow *row : results)
+	{
+		if (row)
+		{
+			[rows addObject: row];
+		}
+	}
+	NSMutableArray *rootChildren = document.root.children;
+	[rootChildren insertObjects: rows
+	                  atIndexes: [NSIndexSet indexSetWithIndexesInRange: NSMakeRange([rootChildren count], [rows count])]];
+	return YES;
+}
+- (BOOL)readOO3XMLData: (NSData*)aData
+                 error: (NSError**)outError
+{
+	if (parsesRowsConcurrently && ![aData isGzippedData])
+	{
+		document_layout layout;
+		if (scanDocumentLayout(aData, layout))
+		{
+			return [self readOO3XMLData: aData
+			                 withLayout: layout
+			                      error: outError];
+		}
+	}
+	if (![self parse: aData error: outError])
+	{
+		return NO;
+	}
+	[self finishReading];
+	return YES;
+}
+/**
+ * Parse a single child of the `<root>` element.  If the child is an `<item>`
+ * then the row is stored in `topLevelRow`, and is not added to the outline.
+ */
+- (BOOL)readOO3XMLRootChild: (NSData*)aData
+                      error: (NSError**)outError
+{
+	columns = [document.columnsBySlot mutableCopy];
+	noteColumn = document.noteColumn;
+	stack.push_back(element::Root);
+	return [self parse: aData error: outError];
+}
+- (BOOL)readOO3XMLFragment: (NSData*)aData
+                 slotCount: (NSUInteger)aSlotCount
+                   intoRow: (OOOutlineRow*)aRow
+                     error: (NSError**)outError
+{
+	// Columns added since the fragment was written have no values in it.
+	NSArray<OOOutlineColumn*> *bySlot = document.columnsBySlot;
+	columns = [[bySlot subarrayWithRange: NSMakeRange(0, std::min(aSlotCount, [bySlot count]))] mutableCopy];
+	noteColumn = document.noteColumn;
+	rows.push_back(aRow);
+	stack.push_back(element::Item);
+	return [self parse: aData error: outError];
+}
+@end
@@ -27,6 +27,8 @@
 
 #import <Foundation/Foundation.h>
 
+@class OOXMLWriter;
+
 /**
  * Key used for storing a reference to partial styles in the attributes
  * dictionary of an `NSAttributedString`.
@@ -46,13 +48,19 @@ extern NSString *OOPartialStyleKey;
  */
 @interface OOPartialStyle : NSObject
 /**
- * The style registry defining this style.
+ * The style registry defining this style.  This is not retained, because the
+ * registry retains all of the styles that it defines.
  */
-@property (nonatomic) OOStyleRegistry *registry;
+@property (nonatomic, weak) OOStyleRegistry *registry;
 /**
  * Serialise this value as OmniOutliner 3 XML.
  */
 - (NSXMLElement*)oo3xmlValue;
+/**
+ * Write this value as OmniOutliner 3 XML.  Writes nothing if this style does
+ * not override any attributes.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter;
 /**
  * Recompute the style from attributes.  This will ignore any attributes that
  * are the same as the style from which this is derrived.
@@ -62,7 +70,8 @@ extern NSString *OOPartialStyleKey;
 
 /**
  * The registry for partial styles.  Instances of this are responsible for
- * constructing chains of partial styles.
+ * constructing chains of partial styles.  Constructing styles and looking up
+ * their attributes are safe to call from multiple threads.
  */
 @interface OOStyleRegistry : NSObject
 /**
@@ -77,7 +86,8 @@ extern NSString *OOPartialStyleKey;
 - (NSDictionary*)attributesForStyle: (OOPartialStyle*)styles;
 /**
  * Construct a partial style from OmniOutliner 3 XML, which inherits from a
- * specified style.
+ * specified style.  Partial styles are interned, so this returns the same
+ * (immutable) instance for every style with the same attributes and parent.
  */
 - (OOPartialStyle*)partialStyleForOO3XML: (NSXMLElement*)xml
                             inheritsFrom: (OOPartialStyle*)aPartialStyle;
@@ -93,4 +103,8 @@ extern NSString *OOPartialStyleKey;
  * Serialise as OmniOutliner 3 XML.
  */
 - (NSXMLElement*)oo3xmlValue;
+/**
+ * Write as OmniOutliner 3 XML.
+ */
+- (void)writeOO3XML: (OOXMLWriter*)aWriter;
 @end
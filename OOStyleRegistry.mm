@@ -26,7 +26,11 @@
  */
 
 #import "OpenOutliner.h"
+#import <algorithm>
+#import <atomic>
 #import <functional>
+#import <mutex>
+#import <unordered_map>
 #import <utility>
 #import <vector>
 #if __has_include(<optional>)
@@ -49,25 +53,137 @@ using std::experimental::optional;
 	 * The partial style from which this inherits.
 	 */
 	OOPartialStyle *inheritsFrom;
+	/**
+	 * The generation at which this style was last modified.
+	 */
+	NSUInteger generation;
+	/**
+	 * The flattened attributes for this style and the styles that it inherits
+	 * from, or `nil` if they have not been computed.
+	 */
+	NSDictionary *cachedAttributes;
+	/**
+	 * The value of `-chainGeneration` when `cachedAttributes` was computed.
+	 */
+	NSUInteger cachedGeneration;
+	/**
+	 * Flag indicating that this is the canonical instance for its contents,
+	 * interned in the registry.  Canonical styles are shared and so must not
+	 * be modified.
+	 */
+	BOOL isCanonical;
 }
+/**
+ * Records that this style has been modified, invalidating any cached
+ * attributes for this style and any styles that inherit from it.
+ */
+- (void)styleDidChange;
+/**
+ * Returns the most recent generation at which this style, or any style that it
+ * inherits from, was modified.  This is O(length of the inheritance chain).
+ */
+- (NSUInteger)chainGeneration;
 @end
 
+namespace {
+/**
+ * Counter used to order modifications to partial styles.
+ */
+std::atomic<NSUInteger> styleGeneration;
+/**
+ * Key used for interning partial styles.  Two partial styles are equivalent if
+ * they define the same attributes and inherit from the same style.
+ */
+struct interned_style_key
+{
+	/**
+	 * The style from which the interned style inherits.  This is retained by
+	 * the interned style and so cannot be deallocated while the key exists.
+	 */
+	__unsafe_unretained OOPartialStyle *inheritsFrom;
+	/**
+	 * The attributes defined by the interned style.
+	 */
+	NSDictionary *attributes;
+	bool operator==(const interned_style_key &o) const
+	{
+		return (inheritsFrom == o.inheritsFrom) &&
+		       [attributes isEqualToDictionary: o.attributes];
+	}
+	/**
+	 * Hash function.  `NSDictionary` hashes only its count, so this combines
+	 * the hashes of the keys and values, independent of their order.
+	 */
+	struct hash
+	{
+		size_t operator()(const interned_style_key &k) const
+		{
+			size_t h = std::hash<void*>()((__bridge void*)k.inheritsFrom);
+			for (id key in k.attributes)
+			{
+				h += [key hash] * 31 + [[k.attributes objectForKey: key] hash];
+			}
+			return h;
+		}
+	};
+};
+}
+
 @interface OOStyleRegistry ()
-- (NSXMLElement*)oo3xmlForPartialStyle: (OOPartialStyle*)aStyle;
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+    forPartialStyle: (OOPartialStyle*)aStyle;
 @end
 
 NSString *OOPartialStyleKey = @"OOPartialStyleKey";
 
 @implementation OOPartialStyle
 @synthesize registry;
+- (BOOL)isEqual: (id)anObject
+{
+	if (anObject == self)
+	{
+		return YES;
+	}
+	if (![anObject isKindOfClass: [OOPartialStyle class]])
+	{
+		return NO;
+	}
+	OOPartialStyle *o = anObject;
+	// Two distinct canonical styles are never equal.
+	if (isCanonical && o->isCanonical && (registry == o.registry))
+	{
+		return NO;
+	}
+	return (inheritsFrom == o->inheritsFrom) && [d isEqualToDictionary: o->d];
+}
+- (NSUInteger)hash
+{
+	return interned_style_key::hash()({ inheritsFrom, d });
+}
 - (id)init
 {
 	OO_SUPER_INIT();
 	d = [NSMutableDictionary new];
+	[self styleDidChange];
 	return self;
 }
+- (void)styleDidChange
+{
+	NSAssert(!isCanonical, @"Shared styles must not be modified");
+	generation = ++styleGeneration;
+}
+- (NSUInteger)chainGeneration
+{
+	NSUInteger g = 0;
+	for (OOPartialStyle *ps = self ; ps != nil ; ps = ps->inheritsFrom)
+	{
+		g = std::max(g, ps->generation);
+	}
+	return g;
+}
 - (instancetype) subtract: (OOPartialStyle *)r
 {
+	NSAssert(!isCanonical, @"Shared styles must not be modified");
 	std::vector<id> removals;
 	for (id key in r->d)
 	{
@@ -81,6 +197,10 @@ NSString *OOPartialStyleKey = @"OOPartialStyleKey";
 	{
 		[d removeObjectForKey: key];
 	}
+	if (!removals.empty())
+	{
+		[self styleDidChange];
+	}
 	if (r->inheritsFrom)
 	{
 		[self subtract: r->inheritsFrom];
@@ -88,12 +208,16 @@ NSString *OOPartialStyleKey = @"OOPartialStyleKey";
 	return self;
 }
 - (NSXMLElement*)oo3xmlValue
+{
+	return [OOXMLWriter elementByWriting: ^(OOXMLWriter *w) { [self writeOO3XML: w]; }];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
 {
 	if ([d count] == 0)
 	{
-		return nil;
+		return;
 	}
-	return [registry oo3xmlForPartialStyle: self];
+	[registry writeOO3XML: aWriter forPartialStyle: self];
 }
 /**
  * Recompute the style from attributes.  This will ignore any attributes that
@@ -148,12 +272,12 @@ struct style_attribute
 	/**
 	 * Emit OmniOutliner 3 XML taking the value from a partial style.
 	 */
-	virtual NSXMLElement* toOO3XML(id) = 0;
+	virtual void toOO3XML(OOXMLWriter*, id) = 0;
 	/**
 	 * Emit OmniOutliner 3 XML for this attribute in the style registry at the
 	 * start of an OmniOutliner 3 document.
 	 */
-	virtual NSXMLElement* toOO3XML() = 0;
+	virtual void toOO3XML(OOXMLWriter*) = 0;
 	/**
 	 * The default value.
 	 */
@@ -191,28 +315,27 @@ struct style_attribute
 	static std::unique_ptr<style_attribute> create(NSXMLElement *e);
 protected:
 	/**
-	 * Constructs an OmniOutliner 3 XML element for a reference to this style
-	 * attribute.
+	 * Starts an OmniOutliner 3 XML element for a reference to this style
+	 * attribute.  The caller is responsible for ending the element.
 	 */
-	NSXMLElement *oo3XMLElement()
+	void startOO3XMLElement(OOXMLWriter *w)
 	{
-		return [NSXMLElement elementWithName: @"value"
-		                attributesDictionary: @{ @"key" : key }];
+		[w startElement: @"value"];
+		[w addAttribute: key withName: @"key"];
 	}
 	/**
-	 * Constructs an OmniOutliner 3 XML element for the definition of this style
-	 * attribute.
+	 * Starts an OmniOutliner 3 XML element for the definition of this style
+	 * attribute.  The caller is responsible for ending the element.
 	 */
-	NSXMLElement *oo3XMLStyleElement()
+	void startOO3XMLStyleElement(OOXMLWriter *w)
 	{
-		NSXMLElement *e = [NSXMLElement elementWithName: @"style-attribute"];
-		[e addAttribute: [NSString stringWithFormat: @"%d", (int)version]
+		[w startElement: @"style-attribute"];
+		[w addAttribute: [NSString stringWithFormat: @"%d", (int)version]
 		       withName: @"version"];
-		[e addAttribute: key withName: @"key"];
-		[e addAttribute: group withName: @"group"];
-		[e addAttribute: name withName: @"name"];
-		[e addAttribute: className withName: @"class"];
-		return e;
+		[w addAttribute: key withName: @"key"];
+		[w addAttribute: group withName: @"group"];
+		[w addAttribute: name withName: @"name"];
+		[w addAttribute: className withName: @"class"];
 	}
 
 };
@@ -227,17 +350,17 @@ class string_style_attribute : public style_attribute
 	{
 		return [e stringValue];
 	}
-	NSXMLElement* toOO3XML(id obj) override
+	void toOO3XML(OOXMLWriter *w, id obj) override
 	{
-		auto *e = oo3XMLElement();
-		[e setStringValue: obj];
-		return e;
+		startOO3XMLElement(w);
+		[w addText: obj];
+		[w endElement];
 	}
-	NSXMLElement* toOO3XML() override
+	void toOO3XML(OOXMLWriter *w) override
 	{
-		auto *e = oo3XMLStyleElement();
-		[e setStringValue: defaultVal];
-		return e;
+		startOO3XMLStyleElement(w);
+		[w addText: defaultVal];
+		[w endElement];
 	}
 	id defaultValue() override
 	{
@@ -265,17 +388,17 @@ class color_style_attribute : public style_attribute
 	{
 		return [NSColor colourWithOO3XML: [e elementForName: @"color"]];
 	}
-	NSXMLElement* toOO3XML(id obj) override
+	void toOO3XML(OOXMLWriter *w, id obj) override
 	{
-		auto *e = oo3XMLElement();
-		[e addChild: [(NSColor*)obj oo3xmlValue]];
-		return e;
+		startOO3XMLElement(w);
+		[(NSColor*)obj writeOO3XML: w];
+		[w endElement];
 	}
-	NSXMLElement* toOO3XML() override
+	void toOO3XML(OOXMLWriter *w) override
 	{
-		auto *e = oo3XMLStyleElement();
-		[e addChild: [defaultVal oo3xmlValue]];
-		return e;
+		startOO3XMLStyleElement(w);
+		[defaultVal writeOO3XML: w];
+		[w endElement];
 	}
 	id defaultValue() override
 	{
@@ -308,17 +431,17 @@ class bool_style_attribute : public style_attribute
 	{
 		return [NSNumber numberWithBool: [[e stringValue] boolValue]];
 	}
-	NSXMLElement* toOO3XML(id obj) override
+	void toOO3XML(OOXMLWriter *w, id obj) override
 	{
-		auto *e = oo3XMLElement();
-		[e setStringValue: boolToString([obj boolValue])];
-		return e;
+		startOO3XMLElement(w);
+		[w addText: boolToString([obj boolValue])];
+		[w endElement];
 	}
-	NSXMLElement* toOO3XML() override
+	void toOO3XML(OOXMLWriter *w) override
 	{
-		auto *e = oo3XMLStyleElement();
-		[e setStringValue: boolToString(defaultVal)];
-		return e;
+		startOO3XMLStyleElement(w);
+		[w addText: boolToString(defaultVal)];
+		[w endElement];
 	}
 	id defaultValue() override
 	{
@@ -371,26 +494,26 @@ class number_style_attribute : public style_attribute
 		}
 		return box_number(val);
 	}
-	NSXMLElement* toOO3XML(id obj) override
+	void toOO3XML(OOXMLWriter *w, id obj) override
 	{
-		auto *e = oo3XMLElement();
-		[e setStringValue: [obj stringValue]];
-		return e;
+		startOO3XMLElement(w);
+		[w addText: [obj stringValue]];
+		[w endElement];
 	}
-	NSXMLElement* toOO3XML() override
+	void toOO3XML(OOXMLWriter *w) override
 	{
-		auto *e = oo3XMLStyleElement();
-		[e addAttribute: isIntegral() ? @"1" : @"0" withName: @"integral"];
+		startOO3XMLStyleElement(w);
+		[w addAttribute: isIntegral() ? @"1" : @"0" withName: @"integral"];
 		if (min)
 		{
-			[e addAttribute: [@(*min) stringValue] withName: @"min"];
+			[w addAttribute: [@(*min) stringValue] withName: @"min"];
 		}
 		if (max)
 		{
-			[e addAttribute: [@(*max) stringValue] withName: @"max"];
+			[w addAttribute: [@(*max) stringValue] withName: @"max"];
 		}
-		[e setStringValue: [@(defaultVal) stringValue]];
-		return e;
+		[w addText: [@(defaultVal) stringValue]];
+		[w endElement];
 	}
 	id defaultValue() override
 	{
@@ -446,27 +569,27 @@ class enum_style_attribute : public style_attribute
 		NSString *key = [e stringValue];
 		return @(values.at(key));
 	}
-	NSXMLElement* toOO3XML(id obj) override
+	void toOO3XML(OOXMLWriter *w, id obj) override
 	{
-		auto *e = oo3XMLElement();
-		[e setStringValue: keys.at([obj intValue])];
-		return e;
+		startOO3XMLElement(w);
+		[w addText: keys.at([obj intValue])];
+		[w endElement];
 	}
-	NSXMLElement* toOO3XML() override
+	void toOO3XML(OOXMLWriter *w) override
 	{
-		auto *e = oo3XMLStyleElement();
-		NSXMLElement *table = [NSXMLElement elementWithName: @"enum-name-table"];
-		[table addAttribute: [@(defaultVal) stringValue] withName: @"default-value"];
+		startOO3XMLStyleElement(w);
+		[w startElement: @"enum-name-table"];
+		[w addAttribute: [@(defaultVal) stringValue] withName: @"default-value"];
 		for (auto &[value, key] : keys)
 		{
-			NSXMLElement *v = [NSXMLElement elementWithName: @"enum-name-table-element"];
-			[v addAttribute: [@(value) stringValue]
+			[w startElement: @"enum-name-table-element"];
+			[w addAttribute: [@(value) stringValue]
 			       withName: @"value"];
-			[v addAttribute: key withName: @"name"];
-			[table addChild: v];
+			[w addAttribute: key withName: @"name"];
+			[w endElement];
 		}
-		[e addChild: table];
-		return e;
+		[w endElement];
+		[w endElement];
 	}
 	id defaultValue() override
 	{
@@ -638,6 +761,42 @@ struct OOStyle
 		        NSUnderlineStyleAttributeName  : @(underlineStyle)
 		     };
 	}
+	bool operator==(const OOStyle &o) const
+	{
+		return [fontFamily isEqualToString: o.fontFamily] &&
+		       [fontFill isEqual: o.fontFill] &&
+		       (fontTraits == o.fontTraits) &&
+		       (fontSize == o.fontSize) &&
+		       (fontWeight == o.fontWeight) &&
+		       (paragraphAlignment == o.paragraphAlignment) &&
+		       (paragraphBaseWritingDirection == o.paragraphBaseWritingDirection) &&
+		       (paragraphFirstLineIndent == o.paragraphFirstLineIndent) &&
+		       (underlineStyle == o.underlineStyle);
+	}
+	/**
+	 * Hash function, allowing flattened styles to be used as keys in
+	 * unordered containers.
+	 */
+	struct hash
+	{
+		size_t operator()(const OOStyle &s) const
+		{
+			size_t h = [s.fontFamily hash];
+			auto mix = [&](size_t v)
+				{
+					h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+				};
+			mix([s.fontFill hash]);
+			mix(std::hash<NSUInteger>()(s.fontTraits));
+			mix(std::hash<CGFloat>()(s.fontSize));
+			mix(std::hash<NSInteger>()(s.fontWeight));
+			mix(std::hash<NSInteger>()(s.paragraphAlignment));
+			mix(std::hash<NSInteger>()(s.paragraphBaseWritingDirection));
+			mix(std::hash<CGFloat>()(s.paragraphFirstLineIndent));
+			mix(std::hash<NSUInteger>()(s.underlineStyle));
+			return h;
+		}
+	};
 	OOStyle() {}
 	OOStyle(NSDictionary *dict)
 	{
@@ -673,6 +832,47 @@ struct OOStyle
 {
 	OOStyle defaultStyle;
 	object_map<NSString*, std::unique_ptr<style_attribute>> attributes;
+	/**
+	 * Immutable attribute dictionaries for every distinct flattened style that
+	 * has been requested.  Styles that resolve to the same attributes share
+	 * the same font, colour, and paragraph style objects.
+	 */
+	std::unordered_map<OOStyle, NSDictionary*, OOStyle::hash> flattenedStyles;
+	/**
+	 * The partial style used when attributes are requested for a `nil` style.
+	 */
+	OOPartialStyle *emptyStyle;
+	/**
+	 * Canonical instances of all partial styles created by this registry.
+	 */
+	std::unordered_map<interned_style_key, OOPartialStyle*, interned_style_key::hash> internedStyles;
+	/**
+	 * Lock protecting the interned and flattened styles, and the attributes
+	 * cached in canonical styles, so that rows can be loaded concurrently.
+	 */
+	std::mutex lock;
+}
+- (void)dealloc
+{
+	for (auto &kv : internedStyles)
+	{
+		kv.second->cachedAttributes = nil;
+	}
+}
+/**
+ * Returns the canonical style with the same attributes and parent as `aStyle`,
+ * making `aStyle` the canonical instance if there is no existing one.  Must be
+ * called with `lock` held.
+ */
+- (OOPartialStyle*)internStyle: (OOPartialStyle*)aStyle
+{
+	OOPartialStyle *&canonical = internedStyles[{ aStyle->inheritsFrom, aStyle->d }];
+	if (!canonical)
+	{
+		aStyle->isCanonical = YES;
+		canonical = aStyle;
+	}
+	return canonical;
 }
 - (instancetype)init
 {
@@ -762,27 +962,48 @@ struct OOStyle
 }
 - (NSDictionary*)attributesForStyle: (OOPartialStyle*)aStyle
 {
-	OOStyle s = defaultStyle;
-	std::function<void(OOPartialStyle*)> collect = [&](OOPartialStyle* ps)
-		{
-			if (ps->inheritsFrom)
-			{
-				collect(ps->inheritsFrom);
-			}
-			s += ps;
-		};
+	std::lock_guard<std::mutex> g(lock);
 	if (!aStyle)
 	{
-		aStyle = [OOPartialStyle new];
-		aStyle.registry = self;
+		if (!emptyStyle)
+		{
+			emptyStyle = [OOPartialStyle new];
+			emptyStyle.registry = self;
+			emptyStyle = [self internStyle: emptyStyle];
+		}
+		aStyle = emptyStyle;
+	}
+	NSUInteger generation = [aStyle chainGeneration];
+	if (aStyle->cachedAttributes && (aStyle->cachedGeneration == generation))
+	{
+		return aStyle->cachedAttributes;
+	}
+	OOStyle s = defaultStyle;
+	std::vector<OOPartialStyle*> chain;
+	for (OOPartialStyle *ps = aStyle ; ps != nil ; ps = ps->inheritsFrom)
+	{
+		chain.push_back(ps);
+	}
+	for (auto i = chain.rbegin(), e = chain.rend() ; i != e ; ++i)
+	{
+		s += *i;
 	}
-	else
+	NSDictionary *&flattened = flattenedStyles[s];
+	if (!flattened)
 	{
-		collect(aStyle);
+		flattened = s.attributes();
 	}
-	NSMutableDictionary *dict = [s.attributes() mutableCopy];
+	NSMutableDictionary *dict = [flattened mutableCopy];
 	[dict setObject: aStyle forKey: OOPartialStyleKey];
-	return dict;
+	// The cached dictionary refers to the style, so only cache it in styles
+	// that we own and can break the cycle for in -dealloc.
+	if (!aStyle->isCanonical)
+	{
+		return dict;
+	}
+	aStyle->cachedAttributes = [dict copy];
+	aStyle->cachedGeneration = generation;
+	return aStyle->cachedAttributes;
 }
 - (OOPartialStyle*)partialStyleForOO3XML: (NSXMLElement*)xml
                             inheritsFrom: (OOPartialStyle*)aPartialStyle
@@ -802,7 +1023,8 @@ struct OOStyle
 	}
 	ps.registry = self;
 	ps->inheritsFrom = aPartialStyle;
-	return ps;
+	std::lock_guard<std::mutex> g(lock);
+	return [self internStyle: ps];
 }
 - (OOPartialStyle*)partialStyleFromAttributes: (NSDictionary*)aDictionary
                                  inheritsFrom: (OOPartialStyle*)aPartialStyle
@@ -812,17 +1034,25 @@ struct OOStyle
 	[ps subtract: aPartialStyle];
 	ps->inheritsFrom = aPartialStyle;
 	ps.registry = self;
-	return ps;
+	std::lock_guard<std::mutex> g(lock);
+	return [self internStyle: ps];
 }
-- (NSXMLElement*)oo3xmlForPartialStyle: (OOPartialStyle*)aPartialStyle
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+    forPartialStyle: (OOPartialStyle*)aPartialStyle
 {
-	NSXMLElement *e = [NSXMLElement elementWithName: @"style"];
+	[aWriter startElement: @"style"];
 	for (NSString *key in aPartialStyle->d)
 	{
 		id val = [aPartialStyle->d objectForKey: key];
-		[e addChild: attributes[key]->toOO3XML(val)];
+		// Styles are written concurrently, so this must not insert into the
+		// map.
+		auto attribute = attributes.find(key);
+		if (attribute != attributes.end())
+		{
+			attribute->second->toOO3XML(aWriter, val);
+		}
 	}
-	return e;
+	[aWriter endElement];
 }
 - (instancetype)initWithOO3XML: (NSXMLElement*)xml
 {
@@ -846,11 +1076,15 @@ struct OOStyle
 }
 - (NSXMLElement*)oo3xmlValue
 {
-	NSXMLElement *xml = [NSXMLElement elementWithName: @"style-attribute-registry"];
+	return [OOXMLWriter elementByWriting: ^(OOXMLWriter *w) { [self writeOO3XML: w]; }];
+}
+- (void)writeOO3XML: (OOXMLWriter*)aWriter
+{
+	[aWriter startElement: @"style-attribute-registry"];
 	for (auto &kv : attributes)
 	{
-		[xml addChild: kv.second->toOO3XML()];
+		kv.second->toOO3XML(aWriter);
 	}
-	return xml;
+	[aWriter endElement];
 }
 @end
@@ -0,0 +1,149 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Writer for XML.  Objects that can be serialised as OmniOutliner 3 XML
+ * implement a `-writeOO3XML:` method that describes their XML representation
+ * as a sequence of calls on a writer.  The same sequence can then either be
+ * emitted directly as bytes, or used to construct an `NSXMLElement` tree.
+ *
+ * The default writer pretty prints into a growable buffer (optionally flushed
+ * to a file descriptor), in the same format as `NSXMLNodePrettyPrint`: child
+ * elements are placed on new lines indented by four spaces, elements that
+ * contain only text are written on a single line, and empty elements are
+ * written as a start and end tag.  Attributes are emitted in the order in
+ * which they are added.
+ */
+@interface OOXMLWriter : NSObject
+/**
+ * Returns a new writer that pretty prints into an in-memory buffer.
+ */
++ (instancetype)writer;
+/**
+ * Returns a new writer that pretty prints into the specified file descriptor.
+ * Output is buffered and periodically written to the file descriptor.  The
+ * caller is responsible for closing the file descriptor after calling
+ * `-flushAndReturnError:`.
+ */
++ (instancetype)writerWithFileDescriptor: (int)aFileDescriptor;
+/**
+ * Returns a new writer that writes a fragment that can later be inserted into
+ * the output of another writer with `-addFragment:`.  Line breaks in text and
+ * attribute values are escaped, so the only line breaks in the output are
+ * those added by pretty printing and the fragment can be reindented.
+ */
++ (instancetype)fragmentWriter;
+/**
+ * Returns a new writer that writes a single element that will be inserted
+ * with `-addWrittenElement:` into the output of a writer whose `depth` is
+ * `aDepth`.  The element is indented as if it had been written directly by
+ * the other writer, so the combined output is identical.
+ */
++ (instancetype)writerAtDepth: (NSUInteger)aDepth;
+/**
+ * Invokes the block with a writer that constructs an `NSXMLElement` tree and
+ * returns the root element.  Returns `nil` if the block does not write any
+ * elements.
+ */
++ (NSXMLElement*)elementByWriting: (void(^)(OOXMLWriter *aWriter))aBlock;
+/**
+ * Writes the XML declaration and a document type declaration with the
+ * specified public and system identifiers.  This must be called before any
+ * elements are written and is ignored by writers that construct trees.
+ */
+- (void)writeXMLDeclarationWithDocumentType: (NSString*)aName
+                                   publicID: (NSString*)aPublicID
+                                   systemID: (NSString*)aSystemID;
+/**
+ * Starts a new element with the specified name as a child of the current
+ * element.
+ */
+- (void)startElement: (NSString*)aName;
+/**
+ * Adds an attribute to the current element.  This must be called before any
+ * children or text are added to the element.
+ */
+- (void)addAttribute: (NSString*)aValue
+            withName: (NSString*)aName;
+/**
+ * Adds text to the current element.  The text will be escaped as required.
+ */
+- (void)addText: (NSString*)aString;
+/**
+ * Ends the current element.
+ */
+- (void)endElement;
+/**
+ * Adds an element containing only the specified text.
+ */
+- (void)addElement: (NSString*)aName
+          withText: (NSString*)aString;
+/**
+ * Adds an element that was written by a fragment writer as a child of the
+ * current element, indented for the current depth.
+ */
+- (void)addFragment: (NSData*)aFragment;
+/**
+ * Adds an element that was written by a writer returned from
+ * `+writerAtDepth:` with the current depth of this writer.
+ */
+- (void)addWrittenElement: (NSData*)anElement;
+/**
+ * Adds an element that was written by a writer with the same depth as this
+ * writer's current depth, from the specified range of that writer's data.
+ */
+- (void)addWrittenElement: (NSData*)aData
+                    range: (NSRange)aRange;
+/**
+ * The length of the output written so far.  Ranges of the output between
+ * offsets remain valid in `-data` for as long as the writer exists.  This is
+ * `NSNotFound` for writers whose data does not contain all of their output,
+ * such as writers that construct trees or that flush to a file descriptor.
+ */
+@property (nonatomic, readonly) NSUInteger offset;
+/**
+ * The offset of the start tag of the current element, or `NSNotFound` if
+ * `offset` is `NSNotFound`.
+ */
+@property (nonatomic, readonly) NSUInteger elementOffset;
+/**
+ * The number of elements that are currently open.
+ */
+@property (nonatomic, readonly) NSUInteger depth;
+/**
+ * Returns the data written so far.  For writers that write to a file
+ * descriptor, this contains only data that has not yet been flushed.
+ */
+- (NSData*)data;
+/**
+ * Writes any buffered data to the file descriptor.  Returns `NO` and sets the
+ * error if writing fails.  Does nothing for writers that write to a buffer.
+ */
+- (BOOL)flushAndReturnError: (NSError**)outError;
+@end
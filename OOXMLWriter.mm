@@ -0,0 +1,501 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#import "OpenOutliner.h"
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+/**
+ * Size at which a writer with a file descriptor flushes its buffer.
+ */
+const NSUInteger flushThreshold = 1024 * 1024;
+/**
+ * State for each element that is currently open in a streaming writer.
+ */
+struct open_element
+{
+	/**
+	 * The name of the element.
+	 */
+	NSString *name;
+	/**
+	 * Flag indicating that the element contains child elements, and so its end
+	 * tag must be placed on a new line.
+	 */
+	bool hasElementChildren = false;
+	/**
+	 * The offset in the buffer of the start tag of the element.
+	 */
+	NSUInteger offset = 0;
+};
+}
+
+/**
+ * Writer that constructs an `NSXMLElement` tree.
+ */
+@interface OOXMLTreeWriter : OOXMLWriter
+/**
+ * The root element that has been written.
+ */
+@property (nonatomic, readonly) NSXMLElement *rootElement;
+@end
+
+@implementation OOXMLWriter
+{
+	/**
+	 * The buffer containing the output.
+	 */
+	NSMutableData *buffer;
+	/**
+	 * The file descriptor to write to, or -1 if this writer writes only to the
+	 * buffer.
+	 */
+	int fd;
+	/**
+	 * The elements that are currently open.
+	 */
+	std::vector<open_element> stack;
+	/**
+	 * Flag indicating that the start tag of the current element has not yet
+	 * been closed, so attributes may still be added.
+	 */
+	bool tagOpen;
+	/**
+	 * Flag indicating that line breaks in text are escaped.  This is set for
+	 * writers that produce fragments.
+	 */
+	bool escapesNewlines;
+	/**
+	 * The number of elements that enclose this writer's output in the writer
+	 * into which it will be inserted.
+	 */
+	NSUInteger baseDepth;
+	/**
+	 * The error from the last failed write, if any.
+	 */
+	NSError *writeError;
+}
++ (instancetype)writer
+{
+	return [self new];
+}
++ (instancetype)writerWithFileDescriptor: (int)aFileDescriptor
+{
+	OOXMLWriter *w = [self new];
+	w->fd = aFileDescriptor;
+	return w;
+}
++ (instancetype)writerAtDepth: (NSUInteger)aDepth
+{
+	OOXMLWriter *w = [self new];
+	w->baseDepth = aDepth;
+	return w;
+}
++ (instancetype)fragmentWriter
+{
+	OOXMLWriter *w = [self new];
+	w->escapesNewlines = true;
+	return w;
+}
++ (NSXMLElement*)elementByWriting: (void(^)(OOXMLWriter *aWriter))aBlock
+{
+	auto *w = [OOXMLTreeWriter new];
+	aBlock(w);
+	return [w rootElement];
+}
+- (instancetype)init
+{
+	OO_SUPER_INIT();
+	buffer = [NSMutableData new];
+	fd = -1;
+	return self;
+}
+/**
+ * Append raw bytes to the output.
+ */
+- (void)write: (const char*)aString length: (NSUInteger)aLength
+{
+	[buffer appendBytes: aString length: aLength];
+	if ((fd != -1) && ([buffer length] > flushThreshold))
+	{
+		[self flushAndReturnError: nullptr];
+	}
+}
+/**
+ * Append a C string to the output.
+ */
+- (void)write: (const char*)aString
+{
+	[self write: aString length: strlen(aString)];
+}
+/**
+ * Append a string to the output, escaping any characters that are not
+ * permitted in the context.  Quotes are escaped only in attribute values.
+ */
+- (void)writeEscaped: (NSString*)aString inAttribute: (BOOL)isAttribute
+{
+	const char *str = [aString UTF8String];
+	if (str == nullptr)
+	{
+		return;
+	}
+	const char *start = str;
+	auto flush = [&](const char *end)
+		{
+			if (end > start)
+			{
+				[self write: start length: static_cast<NSUInteger>(end - start)];
+			}
+		};
+	for (const char *c = str ; *c != 0 ; c++)
+	{
+		const char *replacement = nullptr;
+		switch (*c)
+		{
+			case '&':
+				replacement = "&amp;";
+				break;
+			case '<':
+				replacement = "&lt;";
+				break;
+			case '>':
+				replacement = "&gt;";
+				break;
+			case '\r':
+				replacement = "&#xD;";
+				break;
+			case '\n':
+				if (escapesNewlines)
+				{
+					replacement = "&#xA;";
+				}
+				break;
+			case '"':
+				if (isAttribute)
+				{
+					replacement = "&quot;";
+				}
+				break;
+			default:
+				break;
+		}
+		if (replacement)
+		{
+			flush(c);
+			[self write: replacement];
+			start = c + 1;
+		}
+	}
+	flush(str + strlen(str));
+}
+/**
+ * Write a new line followed by the indent for the current depth.
+ */
+- (void)writeNewLine
+{
+	static const char spaces[] = "                                ";
+	[self write: "\n" length: 1];
+	NSUInteger indent = (baseDepth + stack.size()) * 4;
+	while (indent > 0)
+	{
+		NSUInteger len = std::min<NSUInteger>(indent, sizeof(spaces) - 1);
+		[self write: spaces length: len];
+		indent -= len;
+	}
+}
+/**
+ * Close the start tag of the current element, if it is still open.
+ */
+- (void)closeTag
+{
+	if (tagOpen)
+	{
+		[self write: ">" length: 1];
+		tagOpen = false;
+	}
+}
+- (void)writeXMLDeclarationWithDocumentType: (NSString*)aName
+                                   publicID: (NSString*)aPublicID
+                                   systemID: (NSString*)aSystemID
+{
+	NSAssert(stack.empty(), @"XML declaration must precede the root element");
+	[self write: "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n<!DOCTYPE "];
+	[self write: [aName UTF8String]];
+	[self write: " PUBLIC \""];
+	[self writeEscaped: aPublicID inAttribute: YES];
+	[self write: "\" \""];
+	[self writeEscaped: aSystemID inAttribute: YES];
+	[self write: "\">\n"];
+}
+- (void)startElement: (NSString*)aName
+{
+	[self closeTag];
+	if (!stack.empty())
+	{
+		stack.back().hasElementChildren = true;
+		[self writeNewLine];
+	}
+	NSUInteger offset = [buffer length];
+	[self write: "<" length: 1];
+	[self write: [aName UTF8String]];
+	stack.push_back({ aName, false, offset });
+	tagOpen = true;
+}
+- (void)addAttribute: (NSString*)aValue
+            withName: (NSString*)aName
+{
+	NSAssert(tagOpen, @"Attributes must be added before children");
+	[self write: " " length: 1];
+	[self write: [aName UTF8String]];
+	[self write: "=\"" length: 2];
+	[self writeEscaped: aValue inAttribute: YES];
+	[self write: "\"" length: 1];
+}
+- (void)addText: (NSString*)aString
+{
+	[self closeTag];
+	[self writeEscaped: aString inAttribute: NO];
+}
+- (void)endElement
+{
+	open_element e = stack.back();
+	stack.pop_back();
+	if (tagOpen)
+	{
+		[self write: "></" length: 3];
+		tagOpen = false;
+	}
+	else
+	{
+		if (e.hasElementChildren)
+		{
+			[self writeNewLine];
+		}
+		[self write: "</" length: 2];
+	}
+	[self write: [e.name UTF8String]];
+	[self write: ">" length: 1];
+	if (stack.empty() && (baseDepth == 0))
+	{
+		[self write: "\n" length: 1];
+	}
+}
+- (void)addElement: (NSString*)aName
+          withText: (NSString*)aString
+{
+	[self startElement: aName];
+	[self addText: aString];
+	[self endElement];
+}
+- (void)addFragment: (NSData*)aFragment
+{
+	[self closeTag];
+	if (!stack.empty())
+	{
+		stack.back().hasElementChildren = true;
+		[self writeNewLine];
+	}
+	const char *start = static_cast<const char*>([aFragment bytes]);
+	const char *end = start + [aFragment length];
+	// The fragment writer terminates the root element with a line break.
+	while ((end > start) && (end[-1] == '\n'))
+	{
+		end--;
+	}
+	// Line breaks in the fragment are all formatting, so each one can be
+	// followed by the indent for the current depth.
+	while (const char *nl = static_cast<const char*>(memchr(start, '\n', static_cast<size_t>(end - start))))
+	{
+		[self write: start length: static_cast<NSUInteger>(nl - start)];
+		[self writeNewLine];
+		start = nl + 1;
+	}
+	[self write: start length: static_cast<NSUInteger>(end - start)];
+}
+- (void)addWrittenElement: (NSData*)anElement
+{
+	[self addWrittenElement: anElement
+	                  range: NSMakeRange(0, [anElement length])];
+}
+- (void)addWrittenElement: (NSData*)aData
+                    range: (NSRange)aRange
+{
+	// This must match the output of -startElement:.
+	[self closeTag];
+	if (!stack.empty())
+	{
+		stack.back().hasElementChildren = true;
+		[self writeNewLine];
+	}
+	[self write: static_cast<const char*>([aData bytes]) + aRange.location
+	     length: aRange.length];
+}
+- (NSUInteger)depth
+{
+	return baseDepth + stack.size();
+}
+- (NSUInteger)offset
+{
+	return (fd == -1) ? [buffer length] : NSNotFound;
+}
+- (NSUInteger)elementOffset
+{
+	return (fd == -1) ? stack.back().offset : NSNotFound;
+}
+- (NSData*)data
+{
+	return buffer;
+}
+- (BOOL)flushAndReturnError: (NSError**)outError
+{
+	if (fd != -1)
+	{
+		const char *bytes = static_cast<const char*>([buffer bytes]);
+		NSUInteger remaining = [buffer length];
+		while (remaining > 0 && !writeError)
+		{
+			ssize_t written = write(fd, bytes, remaining);
+			if (written < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				writeError = [NSError errorWithDomain: NSPOSIXErrorDomain
+				                                 code: errno
+				                             userInfo: nil];
+				break;
+			}
+			bytes += written;
+			remaining -= static_cast<NSUInteger>(written);
+		}
+		[buffer setLength: 0];
+	}
+	if (writeError && outError)
+	{
+		*outError = writeError;
+	}
+	return writeError == nil;
+}
+@end
+
+@implementation OOXMLTreeWriter
+{
+	/**
+	 * The elements that are currently open.
+	 */
+	NSMutableArray<NSXMLElement*> *elements;
+}
+@synthesize rootElement;
+- (instancetype)init
+{
+	OO_SUPER_INIT();
+	elements = [NSMutableArray new];
+	return self;
+}
+- (void)writeXMLDeclarationWithDocumentType: (NSString*)aName
+                                   publicID: (NSString*)aPublicID
+                                   systemID: (NSString*)aSystemID
+{
+}
+- (void)startElement: (NSString*)aName
+{
+	NSXMLElement *e = [NSXMLElement elementWithName: aName];
+	if (NSXMLElement *parent = [elements lastObject])
+	{
+		[parent addChild: e];
+	}
+	else if (!rootElement)
+	{
+		rootElement = e;
+	}
+	[elements addObject: e];
+}
+- (void)addAttribute: (NSString*)aValue
+            withName: (NSString*)aName
+{
+	[[elements lastObject] addAttribute: aValue withName: aName];
+}
+- (void)addText: (NSString*)aString
+{
+	[[elements lastObject] addChild: [NSXMLNode textWithStringValue: aString]];
+}
+- (void)endElement
+{
+	[elements removeLastObject];
+}
+- (void)addWrittenElement: (NSData*)anElement
+{
+	[self addFragment: anElement];
+}
+- (void)addWrittenElement: (NSData*)aData
+                    range: (NSRange)aRange
+{
+	[self addFragment: [aData subdataWithRange: aRange]];
+}
+- (NSUInteger)depth
+{
+	return [elements count];
+}
+- (NSUInteger)offset
+{
+	return NSNotFound;
+}
+- (NSUInteger)elementOffset
+{
+	return NSNotFound;
+}
+- (void)addFragment: (NSData*)aFragment
+{
+	NSError *error;
+	auto *doc = [[NSXMLDocument alloc] initWithData: aFragment
+	                                        options: NSXMLNodeOptionsNone
+	                                          error: &error];
+	NSAssert(doc, @"Invalid XML fragment: %@", error);
+	NSXMLElement *e = [doc rootElement];
+	[e detach];
+	if (NSXMLElement *parent = [elements lastObject])
+	{
+		[parent addChild: e];
+	}
+	else if (!rootElement)
+	{
+		rootElement = e;
+	}
+}
+- (NSData*)data
+{
+	return [rootElement XMLDataWithOptions: NSXMLNodePrettyPrint];
+}
+- (BOOL)flushAndReturnError: (NSError**)outError
+{
+	return YES;
+}
+@end
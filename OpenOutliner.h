@@ -31,6 +31,7 @@
 #import <Foundation/Foundation.h>
 #import "AppDelegate.h"
 #import "NSData+GZIP.h"
+#import "NSData+ParallelGZIP.h"
 #import "NSColor+OO3.h"
 #import "NSAttributedString+OO3.h"
 #import "NSString+MissingCasts.h"
@@ -39,14 +40,19 @@
 #import "OOOutlineColumn.h"
 #import "OOOutlineDataSource.h"
 #import "OOOutlineDocument.h"
+#import "OOOutlineFilter.h"
+#import "OOOutlineJournal.h"
 #import "OOOutlineRow.h"
 #import "OOOutlineRow+Pasteboard.h"
+#import "OOOutlineSearchIndex.h"
 #import "OOOutlineTableRowView.h"
 #import "OOOutlineValue.h"
 #import "OOOutlineView.h"
+#import "OOOutlineXMLReader.h"
 #import "OOOutlineWindowController.h"
 #import "OOUNIXDateFormatter.h"
 #import "OOStyleRegistry.h"
+#import "OOXMLWriter.h"
 #import "OpenOutliner.h"
 #import "objcxx_helpers.h"
 
@@ -56,8 +62,8 @@
 
 /**
  * Pasteboard type for outline rows within the current document.  This is used
- * for internal drag operations.  The pasteboard stores the (string) identifiers
- * of the rows, within the current document.
+ * for internal drag operations.  The pasteboard stores the IDs of the rows
+ * (as decimal strings), within the current document.
  */
 extern NSString *OOOUtlineRowsPasteboardType;
 /**
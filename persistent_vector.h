@@ -0,0 +1,368 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/**
+ * This file contains a persistent vector: a sequence container with value
+ * semantics whose copies share their storage.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/**
+ * A vector whose copies share storage until they are modified.  Copying is
+ * O(1), so a copy can be kept as an immutable snapshot while the original
+ * continues to be modified, and element access, replacement, insertion, and
+ * removal are O(log n).
+ *
+ * The elements are stored in a B+ tree whose interior nodes record the number
+ * of elements below each child.  Modifying a vector copies only the nodes on
+ * the path to the modified element that are shared with another vector
+ * (path copying), so modifications allocate O(log n) nodes and a vector that
+ * is not shared is modified in place.
+ *
+ * A copy may be kept as a snapshot and read, or destroyed, on other threads
+ * while the original is modified on one thread.  Snapshots that are shared
+ * between threads must be treated as read-only: only one thread may modify a
+ * vector, or copies of it, at a time.
+ */
+template<typename T, size_t branching = 32>
+class persistent_vector
+{
+	/**
+	 * A node in the tree.  Nodes are either leaves, which contain elements, or
+	 * interior nodes, which contain other nodes.
+	 */
+	struct node
+	{
+		/**
+		 * The elements, if this is a leaf.
+		 */
+		std::vector<T> elements;
+		/**
+		 * The children, if this is an interior node.
+		 */
+		std::vector<std::shared_ptr<node>> children;
+		/**
+		 * The number of elements in the subtrees of the children up to and
+		 * including each child.
+		 */
+		std::vector<size_t> ends;
+		/**
+		 * Returns whether this is a leaf.
+		 */
+		bool is_leaf() const
+		{
+			return children.empty();
+		}
+		/**
+		 * Returns the number of elements or children in this node.
+		 */
+		size_t width() const
+		{
+			return is_leaf() ? elements.size() : children.size();
+		}
+		/**
+		 * Returns the number of elements in this subtree.
+		 */
+		size_t size() const
+		{
+			return is_leaf() ? elements.size() : ends.back();
+		}
+		/**
+		 * Recomputes `ends` after the children have been modified.
+		 */
+		void update_ends()
+		{
+			ends.resize(children.size());
+			size_t total = 0;
+			for (size_t i=0 ; i<children.size() ; i++)
+			{
+				total += children[i]->size();
+				ends[i] = total;
+			}
+		}
+		/**
+		 * Returns the index of the child containing the element at index `i`.
+		 */
+		size_t child_containing(size_t i) const
+		{
+			return std::upper_bound(ends.begin(), ends.end(), i) - ends.begin();
+		}
+		/**
+		 * Returns the index of the first element in the specified child.
+		 */
+		size_t child_start(size_t aChild) const
+		{
+			return (aChild == 0) ? 0 : ends[aChild - 1];
+		}
+		/**
+		 * Moves the second half of this node's elements or children into a
+		 * new node and returns it.
+		 */
+		std::shared_ptr<node> split()
+		{
+			auto right = std::make_shared<node>();
+			if (is_leaf())
+			{
+				size_t half = elements.size() / 2;
+				right->elements.assign(std::make_move_iterator(elements.begin() + half),
+				                       std::make_move_iterator(elements.end()));
+				elements.resize(half);
+			}
+			else
+			{
+				size_t half = children.size() / 2;
+				right->children.assign(children.begin() + half, children.end());
+				children.resize(half);
+				update_ends();
+				right->update_ends();
+			}
+			return right;
+		}
+	};
+	/**
+	 * Shared pointer to a node.
+	 */
+	using node_ptr = std::shared_ptr<node>;
+	/**
+	 * The root of the tree, or `nullptr` if the vector has never contained
+	 * any elements.
+	 */
+	node_ptr root;
+	/**
+	 * Ensures that `aNode` is not shared with any other vector, copying it if
+	 * it is.  The copy shares its children with the original.
+	 */
+	static void make_unique(node_ptr &aNode)
+	{
+		// A count of one means that only this vector can reach the node, so
+		// no other thread can add a reference, but the count may have just
+		// fallen because another thread destroyed a snapshot.  The count is
+		// read with a relaxed load, so the fence ensures that that thread's
+		// reads of the node happen before it is modified in place.
+		if (aNode.use_count() != 1)
+		{
+			aNode = std::make_shared<node>(*aNode);
+			return;
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+	}
+	/**
+	 * Inserts a value into the subtree rooted at the (unshared) node.  If the
+	 * node overflows then it is split and the new right sibling is returned.
+	 */
+	static node_ptr insert(node &aNode, size_t i, T &&aValue)
+	{
+		if (aNode.is_leaf())
+		{
+			aNode.elements.insert(aNode.elements.begin() + i, std::move(aValue));
+		}
+		else
+		{
+			// Insertions at the end of a child's range are added to that
+			// child, so that appending extends the last leaf.
+			size_t k = std::lower_bound(aNode.ends.begin(), aNode.ends.end(), i) - aNode.ends.begin();
+			node_ptr &child = aNode.children[k];
+			make_unique(child);
+			if (node_ptr right = insert(*child, i - aNode.child_start(k), std::move(aValue)))
+			{
+				aNode.children.insert(aNode.children.begin() + k + 1, std::move(right));
+			}
+			aNode.update_ends();
+		}
+		return (aNode.width() > branching) ? aNode.split() : nullptr;
+	}
+	/**
+	 * Removes a value from the subtree rooted at the (unshared) node.  Empty
+	 * children are removed and small children are merged with a neighbour,
+	 * so the tree stays balanced.
+	 */
+	static void erase(node &aNode, size_t i)
+	{
+		if (aNode.is_leaf())
+		{
+			aNode.elements.erase(aNode.elements.begin() + i);
+			return;
+		}
+		size_t k = aNode.child_containing(i);
+		make_unique(aNode.children[k]);
+		erase(*aNode.children[k], i - aNode.child_start(k));
+		node &child = *aNode.children[k];
+		if (child.width() == 0)
+		{
+			aNode.children.erase(aNode.children.begin() + k);
+		}
+		else if ((child.width() < branching / 2) && (aNode.children.size() > 1))
+		{
+			size_t left = (k + 1 < aNode.children.size()) ? k : k - 1;
+			node &l = *aNode.children[left];
+			const node &r = *aNode.children[left + 1];
+			if (l.width() + r.width() <= branching)
+			{
+				make_unique(aNode.children[left]);
+				node &merged = *aNode.children[left];
+				merged.elements.insert(merged.elements.end(), r.elements.begin(), r.elements.end());
+				merged.children.insert(merged.children.end(), r.children.begin(), r.children.end());
+				if (!merged.is_leaf())
+				{
+					merged.update_ends();
+				}
+				aNode.children.erase(aNode.children.begin() + left + 1);
+			}
+		}
+		aNode.update_ends();
+	}
+	/**
+	 * Visits the elements in the subtree rooted at the node, in order.
+	 */
+	template<typename F>
+	static void visit(const node &aNode, F &aVisitor)
+	{
+		if (aNode.is_leaf())
+		{
+			for (const T &element : aNode.elements)
+			{
+				aVisitor(element);
+			}
+			return;
+		}
+		for (const node_ptr &child : aNode.children)
+		{
+			visit(*child, aVisitor);
+		}
+	}
+public:
+	/**
+	 * Returns the number of elements.
+	 */
+	size_t size() const
+	{
+		return root ? root->size() : 0;
+	}
+	/**
+	 * Returns whether the vector contains no elements.
+	 */
+	bool empty() const
+	{
+		return size() == 0;
+	}
+	/**
+	 * Returns the element at the specified index.
+	 */
+	const T &operator[](size_t i) const
+	{
+		const node *n = root.get();
+		while (!n->is_leaf())
+		{
+			size_t k = n->child_containing(i);
+			i -= n->child_start(k);
+			n = n->children[k].get();
+		}
+		return n->elements[i];
+	}
+	/**
+	 * Replaces the element at the specified index.
+	 */
+	void set(size_t i, T aValue)
+	{
+		node_ptr *n = &root;
+		make_unique(*n);
+		while (!(*n)->is_leaf())
+		{
+			size_t k = (*n)->child_containing(i);
+			i -= (*n)->child_start(k);
+			n = &(*n)->children[k];
+			make_unique(*n);
+		}
+		(*n)->elements[i] = std::move(aValue);
+	}
+	/**
+	 * Inserts an element before the element at the specified index, or at
+	 * the end if `i` is equal to `size()`.
+	 */
+	void insert(size_t i, T aValue)
+	{
+		if (!root)
+		{
+			root = std::make_shared<node>();
+		}
+		make_unique(root);
+		if (node_ptr right = insert(*root, i, std::move(aValue)))
+		{
+			auto newRoot = std::make_shared<node>();
+			newRoot->children = { std::move(root), std::move(right) };
+			newRoot->update_ends();
+			root = std::move(newRoot);
+		}
+	}
+	/**
+	 * Appends an element.
+	 */
+	void push_back(T aValue)
+	{
+		insert(size(), std::move(aValue));
+	}
+	/**
+	 * Removes the element at the specified index.
+	 */
+	void erase(size_t i)
+	{
+		make_unique(root);
+		erase(*root, i);
+		// Remove interior nodes with a single child from the top of the tree.
+		while (!root->is_leaf() && (root->children.size() == 1))
+		{
+			node_ptr child = root->children[0];
+			root = std::move(child);
+		}
+		if (root->width() == 0)
+		{
+			root = nullptr;
+		}
+	}
+	/**
+	 * Removes all of the elements.
+	 */
+	void clear()
+	{
+		root = nullptr;
+	}
+	/**
+	 * Invokes the visitor with each element, in order.
+	 */
+	template<typename F>
+	void for_each(F &&aVisitor) const
+	{
+		if (root)
+		{
+			visit(*root, aVisitor);
+		}
+	}
+};
@@ -0,0 +1,420 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/**
+ * This file contains the index of rows in a document, keyed by their integer
+ * IDs, and the mapping between row IDs and OmniOutliner 3 identifier strings.
+ */
+
+#import "OOOutlineRow.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Returns a new row ID.  IDs are allocated sequentially from a random
+ * starting point, so IDs from different sessions are unlikely to collide when
+ * documents are saved and reloaded.  This never returns 0.
+ */
+inline OOOutlineRowID next_row_id()
+{
+	static std::atomic<OOOutlineRowID> next
+		{ (static_cast<OOOutlineRowID>(arc4random()) << 32) | arc4random() };
+	OOOutlineRowID rowID;
+	while ((rowID = next++) == 0) {}
+	return rowID;
+}
+
+namespace {
+/**
+ * The length of the identifier strings that are generated from row IDs.
+ */
+constexpr size_t row_identifier_length = 11;
+/**
+ * The characters used for identifier strings, in order of their value.
+ */
+constexpr char row_identifier_digits[] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+/**
+ * Formats a row ID as an 11-character base-62 identifier string, the same
+ * shape as the identifiers that OmniOutliner generates.
+ */
+inline NSString *row_identifier_string(OOOutlineRowID anID)
+{
+	char buffer[row_identifier_length];
+	for (size_t i=row_identifier_length ; i>0 ; i--)
+	{
+		buffer[i-1] = row_identifier_digits[anID % 62];
+		anID /= 62;
+	}
+	return [[NSString alloc] initWithBytes: buffer
+	                                length: row_identifier_length
+	                              encoding: NSASCIIStringEncoding];
+}
+/**
+ * Parses an identifier string that was generated by `row_identifier_string`.
+ * Returns 0 if the string is not in this form, including when it is an
+ * 11-character alphanumeric string that does not fit in a row ID.
+ */
+inline OOOutlineRowID parse_row_identifier(NSString *anIdentifier)
+{
+	char buffer[row_identifier_length + 1];
+	if (([anIdentifier length] != row_identifier_length) ||
+	    ![anIdentifier getCString: buffer
+	                    maxLength: sizeof(buffer)
+	                     encoding: NSASCIIStringEncoding])
+	{
+		return 0;
+	}
+	OOOutlineRowID rowID = 0;
+	for (size_t i=0 ; i<row_identifier_length ; i++)
+	{
+		const char *digit = strchr(row_identifier_digits, buffer[i]);
+		if (!digit || (buffer[i] == '\0') ||
+		    __builtin_mul_overflow(rowID, 62, &rowID) ||
+		    __builtin_add_overflow(rowID, digit - row_identifier_digits, &rowID))
+		{
+			return 0;
+		}
+	}
+	return rowID;
+}
+
+/**
+ * Hash map from row IDs to values, using open addressing with linear probing.
+ * Entries are stored inline, so inserting does not allocate except when the
+ * table grows.  The ID 0 marks an empty slot and cannot be used as a key.
+ */
+template<typename V>
+class row_id_map
+{
+	/**
+	 * A slot in the table.
+	 */
+	struct entry
+	{
+		OOOutlineRowID key = 0;
+		V value = V();
+	};
+	/**
+	 * The slots.  The number of slots is always zero or a power of two.
+	 */
+	std::vector<entry> entries;
+	/**
+	 * The number of slots that are in use.
+	 */
+	size_t count = 0;
+	/**
+	 * The number of bits used to index the table.
+	 */
+	unsigned bits = 0;
+	/**
+	 * Returns the preferred slot for a key.  Row IDs are mostly sequential,
+	 * so multiply by a large odd constant (Fibonacci hashing) to spread them
+	 * across the table.
+	 */
+	size_t slot(OOOutlineRowID aKey) const
+	{
+		return static_cast<size_t>((aKey * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+	}
+	/**
+	 * Returns the mask for wrapping indexes around the end of the table.
+	 */
+	size_t mask() const
+	{
+		return entries.size() - 1;
+	}
+	/**
+	 * Returns the index of the slot containing a key, or the empty slot where
+	 * it would be inserted.  The table must not be empty.
+	 */
+	size_t index(OOOutlineRowID aKey) const
+	{
+		size_t i = slot(aKey);
+		while ((entries[i].key != 0) && (entries[i].key != aKey))
+		{
+			i = (i + 1) & mask();
+		}
+		return i;
+	}
+	/**
+	 * Doubles the size of the table and reinserts all entries.
+	 */
+	void grow()
+	{
+		std::vector<entry> old;
+		old.swap(entries);
+		bits = std::max(bits + 1, 4U);
+		entries.resize(size_t(1) << bits);
+		for (entry &e : old)
+		{
+			if (e.key != 0)
+			{
+				entries[index(e.key)] = e;
+			}
+		}
+	}
+	public:
+	/**
+	 * Returns a pointer to the value for a key, or `nullptr` if the key is not
+	 * present.
+	 */
+	V *find(OOOutlineRowID aKey)
+	{
+		if (count == 0)
+		{
+			return nullptr;
+		}
+		entry &e = entries[index(aKey)];
+		return (e.key == 0) ? nullptr : &e.value;
+	}
+	/**
+	 * Inserts a value.  Returns false, without modifying the map, if the key
+	 * is already present.
+	 */
+	bool insert(OOOutlineRowID aKey, V aValue)
+	{
+		// Keep the load factor below 3/4.
+		if ((count + 1) * 4 > entries.size() * 3)
+		{
+			grow();
+		}
+		entry &e = entries[index(aKey)];
+		if (e.key != 0)
+		{
+			return false;
+		}
+		e.key = aKey;
+		e.value = aValue;
+		count++;
+		return true;
+	}
+	/**
+	 * Removes a key, if present.  Later entries in the same run are moved
+	 * back, so the table never contains tombstones.
+	 */
+	void erase(OOOutlineRowID aKey)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+		size_t i = index(aKey);
+		if (entries[i].key == 0)
+		{
+			return;
+		}
+		for (size_t j = (i + 1) & mask() ; entries[j].key != 0 ; j = (j + 1) & mask())
+		{
+			// An entry can fill the hole if the hole is between its preferred
+			// slot and its current slot.
+			size_t home = slot(entries[j].key);
+			if (((j - home) & mask()) >= ((j - i) & mask()))
+			{
+				entries[i] = entries[j];
+				i = j;
+			}
+		}
+		entries[i] = entry();
+		count--;
+	}
+	/**
+	 * Calls a function with each key and value.
+	 */
+	template<typename F>
+	void for_each(F &&aFunction)
+	{
+		for (entry &e : entries)
+		{
+			if (e.key != 0)
+			{
+				aFunction(e.key, e.value);
+			}
+		}
+	}
+	/**
+	 * Removes all entries.
+	 */
+	void clear()
+	{
+		entries.clear();
+		count = 0;
+		bits = 0;
+	}
+};
+
+/**
+ * The index of the rows in a document.  Each row has an integer ID and its
+ * identifier string is derived from that ID where possible.  Identifiers that
+ * were read from a file and cannot be represented as IDs are stored in a
+ * single buffer, so rows do not each hold a string.
+ *
+ * This is not thread safe: the document protects it with a lock.
+ */
+class row_index
+{
+	/**
+	 * The location of an identifier string in `names`.
+	 */
+	struct name
+	{
+		uint32_t offset;
+		uint32_t length;
+	};
+	/**
+	 * The rows in the document.  Rows remove themselves when they are
+	 * deallocated, so these references do not need to be weak.
+	 */
+	row_id_map<OOOutlineRow *__unsafe_unretained> rows;
+	/**
+	 * The identifier strings that are not derived from the row ID.  These are
+	 * not removed along with the row, because a version of a deleted row may
+	 * still be being saved.
+	 */
+	row_id_map<name> names;
+	/**
+	 * The UTF-8 bytes of the identifiers in `names`.
+	 */
+	std::string nameBuffer;
+	/**
+	 * Map from the identifiers in `names` to row IDs.  This is needed only to
+	 * find rows by their identifiers, so it is built on first use.
+	 */
+	std::unordered_map<std::string, OOOutlineRowID> idsByName;
+	/**
+	 * Flag indicating whether `idsByName` has been built.
+	 */
+	bool hasIdsByName = false;
+	/**
+	 * Returns whether a row ID is not used by any row or identifier.
+	 */
+	bool isUnused(OOOutlineRowID anID)
+	{
+		return !rows.find(anID) && !names.find(anID);
+	}
+	public:
+	/**
+	 * Adds a row and returns its ID.  If the identifier is `nil` or it is a
+	 * generated identifier whose ID is already in use, the row is given a new
+	 * ID.  Other identifiers are stored so that they can be saved unmodified.
+	 */
+	OOOutlineRowID add(OOOutlineRow *aRow, NSString *anIdentifier)
+	{
+		OOOutlineRowID rowID = parse_row_identifier(anIdentifier);
+		if ((rowID != 0) && isUnused(rowID))
+		{
+			rows.insert(rowID, aRow);
+			return rowID;
+		}
+		do
+		{
+			rowID = next_row_id();
+		} while (!isUnused(rowID));
+		rows.insert(rowID, aRow);
+		if (anIdentifier && ![anIdentifier isEqualToString: row_identifier_string(rowID)])
+		{
+			const char *str = [anIdentifier UTF8String];
+			name n = { static_cast<uint32_t>(nameBuffer.size()),
+			           static_cast<uint32_t>(strlen(str)) };
+			nameBuffer.append(str, n.length);
+			names.insert(rowID, n);
+			if (hasIdsByName)
+			{
+				idsByName[str] = rowID;
+			}
+		}
+		return rowID;
+	}
+	/**
+	 * Removes a row, if it is the row with its ID.  Its identifier remains
+	 * available.
+	 */
+	void remove(OOOutlineRow *aRow, OOOutlineRowID anID)
+	{
+		if (row(anID) == aRow)
+		{
+			rows.erase(anID);
+		}
+	}
+	/**
+	 * Returns the row with the specified ID, or `nil` if there is no such row.
+	 */
+	OOOutlineRow *row(OOOutlineRowID anID)
+	{
+		OOOutlineRow *__unsafe_unretained *row = rows.find(anID);
+		return row ? *row : nil;
+	}
+	/**
+	 * Returns the row with the specified identifier string, or `nil` if there
+	 * is no such row.
+	 */
+	OOOutlineRow *row(NSString *anIdentifier)
+	{
+		if (!anIdentifier)
+		{
+			return nil;
+		}
+		if (!hasIdsByName)
+		{
+			names.for_each([&](OOOutlineRowID anID, name &n)
+				{
+					idsByName[nameBuffer.substr(n.offset, n.length)] = anID;
+				});
+			hasIdsByName = true;
+		}
+		auto i = idsByName.find([anIdentifier UTF8String]);
+		return row((i == idsByName.end()) ? parse_row_identifier(anIdentifier) : i->second);
+	}
+	/**
+	 * Returns the identifier string for a row ID.
+	 */
+	NSString *identifier(OOOutlineRowID anID)
+	{
+		if (name *n = names.find(anID))
+		{
+			return [[NSString alloc] initWithBytes: nameBuffer.data() + n->offset
+			                                length: n->length
+			                              encoding: NSUTF8StringEncoding];
+		}
+		return row_identifier_string(anID);
+	}
+	/**
+	 * Removes all rows and identifiers.
+	 */
+	void clear()
+	{
+		rows.clear();
+		names.clear();
+		nameBuffer.clear();
+		idsByName.clear();
+		hasIdsByName = false;
+	}
+};
+}
@@ -0,0 +1,172 @@
+/*-
+ * Copyright (c) 2017 David T. Chisnall
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/**
+ * This file contains the compact keys that rows are sorted by, and a sort
+ * that runs in parallel for large arrays.  Keys are extracted once per row,
+ * so sorting compares integers or arrays of characters rather than sending
+ * `-compare:` messages.
+ */
+
+#import <Foundation/Foundation.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+namespace {
+/**
+ * Sort key for a decimal number.  Comparing keys compares the numbers exactly,
+ * independently of how they are represented.
+ */
+struct decimal_key
+{
+	/**
+	 * The sign and order of magnitude of the number: 0 for zero, and otherwise
+	 * increasing with the number's order of magnitude for positive numbers
+	 * and decreasing for negative numbers.
+	 */
+	int32_t order;
+	/**
+	 * The digits of the mantissa, with trailing zeros added to make 38
+	 * digits, and inverted for negative numbers.
+	 */
+	unsigned __int128 digits;
+	bool operator<(const decimal_key &aKey) const
+	{
+		return (order < aKey.order) ||
+		       ((order == aKey.order) && (digits < aKey.digits));
+	}
+	bool operator==(const decimal_key &aKey) const
+	{
+		return (order == aKey.order) && (digits == aKey.digits);
+	}
+};
+
+/**
+ * Returns the sort key for a decimal number.
+ */
+inline decimal_key key_for_decimal(NSDecimal aNumber)
+{
+	// The largest number of decimal digits that always fits in the key.
+	constexpr int max_digits = 38;
+	NSDecimalCompact(&aNumber);
+	unsigned __int128 mantissa = 0;
+	for (unsigned i=aNumber._length ; i>0 ; i--)
+	{
+		mantissa = (mantissa << 16) | aNumber._mantissa[i-1];
+	}
+	if (mantissa == 0)
+	{
+		return { 0, 0 };
+	}
+	int digits = 0;
+	for (unsigned __int128 m = mantissa ; m != 0 ; m /= 10)
+	{
+		digits++;
+	}
+	int exponent = aNumber._exponent;
+	for ( ; digits > max_digits ; digits--, exponent++)
+	{
+		mantissa /= 10;
+	}
+	for (int i=digits ; i<max_digits ; i++)
+	{
+		mantissa *= 10;
+	}
+	// The number is in [10^(order-1), 10^order).  Exponents are in [-128,
+	// 127], so offsetting the order keeps it positive.
+	int32_t order = exponent + digits + 256;
+	if (aNumber._isNegative)
+	{
+		return { -order, ~mantissa };
+	}
+	return { order, mantissa };
+}
+
+/**
+ * Returns the sort key for a date: milliseconds since the UNIX epoch.
+ */
+inline int64_t key_for_date(NSDate *aDate)
+{
+	return static_cast<int64_t>(std::floor([aDate timeIntervalSince1970] * 1000));
+}
+
+/**
+ * Returns the collation key for a string.  Case, diacritics, and character
+ * widths are folded for the current locale, so that comparing the keys
+ * character by character orders strings as a person would expect.
+ */
+inline std::u16string collation_key(NSString *aString)
+{
+	NSString *folded = [aString stringByFoldingWithOptions: NSCaseInsensitiveSearch |
+	                                                        NSDiacriticInsensitiveSearch |
+	                                                        NSWidthInsensitiveSearch
+	                                                locale: [NSLocale currentLocale]];
+	std::u16string key([folded length], u'\0');
+	[folded getCharacters: reinterpret_cast<unichar*>(key.data())
+	                range: NSMakeRange(0, key.size())];
+	return key;
+}
+
+/**
+ * Sorts a vector.  Large vectors are split into pieces that are sorted
+ * concurrently and then merged, with the merges at each level also
+ * performed concurrently.  This is not stable, so elements that compare
+ * equal must be distinguished by their original index if the order matters.
+ */
+template<typename T>
+void parallel_sort(std::vector<T> &aVector)
+{
+	// Below this size, the cost of dispatching exceeds the time saved.
+	constexpr size_t serial_limit = 16384;
+	size_t count = aVector.size();
+	if (count < serial_limit)
+	{
+		std::sort(aVector.begin(), aVector.end());
+		return;
+	}
+	size_t pieces = std::min(static_cast<size_t>([[NSProcessInfo processInfo] activeProcessorCount]),
+	                         count / serial_limit);
+	size_t width = (count + pieces - 1) / pieces;
+	T *data = aVector.data();
+	auto *queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+	dispatch_apply(pieces, queue, ^(size_t i) {
+		std::sort(data + std::min(count, i * width), data + std::min(count, (i + 1) * width));
+	});
+	for ( ; width < count ; width *= 2)
+	{
+		size_t merges = (count + 2 * width - 1) / (2 * width);
+		dispatch_apply(merges, queue, ^(size_t i) {
+			size_t start = i * 2 * width;
+			size_t middle = std::min(count, start + width);
+			size_t end = std::min(count, start + 2 * width);
+			std::inplace_merge(data + start, data + middle, data + end);
+		});
+	}
+}
+}